@@ -0,0 +1,27 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef BOOT_H
+#define BOOT_H
+
+/**
+ * Brings the unit up once the managers are created and set. Every boot step declares what it depends on and is
+ * started as soon as that is done, so independent steps overlap; steps depending on one that failed are skipped.
+ * Returns when every step is done or skipped, logging the time to the provisioning portal and the whole boot.
+ */
+void boot_run();
+
+#endif // BOOT_H
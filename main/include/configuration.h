@@ -23,7 +23,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
-#define CONFIGURATION_VERSION 0
+// Stored layout: 0 is positional, 1 tag-length-value sections. See serialisation.h before bumping it.
+#define CONFIGURATION_VERSION 1
 
 #pragma pack(push, 1)
 
@@ -62,6 +63,9 @@ typedef struct
   connectivity_configuration_t con_config;
   system_settings_configuration_t sys_config;
   user_configuration_t user_config;
+  // Not serialised: block holding the members decoded from NVS, NULL when each member is its own allocation
+  void* arena;
+  size_t arena_size;
 } unit_configuration_t;
 
 #pragma pack(pop)
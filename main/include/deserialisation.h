@@ -18,8 +18,64 @@
 #define DESERIALISATION_H
 
 #include "configuration.h"
+#include <stdbool.h>
 #include <stdint.h>
 
-const uint8_t* deserialize_unit_configuration(unit_configuration_t* config, const uint8_t* buffer);
+// Bump allocator over a single block. Deserialisers given a NULL arena allocate each member on the heap.
+typedef struct
+{
+  uint8_t* next;
+  uint8_t* end;
+} config_arena_t;
+
+void config_arena_init(config_arena_t* arena, void* base, size_t size);
+
+// Every deserialiser reads no further than end, the first byte past the blob, and returns NULL when the blob is
+// shorter than its lengths say. Members decoded before the failure are left in place for the caller to free.
+
+// Layout of the single legacy blob and of the first sectioned configuration, positional fields without tags
+#define CONFIGURATION_VERSION_POSITIONAL 0
+
+// Deserialises a legacy blob into a single arena allocation, owned by config->arena
+const uint8_t* deserialize_unit_configuration(unit_configuration_t* config, const uint8_t* buffer, const uint8_t* end);
+
+// Positional sections, the legacy blob is their concatenation.
+// The connectivity header allocates the (zeroed) Wi-Fi settings array.
+const uint8_t* deserialize_connectivity_header(connectivity_configuration_t* config, const uint8_t* buffer,
+                                               const uint8_t* end, config_arena_t* arena);
+const uint8_t* deserialize_wifi_settings(wifi_settings_t* settings, const uint8_t* buffer, const uint8_t* end,
+                                         config_arena_t* arena);
+const uint8_t* deserialize_system_settings_configuration(system_settings_configuration_t* config, const uint8_t* buffer,
+                                                         const uint8_t* end);
+const uint8_t* deserialize_user_configuration(user_configuration_t* config, const uint8_t* buffer, const uint8_t* end,
+                                              config_arena_t* arena);
+
+// Section readers for one stored layout. They decode a section in place and return false when it is shorter than
+// its lengths say, which rejects the whole configuration: members decoded before the failure may point into the
+// section. Each string is moved down over its own length bytes and terminated there, so the members point into the
+// section, which has to outlive them; nothing is allocated. The connectivity header leaves the Wi-Fi settings array
+// to the caller, which sizes it with wifi_settings_count before any section is decoded.
+typedef struct
+{
+  uint8_t (*wifi_settings_count)(const uint8_t* section, size_t size);
+  bool (*connectivity_header)(connectivity_configuration_t* config, uint8_t* section, size_t size);
+  bool (*wifi_settings)(wifi_settings_t* settings, uint8_t* section, size_t size);
+  bool (*system_settings)(system_settings_configuration_t* config, uint8_t* section, size_t size);
+  bool (*user_configuration)(user_configuration_t* config, uint8_t* section, size_t size);
+} config_section_reader_t;
+
+// Reader for sections stored at version. Layouts newer than the firmware are tag-length-value as well and are read
+// with the current reader, skipping the tags it does not know.
+const config_section_reader_t* config_section_reader(uint8_t version);
+
+// Brings a configuration decoded at an older version up to CONFIGURATION_VERSION, in memory, by running the registered
+// migration steps in order. Returns false, at the last version reached, when a step is missing or fails.
+bool migrate_unit_configuration(unit_configuration_t* config);
+
+// Arena bytes a serialised section needs
+size_t calculate_unit_configuration_arena_size(const uint8_t* buffer, const uint8_t* end);
+size_t calculate_connectivity_header_arena_size(const uint8_t* buffer, const uint8_t* end);
+size_t calculate_wifi_settings_arena_size(const uint8_t* buffer, const uint8_t* end);
+size_t calculate_user_configuration_arena_size(const uint8_t* buffer, const uint8_t* end);
 
 #endif //DESERIALISATION_H
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef DNS_MESSAGE_H
+#define DNS_MESSAGE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define DNS_FLAG_QR 0x8000
+#define DNS_FLAG_OPCODE 0x7800
+#define DNS_FLAG_AA 0x0400
+#define DNS_FLAG_RD 0x0100
+#define DNS_RRTYPE_ANY 255
+#define DNS_MAX_QNAME_LEN 255
+#define DNS_MAX_LABEL_LEN 63
+
+#pragma pack(push, 1)
+
+typedef struct
+{
+  uint16_t id;
+  uint16_t flags;
+  uint16_t qdcount;
+  uint16_t ancount;
+  uint16_t nscount;
+  uint16_t arcount;
+} dns_header;
+
+typedef struct
+{
+  uint16_t qtype;
+  uint16_t qclass;
+} dns_question;
+
+#pragma pack(pop)
+
+// Length of the uncompressed QNAME at the start of name, root label included, or 0 when it is compressed, has a
+// label over 63 bytes, is longer than 255 bytes or runs past len. Pure, it depends on nothing but its arguments.
+size_t dns_qname_length(const uint8_t* name, size_t len);
+
+// Length of the header and the single question of the query in message, 0 when it is not a standard query with
+// exactly one well-formed question. Sets answer for A and ANY queries in class IN. Pure, like dns_qname_length.
+size_t dns_parse_question(const uint8_t* message, size_t len, bool* answer);
+
+#endif //DNS_MESSAGE_H
@@ -17,8 +17,22 @@
 #ifndef CAPTIVE_PORTAL_H
 #define CAPTIVE_PORTAL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct
+{
+  uint32_t queries; // Every datagram received on port 53
+  uint32_t answered;
+  uint32_t dropped; // Over the per-client rate limit
+  uint32_t malformed;
+} dns_redirect_stats_t;
+
+// Both block until the tcpip thread has run them, so neither may be called from that thread, e.g. a lwIP callback
 void start_dns_server();
 
 void stop_dns_server();
 
+void dns_redirect_get_stats(dns_redirect_stats_t* stats);
+
 #endif //CAPTIVE_PORTAL_H
@@ -0,0 +1,50 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef HTTPS_CONNECTION_H
+#define HTTPS_CONNECTION_H
+
+#include <esp_err.h>
+#include <esp_http_client.h>
+#include <stdbool.h>
+
+/**
+ * One HTTPS client shared by the version check and the OTA download. It is kept between requests, so a request to
+ * the same host reuses the open keep-alive connection, and a new connection resumes the saved TLS session instead of
+ * making a full handshake. Requests are serialised: acquire blocks until the previous holder has released.
+ *
+ * @param url Request URL, copied into the client
+ * @param handler Receives the client events of this request, may be NULL
+ * @param user_data Passed to handler in the event
+ * @return The GET client, or NULL if it could not be created
+ */
+esp_http_client_handle_t https_connection_acquire(const char* url, http_event_handle_cb handler, void* user_data);
+
+/**
+ * Ends the request. Headers set with https_connection_set_header() are removed. The connection is kept for the next
+ * request when reuse is true and closed otherwise, e.g. when a response was not read to its end.
+ */
+void https_connection_release(esp_http_client_handle_t client, bool reuse);
+
+// Sets a request header for the current request only, key must stay valid until the release
+esp_err_t https_connection_set_header(esp_http_client_handle_t client, const char* key, const char* value);
+
+// esp_http_client_open() and esp_http_client_perform() that reconnect once if the kept connection was closed by the
+// server in the meantime
+esp_err_t https_connection_open(esp_http_client_handle_t client);
+esp_err_t https_connection_perform(esp_http_client_handle_t client);
+
+#endif // HTTPS_CONNECTION_H
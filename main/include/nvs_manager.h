@@ -17,9 +17,12 @@
 #ifndef NVS_MANAGER_H
 #define NVS_MANAGER_H
 
+#include "state.h"
+
 #include <esp_err.h>
 #include <esp_bit_defs.h>
 #include <portmacro.h>
+#include <stddef.h>
 
 typedef enum
 {
@@ -40,7 +43,19 @@ typedef struct nvs_manager nvs_manager_t;
 
 nvs_manager_t* nvs_manager_create(UBaseType_t priority);
 void nvs_manager_destroy(nvs_manager_t *manager);
-esp_err_t nvs_manager_request_state(nvs_manager_t* manager, nvs_manager_state_request_t new_state);
+// Queued behind earlier requests, callback (may be NULL) is called with the outcome
+esp_err_t nvs_manager_request_state(nvs_manager_t* manager, nvs_manager_state_request_t new_state,
+                                    request_callback_t callback, void* user_data);
 void nvs_manager_wait_until_state(nvs_manager_t const * manager, nvs_manager_state_t wait_state);
 
+// Runtime state that is not part of the unit configuration (e.g. connection hints), kept in its own namespace.
+// Calls are synchronous and need the manager to be ready; storing identical data does not write to flash.
+esp_err_t nvs_manager_store_blob(nvs_manager_t const* manager, const char* key, const void* data, size_t size);
+esp_err_t nvs_manager_load_blob(nvs_manager_t const* manager, const char* key, void* data, size_t* size);
+esp_err_t nvs_manager_erase_blob(nvs_manager_t const* manager, const char* key);
+// Stores a copy of data, or erases key when data is NULL, on the manager's task after the requests queued before it.
+// Does not block, for event handlers and tasks that must not wait on flash; fails with ESP_ERR_TIMEOUT when the
+// queue is full.
+esp_err_t nvs_manager_post_blob(nvs_manager_t* manager, const char* key, const void* data, size_t size);
+
 #endif // NVS_MANAGER_H
@@ -17,10 +17,29 @@
 #ifndef OTA_DOWNLOAD_H
 #define OTA_DOWNLOAD_H
 
+#include "configuration.h"
+
+typedef enum
+{
+  OTA_IMAGE_RAW,
+  OTA_IMAGE_ZLIB, // Application image in a zlib stream, inflated while it is written
+} ota_image_encoding_t;
+
+// Image advertised by the version endpoint
+typedef struct
+{
+  ota_image_encoding_t encoding;
+  char url[MAX_URL_LENGTH];
+} ota_image_source_t;
+
+#include <esp_err.h>
+
 /**
- * Performs OTA Update
- * This task is expected to be called after confirming there is a new version available using `version_check`
+ * Performs OTA Update on the calling task, restarting into the new image when it succeeds
+ * Expected to be called after confirming there is a new version available using `version_check_run`
+ * @param source The image advertised by the version endpoint, or NULL for the raw image at the configured OTA URL
+ * @return ESP_OK when the firmware turned out to be up to date, otherwise why the update did not happen
  */
-void init_ota_task();
+esp_err_t ota_download_perform(const ota_image_source_t* source);
 
 #endif // OTA_DOWNLOAD_H
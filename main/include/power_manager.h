@@ -0,0 +1,50 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef POWER_MANAGER_H
+#define POWER_MANAGER_H
+
+#include <esp_bit_defs.h>
+#include <esp_err.h>
+#include <stdbool.h>
+
+typedef enum
+{
+  POWER_PROFILE_PERFORMANCE, // CPU held at its maximum, no modem sleep
+  POWER_PROFILE_STA_IDLE, // Associated and idle: frequency scaling, max modem sleep
+  POWER_PROFILE_IDLE, // Not associated: frequency scaling, min modem sleep so scans and connects stay quick
+} power_profile_t;
+
+// Work that needs the performance profile for as long as it runs
+typedef enum
+{
+  POWER_DEMAND_OTA = BIT0,
+} power_demand_t;
+
+/**
+ * Applies a power profile per Wi-Fi state, switching as the Wi-Fi manager and the AP's clients change: performance
+ * while a demand is held or a client is on the provisioning AP, STA idle once an IP is held, idle otherwise. Frequency
+ * scaling and light sleep need the IDF built with PM_ENABLE, without it only the modem is managed. With
+ * CONFIG_POWER_SUSPEND_PORTAL the HTTP and DNS servers only run while a client is associated to the AP.
+ */
+esp_err_t power_manager_start();
+
+// Raises or drops a demand, the profile follows on the calling task
+void power_manager_demand(power_demand_t demand, bool active);
+
+power_profile_t power_manager_get_profile();
+
+#endif // POWER_MANAGER_H
@@ -22,8 +22,46 @@
 
 #include "configuration.h"
 
-size_t serialize_unit_configuration(const unit_configuration_t* config, uint8_t* buffer);
+// Sections, stored separately so a change only rewrites its own section.
+// The connectivity header holds the Wi-Fi count and URLs, each Wi-Fi setting is its own section.
+//
+// A section is a sequence of tag-length-value records: a tag byte, a length byte and the value. Empty strings are
+// left out. Readers skip tags they do not know, so a field is added under a new tag without a layout change; tags
+// are never reused. Changes that old readers cannot skip bump CONFIGURATION_VERSION and register a migration, see
+// deserialisation.h.
+#define TLV_HEADER_SIZE 2
 
-size_t calculate_unit_configuration_size(const unit_configuration_t* config);
+typedef enum
+{
+  CON_TAG_WIFI_SETTINGS_COUNT = 1,
+  CON_TAG_OTA_URL = 2,
+  CON_TAG_VERSION_URL = 3
+} connectivity_tag_t;
+
+typedef enum
+{
+  WIFI_TAG_SSID = 1,
+  WIFI_TAG_PASSWORD = 2
+} wifi_settings_tag_t;
+
+typedef enum
+{
+  SYS_TAG_LOG_LEVEL = 1
+} system_settings_tag_t;
+
+typedef enum
+{
+  USR_TAG_UNIT_NAME = 1
+} user_configuration_tag_t;
+
+size_t serialize_connectivity_header(const connectivity_configuration_t* config, uint8_t* buffer);
+size_t serialize_wifi_settings(const wifi_settings_t* settings, uint8_t* buffer);
+size_t serialize_system_settings_configuration(const system_settings_configuration_t* config, uint8_t* buffer);
+size_t serialize_user_configuration(const user_configuration_t* config, uint8_t* buffer);
+
+size_t calculate_connectivity_header_size(const connectivity_configuration_t* config);
+size_t calculate_wifi_settings_size(const wifi_settings_t* settings);
+size_t calculate_system_settings_configuration_size(const system_settings_configuration_t* config);
+size_t calculate_user_configuration_size(const user_configuration_t* config);
 
 #endif //SERIALISATION_H
@@ -18,9 +18,14 @@
 #define STATE_H
 
 #include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
 
 #include "configuration.h"
 
+#include <esp_err.h>
+#include <stdbool.h>
+#include <stdint.h>
+
 // Shared group event handler
 
 typedef struct nvs_manager nvs_manager_t;
@@ -33,12 +38,61 @@ typedef struct {
     web_page_manager_t* web_page_manager;
 } managers_t;
 
+// Request bus: every manager's fsm task takes its requests from a queue, one message per request and in the order
+// they were posted, so requests made together are neither merged nor lost. The callback, when given, runs on the
+// manager's task once the request has been handled, and must not block.
+typedef void (*request_callback_t)(esp_err_t result, void* user_data);
+
+typedef struct {
+    uint32_t request; // The manager's request bits
+    request_callback_t callback;
+    void* user_data;
+} request_message_t;
+
+QueueHandle_t request_bus_create();
+
+void request_bus_delete(QueueHandle_t bus);
+
+// Fails with ESP_ERR_TIMEOUT, without calling the callback, when the queue stays full
+esp_err_t request_bus_post(QueueHandle_t bus, uint32_t request, request_callback_t callback, void* user_data);
+// Does not wait for room, for esp_timer callbacks and event handlers, which must not block
+esp_err_t request_bus_try_post(QueueHandle_t bus, uint32_t request, request_callback_t callback, void* user_data);
+
+// Blocks until a request arrives
+void request_bus_receive(QueueHandle_t bus, request_message_t* message);
+
+void request_bus_complete(const request_message_t* message, esp_err_t result);
+
 // Initialize the singleton (called once)
 void unit_config_init();
 
 // Acquire the singleton (blocks if another task is using it)
 unit_configuration_t* unit_config_acquire();
 
+// Get the last released configuration without taking the lock. The snapshot is immutable and stays valid,
+// even across later writes, until it is handed back with unit_config_snapshot_put
+const unit_configuration_t* unit_config_snapshot_get();
+
+void unit_config_snapshot_put(const unit_configuration_t* snapshot);
+
+// Ownership of configuration members. A member may live in the config's arena (see deserialisation.h) or be
+// allocated on its own; these helpers free or replace members without caring which. A NULL config frees
+// members that were never part of one.
+bool unit_config_owns(const unit_configuration_t* config, const void* member);
+
+void unit_config_free_member(const unit_configuration_t* config, void* member);
+
+// Replace a string member with a copy of value, updating its length
+esp_err_t unit_config_replace_string(unit_configuration_t* config, char** field, uint8_t* field_len, const char* value);
+
+void unit_config_free_wifi_settings(const unit_configuration_t* config, wifi_settings_t* wifi_settings, size_t count);
+
+// Takes ownership of wifi_settings, which must be heap allocated, freeing the settings it replaces
+void unit_config_replace_wifi_settings(unit_configuration_t* config, wifi_settings_t* wifi_settings, uint8_t count);
+
+// Free every member, and the arena, leaving the members empty
+void unit_config_free_members(unit_configuration_t* config);
+
 void set_nvs_manager(nvs_manager_t* nvs_manager);
 
 void set_wifi_manager(wifi_manager_t* wifi_manager);
@@ -51,7 +105,12 @@ wifi_manager_t* get_wifi_manager();
 
 web_page_manager_t* get_web_page_manager();
 
-// Release the singleton (must be called after acquire)
+// Mark the acquired singleton as changed by a direct write to its fields. The unit_config_replace_* and
+// unit_config_free_members helpers mark it themselves.
+void unit_config_mark_changed();
+
+// Release the singleton (must be called after acquire), publishing its contents as the current snapshot if they
+// were changed
 void unit_config_release();
 
 void managers_release();
@@ -0,0 +1,60 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef STATUS_EVENT_H
+#define STATUS_EVENT_H
+
+#include <esp_err.h>
+#include <esp_event.h>
+#include <esp_wifi_types.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Progress reported on the default event loop, for whoever shows it live, e.g. the portal's WebSocket.
+// Posting never blocks: an event the loop has no room for is dropped, the next one supersedes it.
+ESP_EVENT_DECLARE_BASE(STATUS_EVENT);
+
+typedef enum
+{
+  STATUS_EVENT_WIFI_STATE, // status_wifi_state_t
+  STATUS_EVENT_SCAN_DONE, // status_scan_done_t
+  STATUS_EVENT_OTA_PROGRESS // status_ota_progress_t
+} status_event_id_t;
+
+typedef struct
+{
+  uint32_t state; // wifi_manager_state_t bits
+} status_wifi_state_t;
+
+typedef struct
+{
+  uint16_t ap_count;
+  uint16_t matches; // APs of a configured network
+  int8_t best_rssi; // Of the selected AP, only valid with a match
+  char best_ssid[MAX_SSID_LEN + 1];
+} status_scan_done_t;
+
+typedef struct
+{
+  uint32_t bytes;
+  int64_t total; // -1 when the server sent no length
+  bool done;
+  esp_err_t err; // Outcome, once done
+} status_ota_progress_t;
+
+void status_event_post(status_event_id_t id, const void* data, size_t size);
+
+#endif //STATUS_EVENT_H
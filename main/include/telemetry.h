@@ -0,0 +1,52 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <freertos/FreeRTOS.h>
+#include <freertos/task.h>
+
+#include <cJSON.h>
+#include <esp_err.h>
+#include <stdint.h>
+
+typedef enum
+{
+  TELEMETRY_HTTP_GET, // Portal page, asset and status handlers
+  TELEMETRY_HTTP_POST, // Configuration and reboot handlers
+  TELEMETRY_NVS_COMMIT, // Writing the changed configuration sections to NVS
+  TELEMETRY_WIFI_SCAN, // esp_wifi_scan_start() to WIFI_EVENT_SCAN_DONE
+  TELEMETRY_OTA_READ, // Filling one OTA write buffer from the network
+  TELEMETRY_OTA_WRITE, // Writing, or inflating and writing, one OTA buffer to flash
+  TELEMETRY_METRIC_COUNT
+} telemetry_metric_t;
+
+// Adds a duration to the metric's histogram, safe from any task
+void telemetry_record(telemetry_metric_t metric, int64_t duration_us);
+
+// Tasks whose stack high-water mark, and CPU share where run time stats are enabled, are reported. A task has to
+// be unregistered before it is deleted.
+void telemetry_register_task(TaskHandle_t task);
+void telemetry_unregister_task(TaskHandle_t task);
+
+// Heap, registered tasks and histograms as a JSON object, to be freed with cJSON_Delete; NULL without memory
+cJSON* telemetry_to_json();
+
+// Starts the periodic log line, every CONFIG_TELEMETRY_LOG_INTERVAL_S, nothing when it is 0
+esp_err_t telemetry_start_logging();
+
+#endif // TELEMETRY_H
@@ -0,0 +1,30 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef UPDATE_SCHEDULER_H
+#define UPDATE_SCHEDULER_H
+
+#include <freertos/FreeRTOS.h>
+#include <esp_err.h>
+
+/**
+ * Starts the task that checks for new firmware every CONFIG_UPDATE_CHECK_INTERVAL_S, spread by a random jitter, and
+ * downloads it on the same task. Checks are held off while the station link is down or weak, or while a client is on
+ * the provisioning AP.
+ */
+esp_err_t update_scheduler_start(UBaseType_t priority);
+
+#endif // UPDATE_SCHEDULER_H
@@ -17,6 +17,16 @@
 #ifndef VERSION_CHECK_H
 #define VERSION_CHECK_H
 
-void init_version_checking_task();
+#include "ota_download.h"
+
+#include <esp_err.h>
+#include <stdbool.h>
+
+/**
+ * Asks the version endpoint for the current firmware version and compares it with the running one
+ * @param source Set to the compressed image when the endpoint advertises one, left as it is otherwise
+ * @param update_available Set when the server version differs from the running one
+ */
+esp_err_t version_check_run(ota_image_source_t* source, bool* update_available);
 
 #endif // VERSION_CHECK_H
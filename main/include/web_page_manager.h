@@ -17,6 +17,8 @@
 #ifndef WEB_PAGE_MANAGER_H
 #define WEB_PAGE_MANAGER_H
 
+#include "state.h"
+
 #include <esp_err.h>
 #include <esp_bit_defs.h>
 #include <portmacro.h>
@@ -41,7 +43,12 @@ typedef struct web_page_manager web_page_manager_t;
 
 web_page_manager_t* web_page_manager_create(UBaseType_t priority);
 void web_page_manager_destroy(web_page_manager_t *manager);
-esp_err_t web_page_manager_request_state(web_page_manager_t* manager, web_page_manager_state_request_t new_state);
+// Queued behind earlier requests, callback (may be NULL) is called with the outcome
+esp_err_t web_page_manager_request_state(web_page_manager_t* manager, web_page_manager_state_request_t new_state,
+                                         request_callback_t callback, void* user_data);
+// Same as web_page_manager_request_state() without waiting for room in the queue, for event handlers and timers
+esp_err_t web_page_manager_try_request_state(web_page_manager_t* manager, web_page_manager_state_request_t new_state,
+                                             request_callback_t callback, void* user_data);
 void web_page_manager_wait_until_state(web_page_manager_t const * manager, web_page_manager_state_t wait_state);
 
 /**
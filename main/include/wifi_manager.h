@@ -17,6 +17,8 @@
 #ifndef WIFI_MANAGER_H
 #define WIFI_MANAGER_H
 
+#include "state.h"
+
 #include <freertos/FreeRTOS.h>
 #include <esp_bit_defs.h>
 #include <portmacro.h>
@@ -40,7 +42,10 @@ typedef struct wifi_manager wifi_manager_t;
 
 wifi_manager_t* wifi_manager_create(UBaseType_t priority);
 void wifi_manager_destroy(wifi_manager_t* manager);
-esp_err_t wifi_manager_request_state(wifi_manager_t* manager, wifi_manager_state_request_t new_state);
+// Queued behind earlier requests, callback (may be NULL) is called with the outcome. STA and AP in one request
+// ask for both interfaces.
+esp_err_t wifi_manager_request_state(wifi_manager_t* manager, wifi_manager_state_request_t new_state,
+                                     request_callback_t callback, void* user_data);
 void wifi_manager_wait_until_state(wifi_manager_t const * manager, wifi_manager_state_t wifi_state);
 wifi_manager_state_t wifi_manager_get_state(wifi_manager_t const* manager);
 
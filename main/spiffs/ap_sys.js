@@ -12,4 +12,11 @@ async function loadContent() {
     document.addEventListener('click', event => {
         if (event.target.id === 'saveBtn') save();
     });
+
+    fetch('/dns_stats').then(r => r.json()).then(d => {
+        document.getElementById('dnsQueries').textContent = d.queries;
+        document.getElementById('dnsAnswered').textContent = d.answered;
+        document.getElementById('dnsDropped').textContent = d.dropped;
+        document.getElementById('dnsMalformed').textContent = d.malformed;
+    });
 }
\ No newline at end of file
@@ -0,0 +1,205 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "boot.h"
+#include "nvs_manager.h"
+#include "power_manager.h"
+#include "state.h"
+#include "update_scheduler.h"
+#include "web_page_manager.h"
+#include "wifi_manager.h"
+
+#include <esp_event.h>
+#include <esp_log.h>
+#include <esp_netif.h>
+#include <esp_timer.h>
+#include <freertos/event_groups.h>
+
+static const char* TAG = "BOOT";
+
+typedef enum
+{
+  BOOT_STEP_NVS,
+  BOOT_STEP_WEB_PAGE,
+  BOOT_STEP_WIFI_AP,
+  BOOT_STEP_UPDATE_SCHEDULER,
+  BOOT_STEP_POWER,
+  BOOT_STEP_COUNT
+} boot_step_id_t;
+
+#define BOOT_STEP_BIT(step) (1U << (step))
+#define BOOT_ALL_STEPS (BOOT_STEP_BIT(BOOT_STEP_COUNT) - 1)
+#define BOOT_PORTAL_STEPS (BOOT_STEP_BIT(BOOT_STEP_WEB_PAGE) | BOOT_STEP_BIT(BOOT_STEP_WIFI_AP))
+
+typedef struct
+{
+  const char* name;
+  uint32_t depends; // Steps that have to be done first
+  bool async; // Done when the manager calls back, otherwise when start returns; only async steps start on callbacks
+  esp_err_t (*start)(boot_step_id_t step);
+  int64_t started_us;
+} boot_step_t;
+
+static esp_err_t start_nvs(boot_step_id_t step);
+static esp_err_t start_web_page(boot_step_id_t step);
+static esp_err_t start_wifi_ap(boot_step_id_t step);
+static esp_err_t start_update_scheduler(boot_step_id_t step);
+static esp_err_t start_power(boot_step_id_t step);
+static void request_done(esp_err_t result, void* user_data);
+static void step_done(boot_step_id_t step, esp_err_t result);
+static void start_ready_steps(bool on_boot_task);
+static void ip_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+
+// Listed in the order ready steps are started, asynchronous ones first so they run while synchronous ones block
+static boot_step_t steps[BOOT_STEP_COUNT] = {
+  [BOOT_STEP_NVS] = {.name = "NVS", .depends = 0, .async = true, .start = start_nvs},
+  // The DNS redirect answers with the AP's address and the portal is only reachable through the AP
+  [BOOT_STEP_WEB_PAGE] = {.name = "Web-page", .depends = BOOT_STEP_BIT(BOOT_STEP_WIFI_AP), .async = true,
+                          .start = start_web_page},
+  // Wi-Fi keeps its calibration data in NVS
+  [BOOT_STEP_WIFI_AP] = {.name = "Wi-Fi AP", .depends = BOOT_STEP_BIT(BOOT_STEP_NVS), .async = true,
+                         .start = start_wifi_ap},
+  [BOOT_STEP_UPDATE_SCHEDULER] = {.name = "Update scheduler",
+                                  .depends = BOOT_STEP_BIT(BOOT_STEP_NVS) | BOOT_STEP_BIT(BOOT_STEP_WIFI_AP),
+                                  .async = false, .start = start_update_scheduler},
+  // Suspending the portal has to wait until it is up
+  [BOOT_STEP_POWER] = {.name = "Power", .depends = BOOT_PORTAL_STEPS, .async = false, .start = start_power},
+};
+
+static EventGroupHandle_t boot_event_group = NULL; // A bit per step done or skipped
+static portMUX_TYPE boot_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t started_steps = 0;
+static uint32_t failed_steps = 0;
+static bool portal_logged = false;
+static int64_t boot_started_us = 0;
+
+static esp_err_t start_nvs(const boot_step_id_t step) {
+  nvs_manager_t* nvs_manager = get_nvs_manager();
+  const esp_err_t err = nvs_manager_request_state(nvs_manager, NVS_STATE_READY_REQUEST, request_done, (void*)(uintptr_t)step);
+  managers_release();
+  return err;
+}
+
+static esp_err_t start_web_page(const boot_step_id_t step) {
+  web_page_manager_t* web_page_manager = get_web_page_manager();
+  const esp_err_t err = web_page_manager_request_state(
+    web_page_manager, WEB_PAGE_STATE_SERVING_REQUEST | WEB_PAGE_STATE_DNS_SERVER_REQUEST, request_done, (void*)(uintptr_t)step);
+  managers_release();
+  return err;
+}
+
+static esp_err_t start_wifi_ap(const boot_step_id_t step) {
+  wifi_manager_t* wifi_manager = get_wifi_manager();
+  const esp_err_t err = wifi_manager_request_state(wifi_manager, WIFI_MANAGER_STATE_AP_REQUEST, request_done,
+                                                   (void*)(uintptr_t)step);
+  managers_release();
+  return err;
+}
+
+static esp_err_t start_update_scheduler(const boot_step_id_t step) {
+  return update_scheduler_start(OTA_UPDATE_P);
+}
+
+static esp_err_t start_power(const boot_step_id_t step) {
+  return power_manager_start();
+}
+
+// Runs on the manager's task
+static void request_done(const esp_err_t result, void* user_data) {
+  step_done((boot_step_id_t)(uintptr_t)user_data, result);
+  start_ready_steps(false);
+}
+
+static void step_done(const boot_step_id_t step, const esp_err_t result) {
+  const int64_t now_us = esp_timer_get_time();
+  if (result == ESP_OK) {
+    ESP_LOGI(TAG, "%s done in %lld ms", steps[step].name, (now_us - steps[step].started_us) / 1000);
+  } else {
+    ESP_LOGE(TAG, "%s failed: %s", steps[step].name, esp_err_to_name(result));
+  }
+
+  taskENTER_CRITICAL(&boot_lock);
+  if (result != ESP_OK) failed_steps |= BOOT_STEP_BIT(step);
+  const EventBits_t done = xEventGroupGetBits(boot_event_group) | BOOT_STEP_BIT(step);
+  const bool portal_up = !portal_logged && (done & BOOT_PORTAL_STEPS) == BOOT_PORTAL_STEPS &&
+    (failed_steps & BOOT_PORTAL_STEPS) == 0;
+  if (portal_up) portal_logged = true;
+  taskEXIT_CRITICAL(&boot_lock);
+
+  if (portal_up) ESP_LOGI(TAG, "Provisioning portal up %lld ms after boot started", (now_us - boot_started_us) / 1000);
+  xEventGroupSetBits(boot_event_group, BOOT_STEP_BIT(step));
+}
+
+// Synchronous steps only start on the boot task, a manager's task is not kept from its own requests
+static void start_ready_steps(const bool on_boot_task) {
+  for (int step = 0; step < BOOT_STEP_COUNT; step++) {
+    boot_step_t* boot_step = &steps[step];
+    const EventBits_t done = xEventGroupGetBits(boot_event_group);
+
+    taskENTER_CRITICAL(&boot_lock);
+    const bool ready = (started_steps & BOOT_STEP_BIT(step)) == 0 && (done & boot_step->depends) == boot_step->depends &&
+      (boot_step->async || on_boot_task);
+    const bool skip = ready && (failed_steps & boot_step->depends) != 0;
+    if (ready) started_steps |= BOOT_STEP_BIT(step);
+    if (skip) failed_steps |= BOOT_STEP_BIT(step);
+    taskEXIT_CRITICAL(&boot_lock);
+    if (!ready) continue;
+
+    if (skip) {
+      ESP_LOGW(TAG, "%s skipped, a step it depends on failed", boot_step->name);
+      xEventGroupSetBits(boot_event_group, BOOT_STEP_BIT(step));
+      continue;
+    }
+
+    boot_step->started_us = esp_timer_get_time();
+    ESP_LOGI(TAG, "Starting %s", boot_step->name);
+    const esp_err_t err = boot_step->start((boot_step_id_t)step);
+    if (!boot_step->async || err != ESP_OK) step_done((boot_step_id_t)step, err);
+  }
+}
+
+// Logs once how long it took to get an address, whenever the station is asked to connect
+static void ip_event_handler(void* arg, esp_event_base_t event_base, const int32_t event_id, void* event_data) {
+  static bool ip_logged = false;
+  if (event_id != IP_EVENT_STA_GOT_IP || ip_logged) return;
+
+  ip_logged = true;
+  ESP_LOGI(TAG, "Station got an IP %lld ms after boot started", (esp_timer_get_time() - boot_started_us) / 1000);
+}
+
+void boot_run() {
+  boot_started_us = esp_timer_get_time();
+  boot_event_group = xEventGroupCreate();
+  if (boot_event_group == NULL) {
+    ESP_LOGE(TAG, "Failed to create boot event group");
+    abort();
+  }
+
+  // The default event loop is created with the Wi-Fi manager
+  esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, &ip_event_handler, NULL, NULL);
+
+  for (;;) {
+    start_ready_steps(true);
+
+    const EventBits_t done = xEventGroupGetBits(boot_event_group) & BOOT_ALL_STEPS;
+    if (done == BOOT_ALL_STEPS) break;
+    // Wakes on whichever step finishes next
+    xEventGroupWaitBits(boot_event_group, BOOT_ALL_STEPS & ~done, pdFALSE, pdFALSE, portMAX_DELAY);
+  }
+
+  ESP_LOGI(TAG, "Boot done in %lld ms%s", (esp_timer_get_time() - boot_started_us) / 1000,
+           failed_steps != 0 ? ", with failures" : "");
+}
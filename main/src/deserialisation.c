@@ -15,117 +15,471 @@
  */
 
 #include "deserialisation.h"
+#include "serialisation.h"
 
 #include <esp_log.h>
+#include <stdlib.h>
 #include <string.h>
 
 static const char* TAG = "Deserialisation";
 
-static const uint8_t* deserialize_block(const uint8_t* buffer, void* data, size_t size);
+typedef struct
+{
+  uint8_t tag;
+  uint8_t len;
+  uint8_t* start; // First byte of the record, a string value is moved here
+  const uint8_t* value;
+} tlv_record_t;
 
-const uint8_t* deserialize_wifi_settings(wifi_settings_t* settings, const uint8_t* buffer);
-const uint8_t* deserialize_connectivity_configuration(connectivity_configuration_t* config, const uint8_t* buffer);
-const uint8_t* deserialize_system_settings_configuration(system_settings_configuration_t* config, const uint8_t* buffer);
-const uint8_t* deserialize_user_configuration(user_configuration_t* config, const uint8_t* buffer);
+// A migration step brings a configuration decoded at version from up to from + 1. Steps that only change the stored
+// layout have nothing to do in memory, the section reader for the old version already decoded it: migrate is NULL.
+typedef struct
+{
+  uint8_t from;
+  bool (*migrate)(unit_configuration_t* config);
+} config_migration_t;
+
+static const uint8_t* deserialize_block(const uint8_t* buffer, const uint8_t* end, void* data, size_t size);
+static void* arena_alloc(config_arena_t* arena, size_t size);
+static const uint8_t* deserialize_string(const uint8_t* buffer, const uint8_t* end, void* str, size_t len,
+                                         config_arena_t* arena);
+static bool view_strings(uint8_t* section, size_t size, size_t header_len, const uint8_t lens[], char* strings[],
+                         size_t count);
+
+static uint8_t positional_wifi_settings_count(const uint8_t* section, size_t size);
+static bool positional_connectivity_header(connectivity_configuration_t* config, uint8_t* section, size_t size);
+static bool positional_wifi_settings(wifi_settings_t* settings, uint8_t* section, size_t size);
+static bool positional_system_settings(system_settings_configuration_t* config, uint8_t* section, size_t size);
+static bool positional_user_configuration(user_configuration_t* config, uint8_t* section, size_t size);
+
+static const uint8_t* tlv_next(const uint8_t* ptr, const uint8_t* end, tlv_record_t* record);
+static char* tlv_view_string(const tlv_record_t* record, uint8_t* len);
+static uint32_t tlv_uint(const tlv_record_t* record);
+static uint8_t tlv_wifi_settings_count(const uint8_t* section, size_t size);
+static bool tlv_connectivity_header(connectivity_configuration_t* config, uint8_t* section, size_t size);
+static bool tlv_wifi_settings(wifi_settings_t* settings, uint8_t* section, size_t size);
+static bool tlv_system_settings(system_settings_configuration_t* config, uint8_t* section, size_t size);
+static bool tlv_user_configuration(user_configuration_t* config, uint8_t* section, size_t size);
+
+const uint8_t* deserialize_connectivity_configuration(connectivity_configuration_t* config, const uint8_t* buffer,
+                                                      const uint8_t* end, config_arena_t* arena);
+
+static const config_migration_t migrations[] = {
+  {CONFIGURATION_VERSION_POSITIONAL, NULL}, // Positional sections to tag-length-value records
+};
+
+static const config_section_reader_t positional_reader = {
+  .wifi_settings_count = positional_wifi_settings_count,
+  .connectivity_header = positional_connectivity_header,
+  .wifi_settings = positional_wifi_settings,
+  .system_settings = positional_system_settings,
+  .user_configuration = positional_user_configuration
+};
+
+static const config_section_reader_t tlv_reader = {
+  .wifi_settings_count = tlv_wifi_settings_count,
+  .connectivity_header = tlv_connectivity_header,
+  .wifi_settings = tlv_wifi_settings,
+  .system_settings = tlv_system_settings,
+  .user_configuration = tlv_user_configuration
+};
+
+// Every read is checked against end, a truncated or corrupt blob fails with NULL instead of being read past.
+// A NULL buffer, from an earlier failed read, fails as well so calls can be chained.
+static const uint8_t* deserialize_block(const uint8_t* buffer, const uint8_t* end, void* data, const size_t size) {
+  if (buffer == NULL || buffer > end || (size_t)(end - buffer) < size) return NULL;
 
-static const uint8_t* deserialize_block(const uint8_t* buffer, void* data, size_t size) {
   memcpy(data, buffer, size);
   return buffer + size;
 }
 
-const uint8_t* deserialize_wifi_settings(wifi_settings_t* settings, const uint8_t* buffer) {
-  const uint8_t* ptr = buffer;
+void config_arena_init(config_arena_t* arena, void* base, const size_t size) {
+  arena->next = base;
+  arena->end = (uint8_t*)base + size;
+}
 
-  ptr = deserialize_block(ptr, &settings->ssid_len, sizeof(settings->ssid_len));
-  ptr = deserialize_block(ptr, &settings->password_len, sizeof(settings->password_len));
+// Zeroed memory from the arena, or from the heap when there is no arena
+static void* arena_alloc(config_arena_t* arena, const size_t size) {
+  if (arena == NULL) return calloc(size, 1);
 
-  if (settings->ssid_len > 0) {
-    settings->ssid = calloc(settings->ssid_len + 1, 1);
-    ptr = deserialize_block(ptr, settings->ssid, settings->ssid_len);
-  } else {
-    settings->ssid = NULL;
+  if ((size_t)(arena->end - arena->next) < size) {
+    ESP_LOGE(TAG, "Arena exhausted, %u bytes requested", (unsigned)size);
+    return NULL;
   }
 
-  if (settings->password_len > 0) {
-    settings->password = calloc(settings->password_len + 1, 1);
-    ptr = deserialize_block(ptr, settings->password, settings->password_len);
-  } else {
-    settings->password = NULL;
-  }
+  void* block = arena->next;
+  arena->next += size;
+  memset(block, 0, size);
+  return block;
+}
 
+// str is a char* member of a packed struct, it may be misaligned and is written with memcpy
+static const uint8_t* deserialize_string(const uint8_t* buffer, const uint8_t* end, void* str, const size_t len,
+                                         config_arena_t* arena) {
+  char* value = NULL;
+  const uint8_t* ptr = NULL;
+  if (buffer != NULL && buffer <= end && (size_t)(end - buffer) >= len) {
+    if (len == 0) {
+      ptr = buffer;
+    } else if ((value = arena_alloc(arena, len + 1)) != NULL) {
+      memcpy(value, buffer, len);
+      ptr = buffer + len;
+    }
+  }
+  memcpy(str, &value, sizeof(value));
   return ptr;
 }
 
-const uint8_t* deserialize_connectivity_configuration(connectivity_configuration_t* config, const uint8_t* buffer) {
-  const uint8_t* ptr = buffer;
+// The count strings follow a header_len byte header, which holds at least their count lengths. Writing string i and
+// its terminator ends before the first byte of string i + 1, so each is moved down in place without a scratch buffer.
+// The strings come back through an aligned local array: the configuration structs are packed, a store through a
+// pointer to one of their members would be misaligned, which faults on Xtensa.
+static bool view_strings(uint8_t* section, const size_t size, const size_t header_len, const uint8_t lens[],
+                         char* strings[], const size_t count) {
+  size_t needed = header_len;
+  for (size_t i = 0; i < count; i++) needed += lens[i];
+  if (section == NULL || size < needed) return false;
 
-  ptr = deserialize_block(ptr, &config->wifi_settings_count, sizeof(config->wifi_settings_count));
-  ptr = deserialize_block(ptr, &config->ota_url_len, sizeof(config->ota_url_len));
-  ptr = deserialize_block(ptr, &config->version_url_len, sizeof(config->version_url_len));
+  const uint8_t* src = section + header_len;
+  uint8_t* dst = section;
+  for (size_t i = 0; i < count; i++) {
+    strings[i] = NULL;
+    if (lens[i] == 0) continue;
 
-  if (config->ota_url_len > 0) {
-    config->ota_url = malloc(config->ota_url_len);
-    ptr = deserialize_block(ptr, config->ota_url, config->ota_url_len);
-  } else {
-    config->ota_url = NULL;
+    memmove(dst, src, lens[i]);
+    dst[lens[i]] = '\0';
+    strings[i] = (char*)dst;
+    dst += lens[i] + 1;
+    src += lens[i];
   }
+  return true;
+}
 
-  if (config->version_url_len > 0) {
-    config->version_url = malloc(config->version_url_len);
-    ptr = deserialize_block(ptr, config->version_url, config->version_url_len);
-  } else {
-    config->version_url = NULL;
+static bool positional_connectivity_header(connectivity_configuration_t* config, uint8_t* section, const size_t size) {
+  if (section == NULL || size < 3) return false;
+
+  const uint8_t lens[] = {section[1], section[2]};
+  char* strings[2];
+  const uint8_t wifi_settings_count = section[0];
+  if (!view_strings(section, size, 3, lens, strings, 2)) return false;
+
+  config->wifi_settings_count = wifi_settings_count;
+  config->ota_url = strings[0];
+  config->version_url = strings[1];
+  config->ota_url_len = lens[0];
+  config->version_url_len = lens[1];
+  return true;
+}
+
+static bool positional_wifi_settings(wifi_settings_t* settings, uint8_t* section, const size_t size) {
+  if (section == NULL || size < 2) return false;
+
+  const uint8_t lens[] = {section[0], section[1]};
+  char* strings[2];
+  if (!view_strings(section, size, 2, lens, strings, 2)) return false;
+
+  settings->ssid = strings[0];
+  settings->password = strings[1];
+  settings->ssid_len = lens[0];
+  settings->password_len = lens[1];
+  return true;
+}
+
+static bool positional_user_configuration(user_configuration_t* config, uint8_t* section, const size_t size) {
+  if (section == NULL || size < 1) return false;
+
+  const uint8_t lens[] = {section[0]};
+  char* strings[1];
+  if (!view_strings(section, size, 1, lens, strings, 1)) return false;
+
+  config->unit_name = strings[0];
+  config->unit_name_len = lens[0];
+  return true;
+}
+
+static uint8_t positional_wifi_settings_count(const uint8_t* section, const size_t size) {
+  return size > 0 ? section[0] : 0;
+}
+
+static bool positional_system_settings(system_settings_configuration_t* config, uint8_t* section, const size_t size) {
+  return deserialize_system_settings_configuration(config, section, section + size) != NULL;
+}
+
+// Tag-length-value sections, see serialisation.h. Returns the next record, NULL when this one runs past end.
+static const uint8_t* tlv_next(const uint8_t* ptr, const uint8_t* end, tlv_record_t* record) {
+  if (end - ptr < TLV_HEADER_SIZE || (size_t)(end - ptr) - TLV_HEADER_SIZE < ptr[1]) return NULL;
+
+  record->tag = ptr[0];
+  record->len = ptr[1];
+  record->start = (uint8_t*)ptr;
+  record->value = ptr + TLV_HEADER_SIZE;
+  return record->value + record->len;
+}
+
+// Moves the value to the start of its record and terminates it there, inside the record's own header bytes.
+// The next record is untouched.
+static char* tlv_view_string(const tlv_record_t* record, uint8_t* len) {
+  *len = record->len;
+  if (record->len == 0) return NULL;
+
+  memmove(record->start, record->value, record->len);
+  record->start[record->len] = '\0';
+  return (char*)record->start;
+}
+
+// Little-endian, a value wider than four bytes is read by its low bytes
+static uint32_t tlv_uint(const tlv_record_t* record) {
+  uint32_t value = 0;
+  for (uint8_t i = 0; i < record->len && i < sizeof(value); i++) {
+    value |= (uint32_t)record->value[i] << (8 * i);
   }
+  return value;
+}
+
+static uint8_t tlv_wifi_settings_count(const uint8_t* section, const size_t size) {
+  const uint8_t* end = section + size;
+  tlv_record_t record;
+  for (const uint8_t* ptr = section; ptr != NULL && ptr < end;) {
+    ptr = tlv_next(ptr, end, &record);
+    if (ptr != NULL && record.tag == CON_TAG_WIFI_SETTINGS_COUNT) return (uint8_t)tlv_uint(&record);
+  }
+  return 0;
+}
+
+// Records with tags the reader does not know are skipped, a missing record leaves its member zeroed
+static bool tlv_connectivity_header(connectivity_configuration_t* config, uint8_t* section, const size_t size) {
+  const uint8_t* end = section + size;
+  tlv_record_t record;
+  for (const uint8_t* ptr = section; ptr < end;) {
+    ptr = tlv_next(ptr, end, &record);
+    if (ptr == NULL) return false;
+
+    switch (record.tag) {
+    case CON_TAG_WIFI_SETTINGS_COUNT: config->wifi_settings_count = (uint8_t)tlv_uint(&record);
+      break;
+    case CON_TAG_OTA_URL: config->ota_url = tlv_view_string(&record, &config->ota_url_len);
+      break;
+    case CON_TAG_VERSION_URL: config->version_url = tlv_view_string(&record, &config->version_url_len);
+      break;
+    default: break;
+    }
+  }
+  return true;
+}
+
+static bool tlv_wifi_settings(wifi_settings_t* settings, uint8_t* section, const size_t size) {
+  const uint8_t* end = section + size;
+  tlv_record_t record;
+  for (const uint8_t* ptr = section; ptr < end;) {
+    ptr = tlv_next(ptr, end, &record);
+    if (ptr == NULL) return false;
+
+    switch (record.tag) {
+    case WIFI_TAG_SSID: settings->ssid = tlv_view_string(&record, &settings->ssid_len);
+      break;
+    case WIFI_TAG_PASSWORD: settings->password = tlv_view_string(&record, &settings->password_len);
+      break;
+    default: break;
+    }
+  }
+  return true;
+}
+
+static bool tlv_system_settings(system_settings_configuration_t* config, uint8_t* section, const size_t size) {
+  const uint8_t* end = section + size;
+  tlv_record_t record;
+  for (const uint8_t* ptr = section; ptr < end;) {
+    ptr = tlv_next(ptr, end, &record);
+    if (ptr == NULL) return false;
 
+    if (record.tag == SYS_TAG_LOG_LEVEL) config->log_level = (esp_log_level_t)tlv_uint(&record);
+  }
+  return true;
+}
+
+static bool tlv_user_configuration(user_configuration_t* config, uint8_t* section, const size_t size) {
+  const uint8_t* end = section + size;
+  tlv_record_t record;
+  for (const uint8_t* ptr = section; ptr < end;) {
+    ptr = tlv_next(ptr, end, &record);
+    if (ptr == NULL) return false;
+
+    if (record.tag == USR_TAG_UNIT_NAME) config->unit_name = tlv_view_string(&record, &config->unit_name_len);
+  }
+  return true;
+}
+
+const config_section_reader_t* config_section_reader(const uint8_t version) {
+  return version == CONFIGURATION_VERSION_POSITIONAL ? &positional_reader : &tlv_reader;
+}
+
+bool migrate_unit_configuration(unit_configuration_t* config) {
+  while (config->configuration_version < CONFIGURATION_VERSION) {
+    const config_migration_t* step = NULL;
+    for (size_t i = 0; i < sizeof(migrations) / sizeof(migrations[0]); i++) {
+      if (migrations[i].from == config->configuration_version) step = &migrations[i];
+    }
+
+    if (step == NULL || (step->migrate != NULL && !step->migrate(config))) {
+      ESP_LOGE(TAG, "No migration from configuration version %d", config->configuration_version);
+      return false;
+    }
+    config->configuration_version++;
+  }
+  return true;
+}
+
+// Arena sizes, computed from the serialised lengths: every string is stored with its terminator. A section too
+// short for its own header needs no arena, its deserialisation fails.
+size_t calculate_connectivity_header_arena_size(const uint8_t* buffer, const uint8_t* end) {
+  if ((size_t)(end - buffer) < 3) return 0;
+  const uint8_t wifi_settings_count = buffer[0];
+  const uint8_t ota_url_len = buffer[1];
+  const uint8_t version_url_len = buffer[2];
+
+  return wifi_settings_count * sizeof(wifi_settings_t) + (ota_url_len ? ota_url_len + 1 : 0) +
+    (version_url_len ? version_url_len + 1 : 0);
+}
+
+size_t calculate_wifi_settings_arena_size(const uint8_t* buffer, const uint8_t* end) {
+  if ((size_t)(end - buffer) < 2) return 0;
+  const uint8_t ssid_len = buffer[0];
+  const uint8_t password_len = buffer[1];
+
+  return (ssid_len ? ssid_len + 1 : 0) + (password_len ? password_len + 1 : 0);
+}
+
+size_t calculate_user_configuration_arena_size(const uint8_t* buffer, const uint8_t* end) {
+  if (end - buffer < 1) return 0;
+  const uint8_t unit_name_len = buffer[0];
+
+  return unit_name_len ? unit_name_len + 1 : 0;
+}
+
+// Stops at the first section that runs past end, the deserialisation that follows fails there too
+size_t calculate_unit_configuration_arena_size(const uint8_t* buffer, const uint8_t* end) {
+  const uint8_t* ptr = buffer + sizeof(uint8_t); // configuration_version
+  if (ptr > end || end - ptr < 3) return 0;
+
+  size_t size = calculate_connectivity_header_arena_size(ptr, end);
+  const uint8_t wifi_settings_count = ptr[0];
+  const size_t header_size = 3 + ptr[1] + ptr[2];
+  if ((size_t)(end - ptr) < header_size) return size;
+  ptr += header_size;
+
+  for (uint8_t i = 0; i < wifi_settings_count; i++) {
+    if (end - ptr < 2 || (size_t)(end - ptr) < 2U + ptr[0] + ptr[1]) return size;
+    size += calculate_wifi_settings_arena_size(ptr, end);
+    ptr += 2 + ptr[0] + ptr[1];
+  }
+
+  if ((size_t)(end - ptr) < sizeof(esp_log_level_t)) return size;
+  ptr += sizeof(esp_log_level_t);
+  size += calculate_user_configuration_arena_size(ptr, end);
+
+  return size;
+}
+
+const uint8_t* deserialize_wifi_settings(wifi_settings_t* settings, const uint8_t* buffer, const uint8_t* end,
+                                         config_arena_t* arena) {
+  const uint8_t* ptr = buffer;
+
+  ptr = deserialize_block(ptr, end, &settings->ssid_len, sizeof(settings->ssid_len));
+  ptr = deserialize_block(ptr, end, &settings->password_len, sizeof(settings->password_len));
+  if (ptr == NULL) return NULL;
+
+  ptr = deserialize_string(ptr, end, &settings->ssid, settings->ssid_len, arena);
+  ptr = deserialize_string(ptr, end, &settings->password, settings->password_len, arena);
+
+  return ptr;
+}
+
+const uint8_t* deserialize_connectivity_header(connectivity_configuration_t* config, const uint8_t* buffer,
+                                               const uint8_t* end, config_arena_t* arena) {
+  const uint8_t* ptr = buffer;
+
+  ptr = deserialize_block(ptr, end, &config->wifi_settings_count, sizeof(config->wifi_settings_count));
+  ptr = deserialize_block(ptr, end, &config->ota_url_len, sizeof(config->ota_url_len));
+  ptr = deserialize_block(ptr, end, &config->version_url_len, sizeof(config->version_url_len));
+  if (ptr == NULL) {
+    config->wifi_settings_count = 0;
+    config->wifi_settings = NULL;
+    return NULL;
+  }
+
+  // The settings themselves are filled in from their own sections
   if (config->wifi_settings_count > 0) {
-    config->wifi_settings = malloc(config->wifi_settings_count * sizeof(wifi_settings_t));
-    for (uint8_t i = 0; i < config->wifi_settings_count; i++) {
-      ptr = deserialize_wifi_settings(&config->wifi_settings[i], ptr);
+    config->wifi_settings = arena_alloc(arena, config->wifi_settings_count * sizeof(wifi_settings_t));
+    if (config->wifi_settings == NULL) {
+      config->wifi_settings_count = 0;
+      return NULL;
     }
   } else {
     config->wifi_settings = NULL;
   }
 
+  ptr = deserialize_string(ptr, end, &config->ota_url, config->ota_url_len, arena);
+  ptr = deserialize_string(ptr, end, &config->version_url, config->version_url_len, arena);
+
   return ptr;
 }
 
-const uint8_t* deserialize_system_settings_configuration(system_settings_configuration_t* config, const uint8_t* buffer) {
-  const uint8_t* ptr = buffer;
+const uint8_t* deserialize_connectivity_configuration(connectivity_configuration_t* config, const uint8_t* buffer,
+                                                      const uint8_t* end, config_arena_t* arena) {
+  const uint8_t* ptr = deserialize_connectivity_header(config, buffer, end, arena);
 
-  ptr = deserialize_block(ptr, &config->log_level, sizeof(config->log_level));
+  for (uint8_t i = 0; ptr != NULL && i < config->wifi_settings_count; i++) {
+    ptr = deserialize_wifi_settings(&config->wifi_settings[i], ptr, end, arena);
+  }
 
   return ptr;
 }
 
-const uint8_t* deserialize_user_configuration(user_configuration_t* config, const uint8_t* buffer) {
+const uint8_t* deserialize_system_settings_configuration(system_settings_configuration_t* config, const uint8_t* buffer,
+                                                         const uint8_t* end) {
   const uint8_t* ptr = buffer;
 
-  ptr = deserialize_block(ptr, &config->unit_name_len, sizeof(config->unit_name_len));
+  ptr = deserialize_block(ptr, end, &config->log_level, sizeof(config->log_level));
 
-  if (config->unit_name_len > 0) {
-    config->unit_name = calloc(config->unit_name_len, 1);
-    ptr = deserialize_block(ptr, config->unit_name, config->unit_name_len);
-  } else {
-    config->unit_name = NULL;
-  }
+  return ptr;
+}
+
+const uint8_t* deserialize_user_configuration(user_configuration_t* config, const uint8_t* buffer, const uint8_t* end,
+                                              config_arena_t* arena) {
+  const uint8_t* ptr = buffer;
+
+  ptr = deserialize_block(ptr, end, &config->unit_name_len, sizeof(config->unit_name_len));
+  ptr = deserialize_string(ptr, end, &config->unit_name, config->unit_name_len, arena);
 
   return ptr;
 }
 
-const uint8_t* deserialize_unit_configuration(unit_configuration_t* config, const uint8_t* buffer) {
+const uint8_t* deserialize_unit_configuration(unit_configuration_t* config, const uint8_t* buffer, const uint8_t* end) {
   const uint8_t* ptr = buffer;
 
-  ptr = deserialize_block(ptr, &config->configuration_version, sizeof(config->configuration_version));
+  ptr = deserialize_block(ptr, end, &config->configuration_version, sizeof(config->configuration_version));
+  if (ptr == NULL) return NULL;
+
+  if (config->configuration_version != CONFIGURATION_VERSION_POSITIONAL) {
+    ESP_LOGE(TAG, "Unknown legacy configuration version %d", config->configuration_version);
+    return NULL;
+  }
 
-  if (config->configuration_version != CONFIGURATION_VERSION) {
-    ESP_LOGE(TAG, "Configuration version mismatch, NVS [%d] vs Firmware [%d]", config->configuration_version,
-             CONFIGURATION_VERSION); // TODO versioning
+  // All strings and the Wi-Fi settings array share one allocation
+  const size_t arena_size = calculate_unit_configuration_arena_size(buffer, end);
+  config_arena_t arena;
+  config->arena = arena_size > 0 ? calloc(arena_size, 1) : NULL;
+  if (arena_size > 0 && config->arena == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate %u byte configuration arena", (unsigned)arena_size);
     return NULL;
   }
+  config->arena_size = arena_size;
+  config_arena_init(&arena, config->arena, arena_size);
 
-  ptr = deserialize_connectivity_configuration(&config->con_config, ptr);
-  ptr = deserialize_system_settings_configuration(&config->sys_config, ptr);
-  ptr = deserialize_user_configuration(&config->user_config, ptr);
+  ptr = deserialize_connectivity_configuration(&config->con_config, ptr, end, &arena);
+  if (ptr != NULL) ptr = deserialize_system_settings_configuration(&config->sys_config, ptr, end);
+  if (ptr != NULL) ptr = deserialize_user_configuration(&config->user_config, ptr, end, &arena);
+  if (ptr == NULL) ESP_LOGE(TAG, "Configuration blob is truncated or corrupt");
 
   return ptr;
 }
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "dns_message.h"
+
+#include <lwip/def.h>
+#include <lwip/prot/dns.h>
+#include <string.h>
+
+size_t dns_qname_length(const uint8_t* const name, const size_t len) {
+  size_t pos = 0;
+  while (pos < len && name[pos] != 0) {
+    if (name[pos] > DNS_MAX_LABEL_LEN) return 0; // Compression pointer or reserved label type
+    pos += name[pos] + 1;
+  }
+  if (pos >= len || pos > DNS_MAX_QNAME_LEN - 1) return 0;
+  return pos + 1; // Root label
+}
+
+size_t dns_parse_question(const uint8_t* const message, const size_t len, bool* const answer) {
+  if (len < sizeof(dns_header)) return 0;
+
+  dns_header hdr;
+  memcpy(&hdr, message, sizeof(hdr));
+  if (PP_NTOHS(hdr.flags) & (DNS_FLAG_QR | DNS_FLAG_OPCODE) || PP_NTOHS(hdr.qdcount) != 1) return 0;
+
+  const uint8_t* qname_start = message + sizeof(dns_header);
+  const size_t remaining = len - sizeof(dns_header);
+  const size_t qname_len = dns_qname_length(qname_start, remaining);
+  if (qname_len == 0 || remaining - qname_len < sizeof(dns_question)) return 0;
+
+  dns_question question;
+  memcpy(&question, qname_start + qname_len, sizeof(question));
+  const uint16_t qtype = PP_NTOHS(question.qtype);
+  *answer = PP_NTOHS(question.qclass) == DNS_RRCLASS_IN && (qtype == DNS_RRTYPE_A || qtype == DNS_RRTYPE_ANY);
+
+  return sizeof(dns_header) + qname_len + sizeof(dns_question);
+}
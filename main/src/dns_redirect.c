@@ -15,39 +15,31 @@
  */
 
 #include "dns_redirect.h"
+#include "dns_message.h"
 
 #include "state.h"
 
 #include <esp_log.h>
 #include <esp_netif.h>
 #include <esp_netif_types.h>
+#include <esp_timer.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 #include <lwip/dns.h>
 #include <lwip/ip4_addr.h>
 #include <lwip/prot/dns.h>
+#include <lwip/tcpip.h>
 #include <lwip/udp.h>
+#include <stdbool.h>
+#include <string.h>
 
-static struct udp_pcb* dns_pcb = NULL;
-static ip4_addr_t ap_ip;
-static char* TAG = "DNS Redirect";
+#define DNS_ANSWER_TTL 60
+#define DNS_RESPONSE_POOL_SIZE 4 // Responses in flight at once before falling back to pbuf_alloc
+#define DNS_RATE_LIMIT_CLIENTS 8 // Sources tracked at once, the least recently seen is replaced by a new one
+#define DNS_TOKEN_SCALE 1000 // Tokens are kept in thousandths so that sub-token refills are not lost
 
 #pragma pack(push, 1)
 
-typedef struct
-{
-  uint16_t id;
-  uint16_t flags;
-  uint16_t qdcount;
-  uint16_t ancount;
-  uint16_t nscount;
-  uint16_t arcount;
-} dns_header;
-
-typedef struct
-{
-  uint16_t qtype;
-  uint16_t qclass;
-} dns_question;
-
 typedef struct
 {
   uint16_t name;
@@ -60,75 +52,242 @@ typedef struct
 
 #pragma pack(pop)
 
-static void dns_recv_callback(void* arg, struct udp_pcb* pcb, struct pbuf* p,
-                              const ip_addr_t* addr, u16_t port) {
-  if (!p || p->tot_len < sizeof(dns_header)) {
-    pbuf_free(p);
-    return;
+#define DNS_MAX_RESPONSE_LEN (sizeof(dns_header) + DNS_MAX_QNAME_LEN + sizeof(dns_question) + sizeof(dns_answer))
+
+// A function run in the tcpip thread and the semaphore the caller waits on until it has
+typedef struct
+{
+  tcpip_callback_fn fn;
+  SemaphoreHandle_t done;
+} tcpip_call_t;
+
+// Response buffers allocated once at start. A buffer is free again once the stack has dropped its references after
+// the send, udp_sendto() leaves the headers it prepended in place, so the payload is restored from here.
+typedef struct
+{
+  struct pbuf* pbuf;
+  void* payload;
+} dns_response_slot_t;
+
+// Token bucket per source address, refilled at CONFIG_DNS_RATE_LIMIT_QPS up to CONFIG_DNS_RATE_LIMIT_BURST
+typedef struct
+{
+  uint32_t addr;
+  uint32_t tokens;
+  int64_t last_us;
+} dns_client_bucket_t;
+
+static struct udp_pcb* dns_pcb = NULL;
+static dns_response_slot_t response_pool[DNS_RESPONSE_POOL_SIZE];
+static dns_client_bucket_t client_buckets[DNS_RATE_LIMIT_CLIENTS];
+static dns_redirect_stats_t stats;
+static portMUX_TYPE stats_lock = portMUX_INITIALIZER_UNLOCKED;
+static char* TAG = "DNS Redirect";
+
+static void dns_recv_callback(void* arg, struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* addr, u16_t port);
+static bool take_token(const ip_addr_t* addr);
+static void count(uint32_t* counter);
+static u16_t parse_question(const struct pbuf* p, bool* answer);
+static bool lookup_ap_ip(ip4_addr_t* ip);
+static u16_t write_response(u8_t* message, u16_t question_end, const ip4_addr_t* answer);
+static struct pbuf* acquire_response(u16_t len);
+static void allocate_response_pool();
+static void free_response_pool();
+static void run_in_tcpip_thread(tcpip_callback_fn fn);
+static void call_and_signal(void* arg);
+static void start_in_tcpip_thread(void* arg);
+static void stop_in_tcpip_thread(void* arg);
+
+// Spends a token of the source's bucket, false when it is empty. Runs in the tcpip thread only.
+static bool take_token(const ip_addr_t* const addr) {
+  if (CONFIG_DNS_RATE_LIMIT_QPS == 0) return true;
+
+  const uint32_t source = ip4_addr_get_u32(ip_2_ip4(addr));
+  const int64_t now = esp_timer_get_time();
+  const uint32_t capacity = CONFIG_DNS_RATE_LIMIT_BURST * DNS_TOKEN_SCALE;
+
+  dns_client_bucket_t* bucket = NULL;
+  dns_client_bucket_t* oldest = &client_buckets[0];
+  for (size_t i = 0; i < DNS_RATE_LIMIT_CLIENTS; i++) {
+    if (client_buckets[i].last_us != 0 && client_buckets[i].addr == source) {
+      bucket = &client_buckets[i];
+      break;
+    }
+    if (client_buckets[i].last_us < oldest->last_us) oldest = &client_buckets[i];
+  }
+
+  if (bucket == NULL) {
+    *oldest = (dns_client_bucket_t){.addr = source, .tokens = capacity, .last_us = now};
+    bucket = oldest;
+  } else {
+    const int64_t refill = (now - bucket->last_us) * CONFIG_DNS_RATE_LIMIT_QPS * DNS_TOKEN_SCALE / 1000000;
+    bucket->tokens = refill >= capacity - bucket->tokens ? capacity : bucket->tokens + (uint32_t)refill;
+    bucket->last_us = now;
+  }
+
+  if (bucket->tokens < DNS_TOKEN_SCALE) return false;
+  bucket->tokens -= DNS_TOKEN_SCALE;
+  return true;
+}
+
+static void count(uint32_t* const counter) {
+  taskENTER_CRITICAL(&stats_lock);
+  (*counter)++;
+  taskEXIT_CRITICAL(&stats_lock);
+}
+
+void dns_redirect_get_stats(dns_redirect_stats_t* const out) {
+  taskENTER_CRITICAL(&stats_lock);
+  *out = stats;
+  taskEXIT_CRITICAL(&stats_lock);
+}
+
+// Length of the header and the single question, 0 when the query is not answered. Only A and ANY queries in class
+// IN get the portal address, every other type, e.g. AAAA and HTTPS, gets an empty NOERROR answer so that clients
+// do not retry it.
+static u16_t parse_question(const struct pbuf* const p, bool* const answer) {
+  // Parsed in place, queries arrive in a single pbuf
+  return (u16_t)dns_parse_question(p->payload, p->len, answer);
+}
+
+// Looked up per query, the AP interface may be created or readdressed after the server starts
+static bool lookup_ap_ip(ip4_addr_t* const ip) {
+  esp_netif_t* ap_netif = esp_netif_get_handle_from_ifkey("WIFI_AP_DEF");
+  if (ap_netif == NULL) return false;
+
+  esp_netif_ip_info_t ip_info;
+  if (esp_netif_get_ip_info(ap_netif, &ip_info) != ESP_OK || ip_info.ip.addr == 0) return false;
+  ip4_addr_set_u32(ip, ip_info.ip.addr);
+  return true;
+}
+
+// Turns a copy of the query into the response, anything after the question, such as an EDNS record, is dropped.
+// Without an answer address the response is an empty NOERROR.
+static u16_t write_response(u8_t* const message, const u16_t question_end, const ip4_addr_t* const answer) {
+  dns_header* hdr = (dns_header*)message;
+  hdr->flags = PP_HTONS(DNS_FLAG_QR | DNS_FLAG_AA | (PP_NTOHS(hdr->flags) & DNS_FLAG_RD));
+  hdr->ancount = answer != NULL ? PP_HTONS(1) : 0;
+  hdr->nscount = 0;
+  hdr->arcount = 0;
+  if (answer == NULL) return question_end;
+
+  const dns_answer ans = {
+    .name = PP_HTONS(0xC00C),
+    .type = PP_HTONS(DNS_RRTYPE_A),
+    .class = PP_HTONS(DNS_RRCLASS_IN),
+    .ttl = PP_HTONL(DNS_ANSWER_TTL),
+    .length = PP_HTONS(sizeof(ip4_addr_t)),
+    .addr = *answer
+  };
+  memcpy(message + question_end, &ans, sizeof(ans));
+  return question_end + sizeof(ans);
+}
+
+static struct pbuf* acquire_response(const u16_t len) {
+  for (size_t i = 0; i < DNS_RESPONSE_POOL_SIZE; i++) {
+    dns_response_slot_t* slot = &response_pool[i];
+    if (slot->pbuf == NULL || slot->pbuf->ref != 1) continue;
+
+    struct pbuf* resp = slot->pbuf;
+    if (resp->payload != slot->payload) pbuf_remove_header(resp, (u8_t*)slot->payload - (u8_t*)resp->payload);
+    // A single PBUF_RAM buffer owned here and allocated at DNS_MAX_RESPONSE_LEN, so its length can be set directly
+    resp->len = len;
+    resp->tot_len = len;
+    pbuf_ref(resp); // The caller's reference, dropped with pbuf_free() after the send like that of a new pbuf
+    return resp;
   }
+  return pbuf_alloc(PBUF_TRANSPORT, len, PBUF_RAM);
+}
 
-  dns_header* hdr = (dns_header*)p->payload;
+static void dns_recv_callback(void* arg, struct udp_pcb* pcb, struct pbuf* p, const ip_addr_t* addr, u16_t port) {
+  if (!p) return;
+  count(&stats.queries);
 
-  if (PP_NTOHS(hdr->flags) & 0x8000 ||
-    (PP_NTOHS(hdr->flags) & 0x7800) != 0 ||
-    PP_NTOHS(hdr->qdcount) != 1) {
+  // Checked before parsing, so a flood costs a table lookup per packet and nothing more
+  if (!take_token(addr)) {
+    count(&stats.dropped);
     pbuf_free(p);
     return;
   }
 
-  u8_t* qname_start = (u8_t*)p->payload + sizeof(dns_header);
-  u16_t remaining = p->tot_len - sizeof(dns_header);
-  u16_t qname_len = 0;
+  bool answer = false;
+  const u16_t question_end = parse_question(p, &answer);
+  if (question_end == 0) {
+    count(&stats.malformed);
+    pbuf_free(p);
+    return;
+  }
 
-  while (remaining > 0 && qname_start[qname_len] != 0) {
-    if (qname_start[qname_len] >= 0xC0) {
-      pbuf_free(p);
-      return;
-    }
-    u8_t label_len = qname_start[qname_len];
-    if (label_len >= remaining) break;
-    qname_len += label_len + 1;
-    remaining -= label_len + 1;
+  // Nothing to redirect to until the AP has an address
+  ip4_addr_t ap_ip;
+  if (answer && !lookup_ap_ip(&ap_ip)) {
+    count(&stats.dropped);
+    pbuf_free(p);
+    return;
   }
+  const ip4_addr_t* answer_ip = answer ? &ap_ip : NULL;
+
+  const u16_t resp_len = question_end + (answer ? sizeof(dns_answer) : 0);
 
-  if (remaining < 5 || qname_start[qname_len] != 0) {
+  // The response is the query with the answer in place of whatever followed the question, so it is written over
+  // the request when that is long enough
+  if (resp_len <= p->len && p->next == NULL && p->ref == 1) {
+    write_response(p->payload, question_end, answer_ip);
+    pbuf_realloc(p, resp_len);
+    if (udp_sendto(pcb, p, addr, port) == ERR_OK) count(&stats.answered);
     pbuf_free(p);
     return;
   }
-  qname_len += 5;
 
-  u16_t resp_len = sizeof(dns_header) + qname_len + sizeof(dns_answer);
-  struct pbuf* resp = pbuf_alloc(PBUF_TRANSPORT, resp_len, PBUF_RAM);
+  struct pbuf* resp = acquire_response(resp_len);
   if (!resp) {
     pbuf_free(p);
     return;
   }
 
-  memcpy(resp->payload, p->payload, sizeof(dns_header));
-  dns_header* resp_hdr = (dns_header*)resp->payload;
+  memcpy(resp->payload, p->payload, question_end);
+  pbuf_free(p);
+  write_response(resp->payload, question_end, answer_ip);
 
-  resp_hdr->flags = PP_HTONS(0x8400);
-  resp_hdr->ancount = PP_HTONS(1);
+  if (udp_sendto(pcb, resp, addr, port) == ERR_OK) count(&stats.answered);
+  pbuf_free(resp);
+}
 
-  memcpy((u8_t*)resp->payload + sizeof(dns_header), qname_start, qname_len);
+static void allocate_response_pool() {
+  for (size_t i = 0; i < DNS_RESPONSE_POOL_SIZE; i++) {
+    struct pbuf* resp = pbuf_alloc(PBUF_TRANSPORT, DNS_MAX_RESPONSE_LEN, PBUF_RAM);
+    response_pool[i] = (dns_response_slot_t){.pbuf = resp, .payload = resp ? resp->payload : NULL};
+  }
+}
 
-  dns_answer ans = {
-    .name = PP_HTONS(0xC00C),
-    .type = PP_HTONS(DNS_RRTYPE_A),
-    .class = PP_HTONS(DNS_RRCLASS_IN),
-    .ttl = PP_HTONL(60),
-    .length = PP_HTONS(sizeof(ip4_addr_t)),
-    .addr = ap_ip
-  };
+static void free_response_pool() {
+  for (size_t i = 0; i < DNS_RESPONSE_POOL_SIZE; i++) {
+    if (response_pool[i].pbuf) pbuf_free(response_pool[i].pbuf);
+    response_pool[i] = (dns_response_slot_t){0};
+  }
+}
 
-  memcpy((u8_t*)resp->payload + sizeof(dns_header) + qname_len, &ans, sizeof(ans));
+// The PCB and the response pool are only touched in the tcpip thread, where dns_recv_callback() runs, so a query
+// being answered never sees them half created or freed. Core locking is not assumed to be enabled, the work is
+// posted to the thread and waited for.
+static void run_in_tcpip_thread(const tcpip_callback_fn fn) {
+  StaticSemaphore_t done_buffer;
+  tcpip_call_t call = {.fn = fn, .done = xSemaphoreCreateBinaryStatic(&done_buffer)};
 
-  udp_sendto(pcb, resp, addr, port);
-  pbuf_free(resp);
-  pbuf_free(p);
+  if (tcpip_callback(call_and_signal, &call) != ERR_OK) {
+    ESP_LOGE(TAG, "Failed to post to the tcpip thread");
+    return;
+  }
+  xSemaphoreTake(call.done, portMAX_DELAY);
 }
 
-void start_dns_server() {
+static void call_and_signal(void* arg) {
+  const tcpip_call_t* call = arg;
+  call->fn(NULL);
+  xSemaphoreGive(call->done);
+}
+
+static void start_in_tcpip_thread(void* arg) {
   if (dns_pcb != NULL) {
     ESP_LOGW(TAG, "Already started");
     return;
@@ -142,24 +301,33 @@ void start_dns_server() {
 
   if (udp_bind(dns_pcb, IP_ANY_TYPE, 53) != ERR_OK) {
     ESP_LOGE(TAG, "Failed to bind DNS port");
-    stop_dns_server();
+    stop_in_tcpip_thread(NULL);
     return;
   }
 
+  memset(client_buckets, 0, sizeof(client_buckets));
+  allocate_response_pool();
   udp_recv(dns_pcb, dns_recv_callback, NULL);
 
-  esp_netif_ip_info_t ip_info;
-  esp_netif_get_ip_info(esp_netif_get_handle_from_ifkey("WIFI_AP_DEF"), &ip_info);
-  ip4_addr_set_u32(&ap_ip, ip_info.ip.addr);
-
   ESP_LOGI(TAG, "DNS redirect started");
 }
 
-void stop_dns_server() {
+// Once the PCB is removed no callback runs again. A pool buffer still referenced by a send in flight is released by
+// the stack when that completes.
+static void stop_in_tcpip_thread(void* arg) {
   if (dns_pcb != NULL) {
     udp_remove(dns_pcb);
     dns_pcb = NULL;
   }
+  free_response_pool();
 
   ESP_LOGI(TAG, "Stopped DNS Redirect");
 }
+
+void start_dns_server() {
+  run_in_tcpip_thread(start_in_tcpip_thread);
+}
+
+void stop_dns_server() {
+  run_in_tcpip_thread(stop_in_tcpip_thread);
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "https_connection.h"
+
+#include <esp_log.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+#include <string.h>
+
+#define MAX_REQUEST_HEADERS 4
+
+static const char* TAG = "HTTPS_CONNECTION";
+extern const uint8_t server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
+extern const uint8_t server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
+
+static esp_http_client_handle_t shared_client = NULL;
+static SemaphoreHandle_t connection_mutex = NULL;
+static StaticSemaphore_t connection_mutex_buffer; // Created without allocating, so it can be under init_lock
+static portMUX_TYPE init_lock = portMUX_INITIALIZER_UNLOCKED;
+// Current request
+static http_event_handle_cb request_handler = NULL;
+static void* request_user_data = NULL;
+static const char* request_headers[MAX_REQUEST_HEADERS];
+static size_t request_header_count = 0;
+static bool connection_reused = false;
+
+static esp_err_t event_handler(esp_http_client_event_t* event);
+static esp_err_t create_client(const char* url);
+
+// Forwards the events to the handler of the request in progress, the client keeps a single handler for its lifetime
+static esp_err_t event_handler(esp_http_client_event_t* event) {
+  if (request_handler == NULL) return ESP_OK;
+
+  event->user_data = request_user_data;
+  return request_handler(event);
+}
+
+static esp_err_t create_client(const char* url) {
+  const esp_http_client_config_t config = {
+    .url = url,
+    .cert_pem = (char*)server_cert_pem_start, // #TODO move cert to spiffs
+    .event_handler = event_handler,
+    .method = HTTP_METHOD_GET,
+    .buffer_size = CONFIG_OTA_HTTP_RX_BUFFER_SIZE,
+    .buffer_size_tx = CONFIG_OTA_HTTP_TX_BUFFER_SIZE,
+    .keep_alive_enable = true,
+#ifdef CONFIG_ESP_TLS_CLIENT_SESSION_TICKETS
+    .save_client_session = true, // Resumed with a session ticket on the next handshake
+#endif
+  };
+
+  shared_client = esp_http_client_init(&config);
+  if (shared_client == NULL) {
+    ESP_LOGE(TAG, "Failed to create HTTPS client");
+    return ESP_FAIL;
+  }
+  return ESP_OK;
+}
+
+esp_http_client_handle_t https_connection_acquire(const char* url, http_event_handle_cb handler, void* user_data) {
+  if (connection_mutex == NULL) {
+    taskENTER_CRITICAL(&init_lock);
+    if (connection_mutex == NULL) connection_mutex = xSemaphoreCreateMutexStatic(&connection_mutex_buffer);
+    taskEXIT_CRITICAL(&init_lock);
+    if (connection_mutex == NULL) return NULL;
+  }
+  xSemaphoreTake(connection_mutex, portMAX_DELAY);
+
+  request_handler = handler;
+  request_user_data = user_data;
+  request_header_count = 0;
+
+  connection_reused = shared_client != NULL;
+  if (shared_client == NULL) {
+    if (create_client(url) != ESP_OK) {
+      xSemaphoreGive(connection_mutex);
+      return NULL;
+    }
+  } else if (esp_http_client_set_url(shared_client, url) != ESP_OK) {
+    xSemaphoreGive(connection_mutex);
+    return NULL;
+  } else {
+    esp_http_client_set_method(shared_client, HTTP_METHOD_GET);
+  }
+
+  return shared_client;
+}
+
+void https_connection_release(esp_http_client_handle_t client, const bool reuse) {
+  if (client == NULL || client != shared_client) return;
+
+  for (size_t i = 0; i < request_header_count; i++) {
+    esp_http_client_delete_header(client, request_headers[i]);
+  }
+  request_header_count = 0;
+
+  // Closing keeps the client and its saved session, only the socket goes
+  if (!reuse) esp_http_client_close(client);
+
+  request_handler = NULL;
+  request_user_data = NULL;
+  xSemaphoreGive(connection_mutex);
+}
+
+esp_err_t https_connection_set_header(esp_http_client_handle_t client, const char* key, const char* value) {
+  if (request_header_count >= MAX_REQUEST_HEADERS) return ESP_ERR_NO_MEM;
+
+  const esp_err_t err = esp_http_client_set_header(client, key, value);
+  if (err == ESP_OK) request_headers[request_header_count++] = key;
+  return err;
+}
+
+esp_err_t https_connection_open(esp_http_client_handle_t client) {
+  esp_err_t err = esp_http_client_open(client, 0);
+  if (err != ESP_OK && connection_reused) {
+    ESP_LOGI(TAG, "Kept connection lost, reconnecting");
+    esp_http_client_close(client);
+    err = esp_http_client_open(client, 0);
+  }
+  return err;
+}
+
+esp_err_t https_connection_perform(esp_http_client_handle_t client) {
+  esp_err_t err = esp_http_client_perform(client);
+  if (err != ESP_OK && connection_reused) {
+    ESP_LOGI(TAG, "Kept connection lost, reconnecting");
+    esp_http_client_close(client);
+    err = esp_http_client_perform(client);
+  }
+  return err;
+}
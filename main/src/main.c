@@ -14,8 +14,10 @@
  * limitations under the License.
  */
 
+#include "boot.h"
 #include "nvs_manager.h"
 #include "state.h"
+#include "telemetry.h"
 #include "web_page_manager.h"
 #include "wifi_manager.h"
 
@@ -35,18 +37,8 @@ void app_main(void) {
   set_wifi_manager(wifi_manager);
   set_web_page_manager(web_page_manager);
 
-  ESP_LOGI(TAG, "NVS requesting state READY");
-  nvs_manager_request_state(nvs_manager, NVS_STATE_READY_REQUEST);
-  ESP_LOGI(TAG, "NVS waiting on state READY");
-  nvs_manager_wait_until_state(nvs_manager, NVS_READY);
-  ESP_LOGI(TAG, "Wi-FI requesting state AP");
-  wifi_manager_request_state(wifi_manager, WIFI_MANAGER_STATE_AP_REQUEST);
-  ESP_LOGI(TAG, "Wi-FI waiting on state AP");
-  wifi_manager_wait_until_state(wifi_manager, WIFI_MANAGER_STATE_AP);
-  ESP_LOGI(TAG, "Web-page requesting state serving | DNS");
-  web_page_manager_request_state(web_page_manager, WEB_PAGE_STATE_SERVING_REQUEST | WEB_PAGE_STATE_DNS_SERVER_REQUEST);
-  ESP_LOGI(TAG, "Web-page requesting waiting | DNS");
-  web_page_manager_wait_until_state(web_page_manager, WEB_PAGE_STATE_SERVING | WEB_PAGE_STATE_DNS_SERVER_ACTIVE);
+  telemetry_start_logging();
+  boot_run();
 
   ESP_LOGI(TAG, "Done");
 }
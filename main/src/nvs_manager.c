@@ -20,8 +20,10 @@
 #include "deserialisation.h"
 #include "serialisation.h"
 #include "state.h"
+#include "telemetry.h"
 
 #include <esp_log.h>
+#include <esp_timer.h>
 #include <freertos/projdefs.h>
 #include <nvs.h>
 #include <nvs_flash.h>
@@ -29,24 +31,70 @@
 
 struct nvs_manager
 {
-  EventGroupHandle_t request_event_group;
+  QueueHandle_t request_queue;
   EventGroupHandle_t state_event_group;
   TaskHandle_t fsm_task_handle;
+  esp_timer_handle_t flush_timer;
 
   bool nvs_flash_inited;
+  bool write_pending; // A write was requested and is waiting for the coalescing window to close
 };
 
 static const char* TAG = "NVS Manager";
 
 #define CONFIG_NAMESPACE "config_storage"
-#define UNIT_CONFIG_KEY "unit_config"
+#define RUNTIME_NAMESPACE "runtime"
+// A complete copy of the configuration, held while the sections are rewritten in a new layout
+#define CONFIG_STAGING_NAMESPACE "config_stage"
+#define UNIT_CONFIG_KEY "unit_config" // Legacy single-blob configuration, migrated to sections on first read
+
+// Each section is stored under its own key, a write only touches the sections that changed
+#define CONFIG_VERSION_KEY "cfg_ver"
+#define CON_CONFIG_KEY "con_cfg"
+#define SYS_CONFIG_KEY "sys_cfg"
+#define USR_CONFIG_KEY "usr_cfg"
+#define WIFI_CONFIG_KEY_FORMAT "wifi_%02u"
+#define CONFIG_KEY_LENGTH 16 // NVS_KEY_NAME_MAX_SIZE
+
+// Posted by the coalescing timer, not part of the public request set
+#define NVS_STATE_FLUSH_REQUEST ((nvs_manager_state_request_t)BIT4)
+#define NVS_FLUSH_RETRY_MS 50 // Delay before the flush is posted again when the request queue was full
+// Posted by nvs_manager_post_blob() on its own, the message's user_data is the posted_blob_t
+#define NVS_STATE_BLOB_REQUEST ((nvs_manager_state_request_t)BIT5)
+#define NVS_STATE_BITS (NVS_STATE_NONE | NVS_READY | NVS_BUSY)
+
+typedef struct
+{
+  char key[CONFIG_KEY_LENGTH];
+  bool erase;
+  size_t size;
+  uint8_t data[];
+} posted_blob_t;
 
 static void fsm_task(void* arg);
 static esp_err_t transition_to_state(nvs_manager_t* manager, nvs_manager_state_request_t state_request);
+static void set_state(nvs_manager_t const* manager, nvs_manager_state_t state);
+static esp_err_t request_write(nvs_manager_t* manager);
+static esp_err_t flush_pending_write(nvs_manager_t* manager);
+static void flush_timer_callback(void* arg);
+static esp_err_t write_posted_blob(nvs_manager_t const* manager, const posted_blob_t* blob);
 
 static esp_err_t update_nvs_from_config();
 static esp_err_t read_nvs_into_config();
 
+static esp_err_t write_section(nvs_handle_t nvs_handle, const char* key, const uint8_t* data, size_t size,
+                               size_t* sections_written);
+static esp_err_t write_sections(nvs_handle_t nvs_handle, const unit_configuration_t* unit_cfg);
+static esp_err_t write_config_sections(nvs_handle_t nvs_handle, const unit_configuration_t* unit_cfg);
+static esp_err_t stage_config(const unit_configuration_t* unit_cfg);
+static void clear_staged_config();
+static esp_err_t recover_staged_config();
+static uint8_t* read_section(nvs_handle_t nvs_handle, const char* key, size_t* size);
+static size_t section_size(nvs_handle_t nvs_handle, const char* key);
+static bool read_section_into(nvs_handle_t nvs_handle, const char* key, uint8_t* dst, size_t* size);
+static esp_err_t read_config_sections(nvs_handle_t nvs_handle, unit_configuration_t* unit_cfg);
+static esp_err_t migrate_legacy_config(nvs_handle_t nvs_handle);
+
 static bool is_config_stored_in_nvs(const char* key);
 static void store_unit_default_config_to_nvs();
 static esp_err_t initialise_nvs_flash();
@@ -60,19 +108,35 @@ nvs_manager_t* nvs_manager_create(UBaseType_t priority) {
   }
 
   *manager = (nvs_manager_t){
-    .request_event_group = xEventGroupCreate(),
+    .request_queue = request_bus_create(),
     .state_event_group = xEventGroupCreate(),
     .fsm_task_handle = NULL,
+    .flush_timer = NULL,
 
-    .nvs_flash_inited = false
+    .nvs_flash_inited = false,
+    .write_pending = false
   };
 
-  if (manager->request_event_group == NULL || manager->state_event_group == NULL) {
+  if (manager->request_queue == NULL || manager->state_event_group == NULL) {
+    request_bus_delete(manager->request_queue);
+    if (manager->state_event_group) vEventGroupDelete(manager->state_event_group);
     free(manager);
     ESP_LOGE(TAG, "Unable to create nvs manager");
     return NULL;
   }
 
+  if (CONFIG_NVS_WRITE_COALESCE_MS > 0) {
+    const esp_timer_create_args_t timer_args = {
+      .callback = &flush_timer_callback,
+      .arg = manager,
+      .name = "nvs_flush"
+    };
+    if (esp_timer_create(&timer_args, &manager->flush_timer) != ESP_OK) {
+      ESP_LOGW(TAG, "Unable to create flush timer, writes are not coalesced");
+      manager->flush_timer = NULL;
+    }
+  }
+
   xTaskCreate(
     fsm_task,
     TAG,
@@ -81,6 +145,7 @@ nvs_manager_t* nvs_manager_create(UBaseType_t priority) {
     priority,
     &manager->fsm_task_handle
     );
+  telemetry_register_task(manager->fsm_task_handle);
 
   return manager;
 }
@@ -89,11 +154,14 @@ void nvs_manager_destroy(nvs_manager_t* const manager) {
   if (manager == NULL) return;
 
   if (manager->fsm_task_handle) {
+    telemetry_unregister_task(manager->fsm_task_handle);
     vTaskDelete(manager->fsm_task_handle);
   }
-  if (manager->request_event_group) {
-    vEventGroupDelete(manager->request_event_group);
+  if (manager->flush_timer) {
+    esp_timer_stop(manager->flush_timer);
+    esp_timer_delete(manager->flush_timer);
   }
+  request_bus_delete(manager->request_queue);
   if (manager->state_event_group) {
     vEventGroupDelete(manager->state_event_group);
   }
@@ -105,12 +173,11 @@ void nvs_manager_destroy(nvs_manager_t* const manager) {
   free(manager);
 }
 
-esp_err_t nvs_manager_request_state(nvs_manager_t* const manager, nvs_manager_state_request_t new_state) {
+esp_err_t nvs_manager_request_state(nvs_manager_t* const manager, nvs_manager_state_request_t new_state,
+                                    const request_callback_t callback, void* user_data) {
   if (manager == NULL) return ESP_ERR_NOT_FOUND;
 
-  xEventGroupSetBits(manager->request_event_group, new_state);
-
-  return ESP_OK;
+  return request_bus_post(manager->request_queue, new_state, callback, user_data);
 }
 
 void nvs_manager_wait_until_state(nvs_manager_t const* const manager, nvs_manager_state_t wait_state) {
@@ -119,6 +186,81 @@ void nvs_manager_wait_until_state(nvs_manager_t const* const manager, nvs_manage
   xEventGroupWaitBits(manager->state_event_group, wait_state, pdFALSE, pdFALSE, portMAX_DELAY);
 }
 
+esp_err_t nvs_manager_store_blob(nvs_manager_t const* const manager, const char* key, const void* data,
+                                 const size_t size) {
+  if (manager == NULL) return ESP_ERR_NOT_FOUND;
+  if (!manager->nvs_flash_inited) return ESP_ERR_INVALID_STATE;
+
+  nvs_handle_t nvs_handle;
+  esp_err_t err = nvs_open(RUNTIME_NAMESPACE, NVS_READWRITE, &nvs_handle);
+  if (err != ESP_OK) return err;
+
+  size_t written = 0;
+  err = write_section(nvs_handle, key, data, size, &written);
+  if (err == ESP_OK && written > 0) {
+    err = nvs_commit(nvs_handle);
+  }
+
+  nvs_close(nvs_handle);
+  return err;
+}
+
+esp_err_t nvs_manager_load_blob(nvs_manager_t const* const manager, const char* key, void* data, size_t* size) {
+  if (manager == NULL) return ESP_ERR_NOT_FOUND;
+  if (!manager->nvs_flash_inited) return ESP_ERR_INVALID_STATE;
+
+  nvs_handle_t nvs_handle;
+  esp_err_t err = nvs_open(RUNTIME_NAMESPACE, NVS_READONLY, &nvs_handle);
+  if (err != ESP_OK) return err; // ESP_ERR_NVS_NOT_FOUND until the first store creates the namespace
+
+  err = nvs_get_blob(nvs_handle, key, data, size);
+  nvs_close(nvs_handle);
+  return err;
+}
+
+esp_err_t nvs_manager_erase_blob(nvs_manager_t const* const manager, const char* key) {
+  if (manager == NULL) return ESP_ERR_NOT_FOUND;
+  if (!manager->nvs_flash_inited) return ESP_ERR_INVALID_STATE;
+
+  nvs_handle_t nvs_handle;
+  esp_err_t err = nvs_open(RUNTIME_NAMESPACE, NVS_READWRITE, &nvs_handle);
+  if (err != ESP_OK) return err;
+
+  err = nvs_erase_key(nvs_handle, key);
+  if (err == ESP_OK) {
+    err = nvs_commit(nvs_handle);
+  } else if (err == ESP_ERR_NVS_NOT_FOUND) {
+    err = ESP_OK;
+  }
+
+  nvs_close(nvs_handle);
+  return err;
+}
+
+esp_err_t nvs_manager_post_blob(nvs_manager_t* const manager, const char* key, const void* data, const size_t size) {
+  if (manager == NULL) return ESP_ERR_NOT_FOUND;
+  if (strlen(key) >= CONFIG_KEY_LENGTH) return ESP_ERR_INVALID_ARG;
+
+  posted_blob_t* blob = malloc(sizeof(posted_blob_t) + (data != NULL ? size : 0));
+  if (blob == NULL) return ESP_ERR_NO_MEM;
+
+  strlcpy(blob->key, key, sizeof(blob->key));
+  blob->erase = data == NULL;
+  blob->size = data != NULL ? size : 0;
+  if (data != NULL) memcpy(blob->data, data, size);
+
+  const esp_err_t err = request_bus_try_post(manager->request_queue, NVS_STATE_BLOB_REQUEST, NULL, blob);
+  if (err != ESP_OK) free(blob);
+  return err;
+}
+
+static esp_err_t write_posted_blob(nvs_manager_t const* const manager, const posted_blob_t* blob) {
+  const esp_err_t err = blob->erase ? nvs_manager_erase_blob(manager, blob->key)
+                                    : nvs_manager_store_blob(manager, blob->key, blob->data, blob->size);
+  if (err != ESP_OK) ESP_LOGW(TAG, "Posted write of %s failed: %s", blob->key, esp_err_to_name(err));
+  return err;
+}
+
 static void fsm_task(void* arg) {
   nvs_manager_t* manager = arg;
 
@@ -128,28 +270,48 @@ static void fsm_task(void* arg) {
     return;
   }
 
-  if (manager->request_event_group == NULL) {
-    ESP_LOGE(TAG, "Request event group not created");
+  if (manager->request_queue == NULL) {
+    ESP_LOGE(TAG, "Request queue not created");
     vTaskDelete(NULL);
     return;
   }
 
-  xEventGroupSetBits(manager->state_event_group, NVS_STATE_NONE);
+  set_state(manager, NVS_STATE_NONE);
+
+  // Bits combined in one message are handled one at a time, in the order they can be served
+  static const nvs_manager_state_request_t request_order[] = {
+    NVS_STATE_READY_REQUEST,
+    NVS_STATE_READ_REQUEST,
+    NVS_STATE_WRITE_REQUEST,
+    NVS_STATE_FLUSH_REQUEST,
+    NVS_STATE_NONE_REQUEST,
+  };
 
   while (1) {
-    EventBits_t bits = xEventGroupWaitBits(manager->request_event_group,
-                                           NVS_STATE_NONE_REQUEST |
-                                           NVS_STATE_READY_REQUEST |
-                                           NVS_STATE_READ_REQUEST |
-                                           NVS_STATE_WRITE_REQUEST, pdTRUE, pdFALSE, portMAX_DELAY);
-
-    if (transition_to_state(manager, bits) == ESP_OK) {
-      ESP_LOGI(TAG, "Successful state transition: 0x%X", bits);
-    } else {
-      ESP_LOGI(TAG, "Unsuccessful state transition: 0x%X", bits);
+    request_message_t message;
+    request_bus_receive(manager->request_queue, &message);
+
+    if (message.request == NVS_STATE_BLOB_REQUEST) {
+      write_posted_blob(manager, message.user_data);
+      free(message.user_data);
+      continue;
     }
 
-    taskYIELD();
+    esp_err_t result = ESP_OK;
+    for (size_t i = 0; i < sizeof(request_order) / sizeof(request_order[0]); i++) {
+      const nvs_manager_state_request_t request = request_order[i];
+      if ((message.request & request) == 0) continue;
+
+      const esp_err_t err = transition_to_state(manager, request);
+      if (err == ESP_OK) {
+        ESP_LOGI(TAG, "Successful state transition: 0x%X", request);
+      } else {
+        ESP_LOGI(TAG, "Unsuccessful state transition: 0x%X", request);
+        if (result == ESP_OK) result = err;
+      }
+    }
+
+    request_bus_complete(&message, result);
   }
 
   vTaskDelete(NULL);
@@ -174,29 +336,35 @@ esp_err_t transition_to_state(nvs_manager_t* const manager, const nvs_manager_st
   if (current_state == NVS_STATE_NONE && state_request == NVS_STATE_READY_REQUEST) {
     ret = initialise_nvs_flash();
     if (ret == ESP_OK) {
-      if (!is_config_stored_in_nvs(UNIT_CONFIG_KEY)) {
+      // Before anything checks what is stored, an interrupted layout rewrite is finished from its staged copy
+      recover_staged_config();
+      if (!is_config_stored_in_nvs(CONFIG_VERSION_KEY) && !is_config_stored_in_nvs(UNIT_CONFIG_KEY)) {
         store_unit_default_config_to_nvs();
       }
       read_nvs_into_config();
       manager->nvs_flash_inited = true;
-      xEventGroupSetBits(manager->state_event_group, NVS_READY);
+      set_state(manager, NVS_READY);
     }
   } else if (current_state == NVS_READY && state_request == NVS_STATE_READ_REQUEST) {
-    xEventGroupSetBits(manager->state_event_group, NVS_BUSY);
+    set_state(manager, NVS_BUSY);
     ret = read_nvs_into_config();
-    xEventGroupSetBits(manager->state_event_group, NVS_READY);
+    set_state(manager, NVS_READY);
   } else if (current_state == NVS_READY && state_request == NVS_STATE_WRITE_REQUEST) {
-    xEventGroupSetBits(manager->state_event_group, NVS_BUSY);
-    ret = update_nvs_from_config();
-    xEventGroupSetBits(manager->state_event_group, NVS_READY);
+    ret = request_write(manager);
+  } else if (state_request == NVS_STATE_FLUSH_REQUEST) {
+    // Nothing to do when the pending write was already flushed, e.g. ahead of a deinit
+    ret = current_state == NVS_READY ? flush_pending_write(manager) : ESP_OK;
   } else if (current_state == NVS_READY && state_request == NVS_STATE_NONE_REQUEST) {
-    xEventGroupSetBits(manager->state_event_group, NVS_BUSY);
+    if (manager->flush_timer) esp_timer_stop(manager->flush_timer);
+    flush_pending_write(manager);
+
+    set_state(manager, NVS_BUSY);
     ret = deinitialise_nvs_flash();
     if (ret == ESP_OK) {
-      xEventGroupSetBits(manager->state_event_group, NVS_STATE_NONE);
+      set_state(manager, NVS_STATE_NONE);
       manager->nvs_flash_inited = false;
     } else {
-      xEventGroupSetBits(manager->state_event_group, NVS_READY);
+      set_state(manager, NVS_READY);
     }
   } else {
     ESP_LOGE(TAG, "State change requested denied - unhandled");
@@ -206,6 +374,53 @@ esp_err_t transition_to_state(nvs_manager_t* const manager, const nvs_manager_st
   return ret;
 }
 
+// State bits are exclusive, the previous state is cleared so comparisons against a single state hold
+static void set_state(nvs_manager_t const* const manager, const nvs_manager_state_t state) {
+  xEventGroupClearBits(manager->state_event_group, NVS_STATE_BITS & ~state);
+  xEventGroupSetBits(manager->state_event_group, state);
+}
+
+// Opens a coalescing window on the first request, requests arriving within it are merged into the same write.
+// The window is not extended by later requests, so a steady stream of writes still reaches flash.
+static esp_err_t request_write(nvs_manager_t* const manager) {
+  if (manager->flush_timer == NULL) {
+    manager->write_pending = true;
+    return flush_pending_write(manager);
+  }
+
+  if (manager->write_pending) return ESP_OK;
+
+  manager->write_pending = true;
+  const esp_err_t err = esp_timer_start_once(manager->flush_timer, CONFIG_NVS_WRITE_COALESCE_MS * 1000ULL);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Unable to start flush timer (%s), writing through", esp_err_to_name(err));
+    return flush_pending_write(manager);
+  }
+
+  return ESP_OK;
+}
+
+static esp_err_t flush_pending_write(nvs_manager_t* const manager) {
+  if (!manager->write_pending) return ESP_OK;
+  manager->write_pending = false;
+
+  set_state(manager, NVS_BUSY);
+  const int64_t started_us = esp_timer_get_time();
+  const esp_err_t ret = update_nvs_from_config();
+  telemetry_record(TELEMETRY_NVS_COMMIT, esp_timer_get_time() - started_us);
+  set_state(manager, NVS_READY);
+  return ret;
+}
+
+// write_pending stays set until the flush runs, so a lost post would hold back every later write; a full queue is
+// retried shortly instead
+static void flush_timer_callback(void* arg) {
+  nvs_manager_t* manager = arg;
+  if (request_bus_try_post(manager->request_queue, NVS_STATE_FLUSH_REQUEST, NULL, NULL) == ESP_OK) return;
+
+  esp_timer_start_once(manager->flush_timer, NVS_FLUSH_RETRY_MS * 1000ULL);
+}
+
 static bool is_config_stored_in_nvs(const char* key) {
   nvs_handle_t nvs_handle;
   ESP_ERROR_CHECK(nvs_open(CONFIG_NAMESPACE, NVS_READWRITE, &nvs_handle));
@@ -233,11 +448,10 @@ static void store_unit_default_config_to_nvs() {
   system_settings_configuration_t* sys_cfg = &(unit_cfg->sys_config);
   user_configuration_t* usr_cfg = &(unit_cfg->user_config);
 
+  unit_config_free_members(unit_cfg);
+
   // Initialize connectivity configuration
   con_cfg->wifi_settings_count = 1;
-  if(con_cfg->wifi_settings){
-    free(con_cfg->wifi_settings);
-  }
   con_cfg->wifi_settings = malloc(sizeof(wifi_settings_t)); // Allocate for one wifi setting
   if (!con_cfg->wifi_settings) {
     ESP_LOGE(TAG, "Failed to allocate memory for wifi_settings");
@@ -273,9 +487,6 @@ static void store_unit_default_config_to_nvs() {
   sys_cfg->log_level = CONFIG_LOG_DEFAULT_LEVEL;
 
   // Initialize user configuration
-  if (usr_cfg->unit_name) {
-    free(usr_cfg->unit_name);
-  }
   usr_cfg->unit_name_len = strlen(CONFIG_ESP_NAME);
   usr_cfg->unit_name = malloc(usr_cfg->unit_name_len + 1);
   if (!usr_cfg->unit_name) {
@@ -284,42 +495,17 @@ static void store_unit_default_config_to_nvs() {
   }
   strlcpy(usr_cfg->unit_name, CONFIG_ESP_NAME, usr_cfg->unit_name_len + 1);
 
-  // Calculate the size of the serialized data
-  const size_t buffer_size = calculate_unit_configuration_size(unit_cfg);
-
-  // Allocate buffer dynamically
-  uint8_t* buffer = calloc(buffer_size, sizeof(uint8_t));
-  if (!buffer) {
-    ESP_LOGE(TAG, "Failed to allocate memory for serialization buffer");
-    goto cleanup;
-  }
-
-  // Serialize the configuration
-  size_t serialized_size = serialize_unit_configuration(unit_cfg, buffer);
-  if (serialized_size != buffer_size) {
-    ESP_LOGE(TAG, "Serialization size mismatch: expected %d, got %d", buffer_size, serialized_size);
-    free(buffer);
-    goto cleanup;
-  }
+  unit_cfg->configuration_version = CONFIGURATION_VERSION;
 
   // Store in NVS
-  ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, UNIT_CONFIG_KEY, buffer, serialized_size));
+  ESP_ERROR_CHECK(write_config_sections(nvs_handle, unit_cfg));
   ESP_ERROR_CHECK(nvs_commit(nvs_handle));
   ESP_LOGI(TAG, "Default unit configuration stored in NVS.");
 
-  // Free the buffer
-  free(buffer);
-
 cleanup:
-  // Cleanup dynamically allocated memory
-  if (con_cfg->wifi_settings) {
-    free(con_cfg->wifi_settings->ssid);
-    free(con_cfg->wifi_settings->password);
-    free(con_cfg->wifi_settings);
-  }
-  free(con_cfg->ota_url);
-  free(con_cfg->version_url);
-  free(usr_cfg->unit_name);
+  // Cleanup dynamically allocated memory, the stored configuration is read back from NVS.
+  // Releasing publishes a snapshot of the config, so the freed members are cleared too.
+  unit_config_free_members(unit_cfg);
   unit_config_release();
   nvs_close(nvs_handle);
 }
@@ -329,67 +515,384 @@ static esp_err_t update_nvs_from_config() {
   nvs_handle_t nvs_handle;
   ESP_ERROR_CHECK(nvs_open(CONFIG_NAMESPACE, NVS_READWRITE, &nvs_handle));
 
-  const unit_configuration_t* unit_cfg = unit_config_acquire();
-  const size_t blob_size = calculate_unit_configuration_size(unit_cfg);
+  const unit_configuration_t* unit_cfg = unit_config_snapshot_get();
+  const esp_err_t ret = write_config_sections(nvs_handle, unit_cfg);
+  unit_config_snapshot_put(unit_cfg);
 
-  uint8_t* serialized_blob = calloc(blob_size, sizeof(uint8_t));
-  if (serialized_blob == NULL) {
-    ESP_LOGE(TAG, "Failed to allocate memory for serialization blob");
-    abort();
+  if (ret == ESP_OK) {
+    ESP_ERROR_CHECK(nvs_commit(nvs_handle));
   }
 
-  serialize_unit_configuration(unit_cfg, serialized_blob);
+  nvs_close(nvs_handle);
+  return ret;
+}
 
-  unit_config_release();
+// Deserialize NVS sections into config
+static esp_err_t read_nvs_into_config() {
+  nvs_handle_t nvs_handle;
+  ESP_ERROR_CHECK(nvs_open(CONFIG_NAMESPACE, NVS_READWRITE, &nvs_handle));
 
-  // Store in NVS
-  ESP_ERROR_CHECK(nvs_set_blob(nvs_handle, UNIT_CONFIG_KEY, serialized_blob, blob_size));
-  ESP_ERROR_CHECK(nvs_commit(nvs_handle));
+  if (!is_config_stored_in_nvs(CONFIG_VERSION_KEY) && is_config_stored_in_nvs(UNIT_CONFIG_KEY)) {
+    const esp_err_t ret = migrate_legacy_config(nvs_handle);
+    if (ret != ESP_OK) {
+      nvs_close(nvs_handle);
+      return ret;
+    }
+  }
 
-  // Cleanup
-  free(serialized_blob);
+  // Decode outside the lock, then swap the loaded members in
+  unit_configuration_t loaded = {0};
+  const esp_err_t ret = read_config_sections(nvs_handle, &loaded);
   nvs_close(nvs_handle);
-  ESP_LOGI(TAG, "Current unit configuration stored in NVS");
+  if (ret != ESP_OK) {
+    unit_config_free_members(&loaded);
+    return ret;
+  }
+
+  unit_configuration_t* unit_cfg = unit_config_acquire();
+  unit_config_free_members(unit_cfg);
+  *unit_cfg = loaded;
+
+  esp_log_level_set("*", unit_cfg->sys_config.log_level);
+
+  unit_config_release();
+  ESP_LOGI(TAG, "Unit configuration loaded from NVS");
 
   return ESP_OK;
 }
 
-// Deserialize NVS blobs into config
-static esp_err_t read_nvs_into_config() {
-  nvs_handle_t nvs_handle;
-  ESP_ERROR_CHECK(nvs_open(CONFIG_NAMESPACE, NVS_READONLY, &nvs_handle));
+// Writes the section when it differs from what is stored, identical sections cost a read instead of flash wear
+static esp_err_t write_section(const nvs_handle_t nvs_handle, const char* key, const uint8_t* data, const size_t size,
+                               size_t* sections_written) {
+  size_t stored_size = 0;
+  if (nvs_get_blob(nvs_handle, key, NULL, &stored_size) == ESP_OK && stored_size == size) {
+    uint8_t* stored = malloc(size);
+    const bool unchanged = stored != NULL &&
+      nvs_get_blob(nvs_handle, key, stored, &stored_size) == ESP_OK &&
+      memcmp(stored, data, size) == 0;
+    free(stored);
+
+    if (unchanged) return ESP_OK;
+  }
 
-  // Get blob size
-  size_t blob_size = 0;
-  esp_err_t ret = nvs_get_blob(nvs_handle, UNIT_CONFIG_KEY, NULL, &blob_size);
-  if (ret != ESP_OK && ret != ESP_ERR_NVS_NOT_FOUND) {
-    ESP_ERROR_CHECK(ret);
+  const esp_err_t err = nvs_set_blob(nvs_handle, key, data, size);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to store section %s (%s)", key, esp_err_to_name(err));
+    return err;
   }
-  if (blob_size == 0) {
-    nvs_close(nvs_handle);
-    return ESP_ERR_NOT_FOUND;
+
+  ESP_LOGI(TAG, "Stored section %s (%u bytes)", key, (unsigned)size);
+  (*sections_written)++;
+  return ESP_OK;
+}
+
+// Sections are always written in the current layout. When that changes the stored one, a complete copy is staged
+// first: the version is dropped and written last, so half rewritten sections are never read as the old layout, and
+// a reset in between finds the staged copy at boot rather than no configuration at all.
+static esp_err_t write_config_sections(const nvs_handle_t nvs_handle, const unit_configuration_t* unit_cfg) {
+  uint8_t stored_version = CONFIGURATION_VERSION;
+  size_t version_size = sizeof(stored_version);
+  if (nvs_get_blob(nvs_handle, CONFIG_VERSION_KEY, &stored_version, &version_size) != ESP_OK ||
+    stored_version == CONFIGURATION_VERSION) {
+    return write_sections(nvs_handle, unit_cfg);
   }
 
-  uint8_t* serialized_blob = calloc(blob_size, sizeof(uint8_t));
-  if (serialized_blob == NULL) {
-    ESP_LOGE(TAG, "Failed to allocate memory for serialization blob");
-    abort();
+  ESP_LOGI(TAG, "Rewriting configuration from version %d to %d", stored_version, CONFIGURATION_VERSION);
+  esp_err_t ret = stage_config(unit_cfg);
+  if (ret == ESP_OK) ret = nvs_erase_key(nvs_handle, CONFIG_VERSION_KEY);
+  if (ret == ESP_OK) ret = write_sections(nvs_handle, unit_cfg);
+  if (ret == ESP_OK) ret = nvs_commit(nvs_handle);
+  if (ret == ESP_OK) clear_staged_config();
+  return ret;
+}
+
+static esp_err_t stage_config(const unit_configuration_t* unit_cfg) {
+  nvs_handle_t stage_handle;
+  esp_err_t ret = nvs_open(CONFIG_STAGING_NAMESPACE, NVS_READWRITE, &stage_handle);
+  if (ret != ESP_OK) return ret;
+
+  // The version is written last here too, a copy without it was interrupted and is not used
+  ret = nvs_erase_all(stage_handle);
+  if (ret == ESP_OK) ret = write_sections(stage_handle, unit_cfg);
+  if (ret == ESP_OK) ret = nvs_commit(stage_handle);
+  nvs_close(stage_handle);
+  if (ret != ESP_OK) ESP_LOGE(TAG, "Failed to stage configuration (%s)", esp_err_to_name(ret));
+  return ret;
+}
+
+static void clear_staged_config() {
+  nvs_handle_t stage_handle;
+  if (nvs_open(CONFIG_STAGING_NAMESPACE, NVS_READWRITE, &stage_handle) != ESP_OK) return;
+
+  if (nvs_erase_all(stage_handle) == ESP_OK) nvs_commit(stage_handle);
+  nvs_close(stage_handle);
+}
+
+// Writing the sections again from a complete staged copy is safe however far the interrupted rewrite got, sections
+// already in place are left alone
+static esp_err_t recover_staged_config() {
+  nvs_handle_t stage_handle;
+  if (nvs_open(CONFIG_STAGING_NAMESPACE, NVS_READONLY, &stage_handle) != ESP_OK) return ESP_OK; // Never staged
+
+  size_t size = 0;
+  const bool complete = nvs_get_blob(stage_handle, CONFIG_VERSION_KEY, NULL, &size) == ESP_OK;
+  unit_configuration_t staged = {0};
+  esp_err_t ret = complete ? read_config_sections(stage_handle, &staged) : ESP_OK;
+  nvs_close(stage_handle);
+
+  if (complete && ret == ESP_OK) {
+    ESP_LOGW(TAG, "Configuration rewrite was interrupted, restoring it from the staged copy");
+    nvs_handle_t nvs_handle;
+    ret = nvs_open(CONFIG_NAMESPACE, NVS_READWRITE, &nvs_handle);
+    if (ret == ESP_OK) {
+      ret = write_sections(nvs_handle, &staged);
+      if (ret == ESP_OK) ret = nvs_commit(nvs_handle);
+      nvs_close(nvs_handle);
+    }
   }
-  ESP_ERROR_CHECK(nvs_get_blob(nvs_handle, UNIT_CONFIG_KEY, serialized_blob, &blob_size));
+  unit_config_free_members(&staged);
 
-  ESP_LOGI(TAG, "Loaded blob of size %d.", blob_size);
+  // A failed restore keeps the copy for the next boot
+  if (ret != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to restore the staged configuration (%s)", esp_err_to_name(ret));
+    return ret;
+  }
+  clear_staged_config();
+  return ESP_OK;
+}
 
-  unit_configuration_t* unit_cfg = unit_config_acquire();
-  deserialize_unit_configuration(unit_cfg, serialized_blob);
+static esp_err_t write_sections(const nvs_handle_t nvs_handle, const unit_configuration_t* unit_cfg) {
+  const connectivity_configuration_t* con_cfg = &unit_cfg->con_config;
 
-  esp_log_level_set("*", unit_cfg->sys_config.log_level);
+  // One scratch buffer, sized for the largest section
+  size_t buffer_size = calculate_connectivity_header_size(con_cfg);
+  for (uint8_t i = 0; i < con_cfg->wifi_settings_count; i++) {
+    const size_t wifi_size = calculate_wifi_settings_size(&con_cfg->wifi_settings[i]);
+    if (wifi_size > buffer_size) buffer_size = wifi_size;
+  }
+  const size_t sys_size = calculate_system_settings_configuration_size(&unit_cfg->sys_config);
+  const size_t usr_size = calculate_user_configuration_size(&unit_cfg->user_config);
+  if (sys_size > buffer_size) buffer_size = sys_size;
+  if (usr_size > buffer_size) buffer_size = usr_size;
 
-  unit_config_release();
-  free(serialized_blob);
-  nvs_close(nvs_handle);
-  ESP_LOGI(TAG, "Unit configuration loaded from NVS");
+  uint8_t* buffer = malloc(buffer_size);
+  if (buffer == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate memory for serialization buffer");
+    return ESP_ERR_NO_MEM;
+  }
+
+  esp_err_t ret = ESP_OK;
+  size_t sections_written = 0;
+  char key[CONFIG_KEY_LENGTH];
+  const uint8_t version = CONFIGURATION_VERSION;
+
+  // The header holds the Wi-Fi count, it is written after the networks it counts and before the ones it no longer
+  // counts are dropped, so an interrupted write never leaves the header counting a network that was not stored
+  for (uint8_t i = 0; i < con_cfg->wifi_settings_count; i++) {
+    snprintf(key, sizeof(key), WIFI_CONFIG_KEY_FORMAT, i);
+    ret = write_section(nvs_handle, key, buffer, serialize_wifi_settings(&con_cfg->wifi_settings[i], buffer),
+                        &sections_written);
+    if (ret != ESP_OK) goto cleanup;
+  }
+
+  ret = write_section(nvs_handle, CON_CONFIG_KEY, buffer, serialize_connectivity_header(con_cfg, buffer),
+                      &sections_written);
+  if (ret != ESP_OK) goto cleanup;
+
+  // Networks beyond the current count were removed, drop their sections
+  for (unsigned i = con_cfg->wifi_settings_count; i <= UINT8_MAX; i++) {
+    snprintf(key, sizeof(key), WIFI_CONFIG_KEY_FORMAT, i);
+    if (nvs_erase_key(nvs_handle, key) != ESP_OK) break;
+    sections_written++;
+  }
 
+  ret = write_section(nvs_handle, SYS_CONFIG_KEY, buffer,
+                      serialize_system_settings_configuration(&unit_cfg->sys_config, buffer), &sections_written);
+  if (ret != ESP_OK) goto cleanup;
+
+  ret = write_section(nvs_handle, USR_CONFIG_KEY, buffer, serialize_user_configuration(&unit_cfg->user_config, buffer),
+                      &sections_written);
+  if (ret != ESP_OK) goto cleanup;
+
+  ret = write_section(nvs_handle, CONFIG_VERSION_KEY, &version, sizeof(version), &sections_written);
+
+cleanup:
+  free(buffer);
+  if (ret == ESP_OK) {
+    if (sections_written == 0) {
+      ESP_LOGI(TAG, "Unit configuration unchanged, nothing written to NVS");
+    } else {
+      ESP_LOGI(TAG, "Current unit configuration stored in NVS, %u section(s) updated", (unsigned)sections_written);
+    }
+  }
+  return ret;
+}
+
+static uint8_t* read_section(const nvs_handle_t nvs_handle, const char* key, size_t* size) {
+  *size = 0;
+  if (nvs_get_blob(nvs_handle, key, NULL, size) != ESP_OK || *size == 0) {
+    ESP_LOGW(TAG, "Section %s not found in NVS", key);
+    return NULL;
+  }
+
+  uint8_t* blob = calloc(*size, sizeof(uint8_t));
+  if (blob == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate memory for section %s", key);
+    return NULL;
+  }
+
+  if (nvs_get_blob(nvs_handle, key, blob, size) != ESP_OK) {
+    free(blob);
+    return NULL;
+  }
+  return blob;
+}
+
+// Stored size of a section, 0 when it is missing. Taken for every section before any is read, to size the block
+// they are read into.
+static size_t section_size(const nvs_handle_t nvs_handle, const char* key) {
+  size_t size = 0;
+  if (nvs_get_blob(nvs_handle, key, NULL, &size) != ESP_OK) return 0;
+  return size;
+}
+
+// Reads a section into place, a missing one reads as empty
+static bool read_section_into(const nvs_handle_t nvs_handle, const char* key, uint8_t* dst, size_t* size) {
+  if (*size == 0) return true;
+  const esp_err_t ret = nvs_get_blob(nvs_handle, key, dst, size);
+  if (ret == ESP_ERR_NVS_NOT_FOUND) *size = 0;
+  return ret == ESP_OK || ret == ESP_ERR_NVS_NOT_FOUND;
+}
+
+// The sections are read into one block, which becomes the configuration arena, and decoded in place:
+// [con][sys][usr][wifi_00 .. wifi_NN][padding][Wi-Fi settings array]. Strings point into their section, so the
+// configuration costs the size of its blobs and nothing is copied out of them.
+static esp_err_t read_config_sections(const nvs_handle_t nvs_handle, unit_configuration_t* unit_cfg) {
+  size_t size = 0;
+  uint8_t* blob = read_section(nvs_handle, CONFIG_VERSION_KEY, &size);
+  if (blob == NULL) return ESP_ERR_NOT_FOUND;
+  unit_cfg->configuration_version = blob[0];
+  free(blob);
+
+  // Older layouts are read as they are and migrated in memory, the sections are rewritten on the next write
+  const uint8_t version = unit_cfg->configuration_version;
+  const config_section_reader_t* reader = config_section_reader(version);
+  if (version > CONFIGURATION_VERSION) {
+    ESP_LOGW(TAG, "Configuration version %d is newer than firmware [%d], unknown fields are ignored", version,
+             CONFIGURATION_VERSION);
+  }
+
+  char key[CONFIG_KEY_LENGTH];
+  size_t con_size = section_size(nvs_handle, CON_CONFIG_KEY);
+  size_t sys_size = section_size(nvs_handle, SYS_CONFIG_KEY);
+  size_t usr_size = section_size(nvs_handle, USR_CONFIG_KEY);
+  if (con_size == 0) ESP_LOGW(TAG, "Section %s not found in NVS", CON_CONFIG_KEY);
+
+  // The Wi-Fi count is in the connectivity header, read it first to size the rest of the block
+  uint8_t* block = malloc(con_size + sys_size + usr_size + 1);
+  if (block == NULL) goto no_mem;
+  if (!read_section_into(nvs_handle, CON_CONFIG_KEY, block, &con_size)) goto corrupt;
+  const uint8_t wifi_count = con_size > 0 ? reader->wifi_settings_count(block, con_size) : 0;
+
+  size_t blobs_size = con_size + sys_size + usr_size;
+  for (uint8_t i = 0; i < wifi_count; i++) {
+    snprintf(key, sizeof(key), WIFI_CONFIG_KEY_FORMAT, i);
+    blobs_size += section_size(nvs_handle, key);
+  }
+  const size_t align = _Alignof(wifi_settings_t);
+  const size_t wifi_offset = (blobs_size + align - 1) / align * align;
+  const size_t block_size = wifi_offset + wifi_count * sizeof(wifi_settings_t);
+
+  uint8_t* grown = realloc(block, block_size);
+  if (grown == NULL) goto no_mem;
+  block = grown;
+  unit_cfg->arena = block;
+  unit_cfg->arena_size = block_size;
+
+  // Single validating pass: a section that does not hold what its lengths say rejects the whole configuration
+  connectivity_configuration_t* con_cfg = &unit_cfg->con_config;
+  uint8_t* ptr = block + con_size;
+  if (con_size > 0 && !reader->connectivity_header(con_cfg, block, con_size)) goto corrupt;
+  con_cfg->wifi_settings = wifi_count > 0 ? (wifi_settings_t*)(block + wifi_offset) : NULL;
+  if (wifi_count > 0) memset(con_cfg->wifi_settings, 0, wifi_count * sizeof(wifi_settings_t));
+
+  if (!read_section_into(nvs_handle, SYS_CONFIG_KEY, ptr, &sys_size)) goto corrupt;
+  if (sys_size > 0 && !reader->system_settings(&unit_cfg->sys_config, ptr, sys_size)) goto corrupt;
+  ptr += sys_size;
+
+  if (!read_section_into(nvs_handle, USR_CONFIG_KEY, ptr, &usr_size)) goto corrupt;
+  if (usr_size > 0 && !reader->user_configuration(&unit_cfg->user_config, ptr, usr_size)) goto corrupt;
+  ptr += usr_size;
+
+  // A network the header counts but NVS does not hold, or one without an SSID, is left out and the rest moved up,
+  // so every setting within the count has an SSID
+  uint8_t wifi_read = 0;
+  for (uint8_t i = 0; i < wifi_count; i++) {
+    snprintf(key, sizeof(key), WIFI_CONFIG_KEY_FORMAT, i);
+    size_t wifi_size = (size_t)(block + blobs_size - ptr);
+    if (!read_section_into(nvs_handle, key, ptr, &wifi_size)) goto corrupt;
+
+    wifi_settings_t* setting = &con_cfg->wifi_settings[wifi_read];
+    if (wifi_size > 0 && !reader->wifi_settings(setting, ptr, wifi_size)) goto corrupt;
+    if (wifi_size == 0 || setting->ssid == NULL) {
+      ESP_LOGW(TAG, "Section %s missing or without SSID, network skipped", key);
+      *setting = (wifi_settings_t){0};
+      continue;
+    }
+    wifi_read++;
+    ptr += wifi_size;
+  }
+
+  // The header's count sized the settings array, a reader that decoded a different one does not get to overrun it
+  con_cfg->wifi_settings_count = wifi_read;
+  if (wifi_read == 0) con_cfg->wifi_settings = NULL;
+  if (version < CONFIGURATION_VERSION) {
+    if (!migrate_unit_configuration(unit_cfg)) return ESP_ERR_INVALID_VERSION;
+    ESP_LOGI(TAG, "Configuration version %d migrated to %d, stored on the next write", version, CONFIGURATION_VERSION);
+  }
   return ESP_OK;
+
+corrupt:
+  // The caller frees the arena with the rest of the configuration
+  if (unit_cfg->arena == NULL) free(block);
+  ESP_LOGE(TAG, "Configuration section in NVS is truncated or corrupt");
+  return ESP_ERR_INVALID_SIZE;
+
+no_mem:
+  free(block);
+  ESP_LOGE(TAG, "Failed to allocate configuration block");
+  return ESP_ERR_NO_MEM;
+}
+
+// Splits a configuration stored by earlier firmware, under a single key, into sections
+static esp_err_t migrate_legacy_config(const nvs_handle_t nvs_handle) {
+  size_t size = 0;
+  uint8_t* blob = read_section(nvs_handle, UNIT_CONFIG_KEY, &size);
+  if (blob == NULL) return ESP_ERR_NOT_FOUND;
+
+  unit_configuration_t legacy = {0};
+  esp_err_t ret = deserialize_unit_configuration(&legacy, blob, blob + size) != NULL && migrate_unit_configuration(&legacy)
+    ? ESP_OK
+    : ESP_ERR_INVALID_VERSION;
+  free(blob);
+
+  if (ret == ESP_OK) {
+    ret = write_config_sections(nvs_handle, &legacy);
+  }
+  if (ret == ESP_OK) {
+    ret = nvs_erase_key(nvs_handle, UNIT_CONFIG_KEY);
+  }
+  if (ret == ESP_OK) {
+    ret = nvs_commit(nvs_handle);
+  }
+
+  unit_config_free_members(&legacy);
+  if (ret == ESP_OK) {
+    ESP_LOGI(TAG, "Migrated legacy configuration to per-section keys");
+  } else {
+    ESP_LOGE(TAG, "Failed to migrate legacy configuration (%s)", esp_err_to_name(ret));
+  }
+  return ret;
 }
 
 static esp_err_t initialise_nvs_flash() {
@@ -16,44 +16,129 @@
 
 #include "ota_download.h"
 
+#include "https_connection.h"
+#include "nvs_manager.h"
+#include "power_manager.h"
+#include "status_event.h"
+#include "telemetry.h"
 #include "wifi_manager.h"
 
 #include <configuration.h>
 #include <esp_app_desc.h>
 #include <esp_http_client.h>
 #include <esp_https_ota.h>
+#include <esp_idf_version.h>
+#include <esp_image_format.h>
 #include <esp_log.h>
 #include <esp_ota_ops.h>
-#include <esp_wifi.h>
+#include <esp_partition.h>
+#include <esp_timer.h>
+#include <freertos/queue.h>
+#include <rom/miniz.h>
 #include <state.h>
+#include <string.h>
+#include <strings.h>
 
 
 static const char* TAG = "OTA_DOWNLOAD";
-extern const uint8_t server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
-extern const uint8_t server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
 
 #define ESP_FIRMWARE_UP_TO_DATE (ESP_ERR_HTTPS_OTA_BASE + 2)
-
-static esp_err_t new_version_available(const esp_https_ota_handle_t* ota_handle);
-static esp_err_t create_ota_handle(esp_https_ota_handle_t* ota_handle);
-static esp_err_t download_firmware(const esp_https_ota_handle_t* ota_handle);
-static esp_err_t perform_ota_update();
-
-static esp_err_t new_version_available(const esp_https_ota_handle_t* ota_handle) {
-  esp_app_desc_t ota_app = {0};
+#define OTA_BUFFER_COUNT 2 // One buffer is filled from the network while the other is written to flash
+#define OTA_WRITER_STACK_SIZE 3072
+#define OTA_APP_DESC_OFFSET (sizeof(esp_image_header_t) + sizeof(esp_image_segment_header_t))
+#define OTA_APP_DESC_END (OTA_APP_DESC_OFFSET + sizeof(esp_app_desc_t))
+#define OTA_RESUME_KEY "ota_resume"
+#define OTA_ETAG_MAX_LEN 64
+#define OTA_PROGRESS_INTERVAL_US (250 * 1000) // Live progress, see status_event.h
+#define OTA_MAX_REDIRECTS 5
+
+#ifdef CONFIG_OTA_COMPRESSED_IMAGES
+#define OTA_COMPRESSED_ENABLED true
+#else
+#define OTA_COMPRESSED_ENABLED false
+#endif
+
+// esp_ota_resume() arrived with IDF 5.3, older IDFs download every image from the start
+#if defined(CONFIG_OTA_RESUME) && ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 3, 0)
+#define OTA_RESUME_ENABLED true
+#define OTA_RESUME_SAVE_INTERVAL CONFIG_OTA_RESUME_SAVE_INTERVAL
+#else
+#define OTA_RESUME_ENABLED false
+#define OTA_RESUME_SAVE_INTERVAL SIZE_MAX
+#endif
+
+// Progress of an interrupted download, valid for the image with this ETag on this partition. bytes_written is only
+// advanced after the flash write of those bytes has returned, and is a multiple of the sector size: the download
+// continues at the start of a sector, which is erased again before it is rewritten.
+typedef struct
+{
+  uint32_t partition_address;
+  uint32_t image_size;
+  uint32_t bytes_written;
+  char etag[OTA_ETAG_MAX_LEN];
+} ota_resume_t;
+
+typedef struct
+{
+  uint8_t* data;
+  size_t len; // 0 marks the end of the image
+} ota_chunk_t;
+
+// Shared by the download loop and the writer task, buffers travel between them over the two queues so that each
+// side only blocks while it waits for the other
+typedef struct
+{
+  const esp_partition_t* partition;
+  uint8_t* buffers[OTA_BUFFER_COUNT];
+  QueueHandle_t free_chunks;
+  QueueHandle_t filled_chunks;
+  TaskHandle_t writer_task;
+  TaskHandle_t download_task;
+  esp_err_t write_err;
+  esp_ota_handle_t ota_handle; // Begun on the first write
+  bool ota_begun;
+  size_t write_offset; // Next partition offset to write, starts past the resumed part
+  size_t saved_offset; // Offset at the last progress save
+  ota_resume_t resume; // Loaded before the request, then describes the image being downloaded
+  bool resume_loaded;
+  char response_etag[OTA_ETAG_MAX_LEN];
+  // zlib images are inflated by the writer task through the ROM tinfl into a circular window, which doubles as the
+  // output buffer, so only the window and the decompressor state are allocated
+  tinfl_decompressor* inflator;
+  uint8_t* window;
+  size_t window_offset;
+  bool inflate_done;
+} ota_pipeline_t;
+
+static esp_err_t new_version_available(const esp_app_desc_t* ota_app);
+static esp_err_t http_event_handler(esp_http_client_event_t* event);
+static bool is_redirect(int status);
+static esp_err_t open_firmware_stream(esp_http_client_handle_t* client, const char* url, ota_pipeline_t* pipeline,
+                                      int64_t* total_size);
+static esp_err_t create_pipeline(ota_pipeline_t* pipeline, ota_image_encoding_t encoding);
+static void destroy_pipeline(ota_pipeline_t* pipeline);
+static void load_resume_state(ota_pipeline_t* pipeline);
+static void save_resume_state(ota_pipeline_t* pipeline);
+static void clear_resume_state(ota_pipeline_t* pipeline);
+static esp_err_t begin_ota(ota_pipeline_t* pipeline);
+static esp_err_t write_image(ota_pipeline_t* pipeline, const uint8_t* data, size_t len);
+static esp_err_t inflate_chunk(ota_pipeline_t* pipeline, const ota_chunk_t* chunk);
+static esp_err_t write_chunk(ota_pipeline_t* pipeline, const ota_chunk_t* chunk);
+static void ota_writer_task(void* arg);
+static esp_err_t download_firmware(esp_http_client_handle_t client, ota_pipeline_t* pipeline, int64_t total_size);
+static esp_err_t perform_ota_update(const ota_image_source_t* source);
+
+// The application descriptor sits right after the image and first segment headers, so the version is known from
+// the first chunk, before anything has been written to flash
+static esp_err_t new_version_available(const esp_app_desc_t* ota_app) {
   esp_app_desc_t current_app = {0};
 
-  if (esp_https_ota_get_img_desc(*ota_handle, &ota_app) != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to get image description");
-    return ESP_FAIL;
-  }
-
   const esp_partition_t* running = esp_ota_get_running_partition();
   assert(running);
   esp_ota_get_partition_description(running, &current_app);
 
   ESP_LOGI(TAG, "Running firmware version: %s", current_app.version);
-  if (strncmp(ota_app.version, current_app.version, sizeof(ota_app.version)) == 0) {
+  if (strncmp(ota_app->version, current_app.version, sizeof(ota_app->version)) == 0) {
     ESP_LOGW(TAG, "Current version is the same as new. Skipping update.");
     return ESP_FIRMWARE_UP_TO_DATE;
   }
@@ -61,123 +146,486 @@ static esp_err_t new_version_available(const esp_https_ota_handle_t* ota_handle)
   return ERR_OK;
 }
 
-static esp_err_t create_ota_handle(esp_https_ota_handle_t* ota_handle) {
-  unit_configuration_t* unit_cfg = unit_config_acquire();
-  connectivity_configuration_t* con_cfg = &(unit_cfg->con_config);
-
-  esp_http_client_config_t config = {.url = con_cfg->ota_url,
-                                     .cert_pem = (char*)server_cert_pem_start,
-                                     .keep_alive_enable = true,
-                                     .skip_cert_common_name_check = true}; // TODO experiment with value
-  unit_config_release();
+static esp_err_t http_event_handler(esp_http_client_event_t* event) {
+  ota_pipeline_t* pipeline = event->user_data;
+  if (event->event_id == HTTP_EVENT_ON_HEADER && strcasecmp(event->header_key, "ETag") == 0) {
+    strlcpy(pipeline->response_etag, event->header_value, sizeof(pipeline->response_etag));
+  }
+  return ESP_OK;
+}
 
-  const esp_https_ota_config_t ota_config = {
-    .http_config = &config,
-    .partial_http_download = true,
-    .max_http_request_size = 4096, // TODO experiment with value
-  };
+static bool is_redirect(const int status) {
+  return status == 301 || status == 302 || status == 303 || status == 307 || status == 308;
+}
 
-  if (esp_https_ota_begin(&ota_config, ota_handle) != ESP_OK) {
-    ESP_LOGE(TAG, "OTA Begin failed");
+// A single streamed GET for the whole image, instead of one ranged request per chunk. With a resume state the
+// request asks for the rest of the image only if it still has the same ETag: a 206 continues where the last attempt
+// stopped, a 200 means the image changed and it is downloaded from the start.
+static esp_err_t open_firmware_stream(esp_http_client_handle_t* client, const char* url, ota_pipeline_t* pipeline,
+                                      int64_t* total_size) {
+  // The URL is copied into the client, normally the one the version check just used, so the connection or at
+  // least the TLS session of that check is reused
+  const unit_configuration_t* unit_cfg = unit_config_snapshot_get();
+  if (unit_cfg == NULL) return ESP_ERR_INVALID_STATE;
+  const connectivity_configuration_t* con_cfg = &(unit_cfg->con_config);
+  *client = https_connection_acquire(url != NULL ? url : con_cfg->ota_url, http_event_handler, pipeline);
+  unit_config_snapshot_put(unit_cfg);
+  if (*client == NULL) {
+    ESP_LOGE(TAG, "Failed to create HTTP client");
     return ESP_FAIL;
   }
 
+  const ota_resume_t* resume = &pipeline->resume;
+  if (pipeline->resume_loaded) {
+    char range[32];
+    snprintf(range, sizeof(range), "bytes=%lu-", (unsigned long)resume->bytes_written);
+    https_connection_set_header(*client, "Range", range);
+    https_connection_set_header(*client, "If-Range", resume->etag);
+  }
+
+  // Opened and read by hand, so redirects are not followed by the client as they are for esp_http_client_perform()
+  int64_t content_length = 0;
+  int status = 0;
+  for (int redirects = 0;; redirects++) {
+    const esp_err_t err = https_connection_open(*client);
+    if (err != ESP_OK) {
+      ESP_LOGE(TAG, "Failed to open firmware URL: %s", esp_err_to_name(err));
+      https_connection_release(*client, false);
+      *client = NULL;
+      return err;
+    }
+
+    content_length = esp_http_client_fetch_headers(*client);
+    status = esp_http_client_get_status_code(*client);
+    if (!is_redirect(status)) break;
+
+    if (redirects == OTA_MAX_REDIRECTS || esp_http_client_set_redirection(*client) != ESP_OK) {
+      ESP_LOGE(TAG, "Firmware request redirected with HTTP status %d, not followed", status);
+      https_connection_release(*client, false);
+      *client = NULL;
+      return ESP_FAIL;
+    }
+    // The body of the redirect is not read and the new location may be on another host
+    esp_http_client_close(*client);
+  }
+  if (status == 206 && pipeline->resume_loaded &&
+      content_length == (int64_t)(resume->image_size - resume->bytes_written)) {
+    ESP_LOGI(TAG, "Resuming download at %lu/%lu bytes", (unsigned long)resume->bytes_written,
+             (unsigned long)resume->image_size);
+    pipeline->write_offset = resume->bytes_written;
+    pipeline->saved_offset = resume->bytes_written;
+    *total_size = resume->image_size;
+    return ESP_OK;
+  }
+
+  if (status == 200) {
+    if (pipeline->resume_loaded) {
+      ESP_LOGI(TAG, "Image changed since the interrupted download, starting over");
+      clear_resume_state(pipeline);
+    }
+    *total_size = content_length;
+    pipeline->resume = (ota_resume_t){
+      .partition_address = pipeline->partition->address,
+      .image_size = content_length > 0 ? (uint32_t)content_length : 0,
+      .bytes_written = 0
+    };
+    strlcpy(pipeline->resume.etag, pipeline->response_etag, sizeof(pipeline->resume.etag));
+    return ESP_OK;
+  }
+
+  https_connection_release(*client, false);
+  *client = NULL;
+  // A 206 of the wrong length, a 416 or any other answer to the ranged request: the saved progress is of no use
+  if (pipeline->resume_loaded) {
+    ESP_LOGW(TAG, "Resume refused with HTTP status %d, starting over", status);
+    clear_resume_state(pipeline);
+    return open_firmware_stream(client, url, pipeline, total_size);
+  }
+
+  ESP_LOGE(TAG, "Firmware request failed with HTTP status %d", status);
+  return ESP_FAIL;
+}
+
+static esp_err_t create_pipeline(ota_pipeline_t* pipeline, const ota_image_encoding_t encoding) {
+  *pipeline = (ota_pipeline_t){.download_task = xTaskGetCurrentTaskHandle(), .write_err = ESP_OK};
+
+  pipeline->partition = esp_ota_get_next_update_partition(NULL);
+  if (pipeline->partition == NULL) {
+    ESP_LOGE(TAG, "No OTA partition to update");
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  if (encoding == OTA_IMAGE_ZLIB) {
+    if (!OTA_COMPRESSED_ENABLED) return ESP_ERR_NOT_SUPPORTED;
+
+    pipeline->inflator = malloc(sizeof(tinfl_decompressor));
+    pipeline->window = malloc(TINFL_LZ_DICT_SIZE);
+    if (pipeline->inflator == NULL || pipeline->window == NULL) return ESP_ERR_NO_MEM;
+    tinfl_init(pipeline->inflator);
+  }
+
+  pipeline->free_chunks = xQueueCreate(OTA_BUFFER_COUNT, sizeof(ota_chunk_t));
+  pipeline->filled_chunks = xQueueCreate(OTA_BUFFER_COUNT + 1, sizeof(ota_chunk_t)); // + the end marker
+  if (pipeline->free_chunks == NULL || pipeline->filled_chunks == NULL) return ESP_ERR_NO_MEM;
+
+  for (size_t i = 0; i < OTA_BUFFER_COUNT; i++) {
+    pipeline->buffers[i] = malloc(CONFIG_OTA_WRITE_BUFFER_SIZE);
+    if (pipeline->buffers[i] == NULL) return ESP_ERR_NO_MEM;
+
+    const ota_chunk_t chunk = {.data = pipeline->buffers[i], .len = 0};
+    xQueueSend(pipeline->free_chunks, &chunk, 0);
+  }
+
   return ESP_OK;
 }
 
-static esp_err_t download_firmware(const esp_https_ota_handle_t* ota_handle) {
-  esp_err_t err = ESP_OK;
+// Safe on a partially created pipeline, the writer task must have finished
+static void destroy_pipeline(ota_pipeline_t* pipeline) {
+  for (size_t i = 0; i < OTA_BUFFER_COUNT; i++) {
+    free(pipeline->buffers[i]);
+    pipeline->buffers[i] = NULL;
+  }
+  if (pipeline->free_chunks) vQueueDelete(pipeline->free_chunks);
+  if (pipeline->filled_chunks) vQueueDelete(pipeline->filled_chunks);
+  pipeline->free_chunks = NULL;
+  pipeline->filled_chunks = NULL;
+  free(pipeline->inflator);
+  free(pipeline->window);
+  pipeline->inflator = NULL;
+  pipeline->window = NULL;
+}
+
+static void load_resume_state(ota_pipeline_t* pipeline) {
+  if (!OTA_RESUME_ENABLED) return;
+
+  ota_resume_t resume;
+  size_t size = sizeof(resume);
+  nvs_manager_t* nvs_manager = get_nvs_manager();
+  const esp_err_t err = nvs_manager_load_blob(nvs_manager, OTA_RESUME_KEY, &resume, &size);
+  managers_release();
+  if (err != ESP_OK || size != sizeof(resume)) return;
+
+  resume.etag[sizeof(resume.etag) - 1] = '\0';
+  if (resume.partition_address != pipeline->partition->address || resume.etag[0] == '\0' ||
+      resume.bytes_written == 0 || resume.bytes_written % SPI_FLASH_SEC_SIZE != 0 ||
+      resume.bytes_written >= resume.image_size ||
+      resume.image_size > pipeline->partition->size) {
+    clear_resume_state(pipeline);
+    return;
+  }
+
+  pipeline->resume = resume;
+  pipeline->resume_loaded = true;
+}
+
+// Only images with an ETag can be resumed, without one a changed image could not be told apart. Compressed images
+// are not, the inflate state is not kept and offsets in the download do not match those on flash. Saved through the
+// NVS manager's queue, the writer task does not wait on the commit.
+static void save_resume_state(ota_pipeline_t* pipeline) {
+  if (!OTA_RESUME_ENABLED || pipeline->inflator != NULL) return;
+  if (pipeline->resume.etag[0] == '\0' || pipeline->resume.image_size == 0) return;
+
+  pipeline->saved_offset = pipeline->write_offset;
+  const uint32_t sector_start = pipeline->write_offset / SPI_FLASH_SEC_SIZE * SPI_FLASH_SEC_SIZE;
+  if (sector_start == 0 || sector_start == pipeline->resume.bytes_written) return;
+
+  pipeline->resume.bytes_written = sector_start;
+  nvs_manager_t* nvs_manager = get_nvs_manager();
+  const esp_err_t err = nvs_manager_post_blob(nvs_manager, OTA_RESUME_KEY, &pipeline->resume, sizeof(pipeline->resume));
+  managers_release();
+  if (err != ESP_OK) ESP_LOGW(TAG, "Failed to store OTA progress: %s", esp_err_to_name(err));
+}
+
+// Queued like the saves, so it cannot overtake one still waiting
+static void clear_resume_state(ota_pipeline_t* pipeline) {
+  pipeline->resume_loaded = false;
+  if (!OTA_RESUME_ENABLED) return;
+
+  nvs_manager_t* nvs_manager = get_nvs_manager();
+  const esp_err_t err = nvs_manager_post_blob(nvs_manager, OTA_RESUME_KEY, NULL, 0);
+  managers_release();
+  if (err != ESP_OK) ESP_LOGW(TAG, "Failed to clear OTA progress: %s", esp_err_to_name(err));
+}
+
+// Sequential writes erase each sector just before its first write. A resumed image continues at a sector boundary,
+// so that sector is erased again and nothing of the interrupted attempt is written over without an erase.
+static esp_err_t begin_ota(ota_pipeline_t* pipeline) {
+#if OTA_RESUME_ENABLED
+  if (pipeline->write_offset > 0) {
+    return esp_ota_resume(pipeline->partition, OTA_WITH_SEQUENTIAL_WRITES, pipeline->write_offset,
+                          &pipeline->ota_handle);
+  }
+#endif
+  return esp_ota_begin(pipeline->partition, OTA_WITH_SEQUENTIAL_WRITES, &pipeline->ota_handle);
+}
+
+// Written through esp_ota, which checks the image magic byte, writes encrypted partitions in whole blocks and
+// verifies the image in esp_ota_end(). The application descriptor sits right after the image and first segment
+// headers, so the version is checked on the first write, before anything is erased.
+static esp_err_t write_image(ota_pipeline_t* pipeline, const uint8_t* data, const size_t len) {
+  esp_err_t err;
+  if (!pipeline->ota_begun) {
+    if (pipeline->write_offset == 0) {
+      if (len < OTA_APP_DESC_END) {
+        ESP_LOGE(TAG, "Image too short for an application descriptor");
+        return ESP_ERR_INVALID_SIZE;
+      }
+
+      esp_app_desc_t ota_app;
+      memcpy(&ota_app, data + OTA_APP_DESC_OFFSET, sizeof(ota_app));
+      if ((err = new_version_available(&ota_app)) != ESP_OK) return err;
+    }
+
+    if ((err = begin_ota(pipeline)) != ESP_OK) return err;
+    pipeline->ota_begun = true;
+  }
+
+  const size_t end = pipeline->write_offset + len;
+  if (end > pipeline->partition->size) return ESP_ERR_INVALID_SIZE;
+
+  err = esp_ota_write(pipeline->ota_handle, data, len);
+  if (err != ESP_OK) return err;
+  pipeline->write_offset = end;
+
+  if (pipeline->write_offset - pipeline->saved_offset >= OTA_RESUME_SAVE_INTERVAL) {
+    save_resume_state(pipeline);
+  }
+  return ESP_OK;
+}
+
+// Feeds one downloaded chunk through the decompressor, writing out the window each time it fills or the input runs
+// out. The zlib trailer carries an Adler-32 of the image, checked when the stream ends.
+static esp_err_t inflate_chunk(ota_pipeline_t* pipeline, const ota_chunk_t* chunk) {
+  const uint8_t* in = chunk->data;
+  size_t in_left = chunk->len;
+
+  while (!pipeline->inflate_done) {
+    size_t in_bytes = in_left;
+    size_t out_bytes = TINFL_LZ_DICT_SIZE - pipeline->window_offset;
+    const tinfl_status status = tinfl_decompress(pipeline->inflator, in, &in_bytes, pipeline->window,
+                                                 pipeline->window + pipeline->window_offset, &out_bytes,
+                                                 TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_COMPUTE_ADLER32 |
+                                                 TINFL_FLAG_HAS_MORE_INPUT);
+    in += in_bytes;
+    in_left -= in_bytes;
+
+    if (out_bytes > 0) {
+      const esp_err_t err = write_image(pipeline, pipeline->window + pipeline->window_offset, out_bytes);
+      if (err != ESP_OK) return err;
+      pipeline->window_offset = (pipeline->window_offset + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+
+    if (status < TINFL_STATUS_DONE) {
+      ESP_LOGE(TAG, "Compressed image is corrupt: %d", status);
+      return ESP_ERR_INVALID_CRC;
+    }
+    if (status == TINFL_STATUS_DONE) pipeline->inflate_done = true;
+    if (status == TINFL_STATUS_NEEDS_MORE_INPUT && in_left == 0) break;
+  }
+  return ESP_OK;
+}
+
+static esp_err_t write_chunk(ota_pipeline_t* pipeline, const ota_chunk_t* chunk) {
+  return pipeline->inflator != NULL ? inflate_chunk(pipeline, chunk) : write_image(pipeline, chunk->data, chunk->len);
+}
+
+// Writes chunks in arrival order. After a write error the rest are only handed back, so the download loop never
+// waits on a buffer that does not come back. Notifies the download task once the end marker is processed.
+static void ota_writer_task(void* arg) {
+  ota_pipeline_t* pipeline = arg;
 
-  ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_NONE));
   while (1) {
-    const esp_err_t dl_progress = esp_https_ota_perform(*ota_handle);
-    const int bytes_read = esp_https_ota_get_image_len_read(*ota_handle);
-    const int total_size = esp_https_ota_get_image_size(*ota_handle);
-
-    if (dl_progress == ESP_ERR_HTTPS_OTA_IN_PROGRESS) {
-      ESP_LOGI(TAG, "Downloading... Progress: %d/%d bytes (%.1f%%)", bytes_read, total_size,
-               (total_size > 0) ? (bytes_read * 100.0 / total_size) : 0);
-    } else if (dl_progress == ESP_OK) {
-      ESP_LOGI(TAG, "Download completed");
+    ota_chunk_t chunk;
+    xQueueReceive(pipeline->filled_chunks, &chunk, portMAX_DELAY);
+    if (chunk.len == 0) break;
+
+    if (pipeline->write_err == ESP_OK) {
+      const int64_t started_us = esp_timer_get_time();
+      pipeline->write_err = write_chunk(pipeline, &chunk);
+      telemetry_record(TELEMETRY_OTA_WRITE, esp_timer_get_time() - started_us);
+      if (pipeline->write_err != ESP_OK && pipeline->write_err != ESP_FIRMWARE_UP_TO_DATE) {
+        ESP_LOGE(TAG, "Flash write failed: %s", esp_err_to_name(pipeline->write_err));
+      }
+    }
+    xQueueSend(pipeline->free_chunks, &chunk, portMAX_DELAY);
+  }
+
+  telemetry_unregister_task(xTaskGetCurrentTaskHandle());
+  xTaskNotifyGive(pipeline->download_task);
+  vTaskDelete(NULL);
+}
+
+// Fills a free buffer from the stream and queues it for the writer, so the next read overlaps the flash write of
+// the previous buffer. The read blocks on the socket rather than on a fixed delay.
+static esp_err_t download_firmware(esp_http_client_handle_t client, ota_pipeline_t* pipeline, const int64_t total_size) {
+  esp_err_t err = ESP_OK;
+  size_t bytes_read = pipeline->write_offset;
+  int last_percent = -10;
+  int64_t last_progress_us = 0;
+  bool writer_started = false;
+
+  power_manager_demand(POWER_DEMAND_OTA, true);
+  while (err == ESP_OK) {
+    ota_chunk_t chunk;
+    xQueueReceive(pipeline->free_chunks, &chunk, portMAX_DELAY);
+    chunk.len = 0;
+
+    int read = 0;
+    const int64_t started_us = esp_timer_get_time();
+    while (chunk.len < CONFIG_OTA_WRITE_BUFFER_SIZE &&
+      (read = esp_http_client_read(client, (char*)chunk.data + chunk.len, CONFIG_OTA_WRITE_BUFFER_SIZE - chunk.len)) > 0) {
+      chunk.len += read;
+    }
+    if (chunk.len > 0) telemetry_record(TELEMETRY_OTA_READ, esp_timer_get_time() - started_us);
+    if (read < 0) {
+      ESP_LOGE(TAG, "Error during download");
+      err = ESP_FAIL;
       break;
-    } else {
-      ESP_LOGE(TAG, "Error during download: %s", esp_err_to_name(dl_progress));
-      err = dl_progress;
+    }
+    if (pipeline->write_err != ESP_OK) {
+      err = pipeline->write_err;
       break;
     }
-    vTaskDelay(pdMS_TO_TICKS(50)); // TODO experiment with value
+    if (chunk.len == 0) {
+      xQueueSend(pipeline->free_chunks, &chunk, 0);
+      break;
+    }
+
+    if (!writer_started) {
+      if (xTaskCreate(ota_writer_task, "ota_writer", OTA_WRITER_STACK_SIZE, pipeline, uxTaskPriorityGet(NULL),
+                      &pipeline->writer_task) != pdPASS) {
+        err = ESP_ERR_NO_MEM;
+        break;
+      }
+      telemetry_register_task(pipeline->writer_task);
+      writer_started = true;
+    }
+
+    bytes_read += chunk.len;
+    xQueueSend(pipeline->filled_chunks, &chunk, portMAX_DELAY);
+
+    // Logged every 10 % of the download, a line per chunk would cost more than the chunk takes to arrive
+    const int percent = total_size > 0 ? (int)(bytes_read * 100 / total_size) : 0;
+    if (percent / 10 != last_percent / 10) {
+      ESP_LOGI(TAG, "Downloading... Progress: %u/%lld bytes (%d%%)", (unsigned)bytes_read, total_size, percent);
+      last_percent = percent;
+    }
+    if (esp_timer_get_time() - last_progress_us >= OTA_PROGRESS_INTERVAL_US) {
+      const status_ota_progress_t progress = {.bytes = bytes_read, .total = total_size, .done = false};
+      status_event_post(STATUS_EVENT_OTA_PROGRESS, &progress, sizeof(progress));
+      last_progress_us = esp_timer_get_time();
+    }
   }
 
-  if (err != ESP_OK) {
+  if (writer_started) {
+    // Drains the chunks still queued, then waits for the writer to exit
+    const ota_chunk_t end = {.data = NULL, .len = 0};
+    xQueueSend(pipeline->filled_chunks, &end, portMAX_DELAY);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    if (err == ESP_OK) err = pipeline->write_err;
+
+    if (err == ESP_OK && !esp_http_client_is_complete_data_received(client)) {
+      ESP_LOGE(TAG, "OTA data not fully received");
+      err = ESP_FAIL;
+    }
+    if (err == ESP_OK && pipeline->inflator != NULL && !pipeline->inflate_done) {
+      ESP_LOGE(TAG, "Compressed image ended early");
+      err = ESP_ERR_INVALID_SIZE;
+    }
+    if (err == ESP_OK && pipeline->inflator == NULL && total_size > 0 && pipeline->write_offset != (size_t)total_size) {
+      ESP_LOGE(TAG, "Image size mismatch: %u of %lld bytes", (unsigned)pipeline->write_offset, total_size);
+      err = ESP_ERR_INVALID_SIZE;
+    }
+    // Keeps what reached flash for the next attempt
+    if (err != ESP_OK && pipeline->write_offset > pipeline->saved_offset) save_resume_state(pipeline);
+  } else if (err == ESP_OK) {
+    ESP_LOGE(TAG, "Empty firmware image");
+    err = ESP_FAIL;
+  }
+
+  if (err == ESP_OK) {
+    ESP_LOGI(TAG, "Download completed, %u bytes written", (unsigned)pipeline->write_offset);
+  } else if (err != ESP_FIRMWARE_UP_TO_DATE) {
     ESP_LOGE(TAG, "Error: %s", esp_err_to_name(err));
   }
-  ESP_ERROR_CHECK(esp_wifi_set_ps(WIFI_PS_MIN_MODEM));
+  const status_ota_progress_t progress = {.bytes = bytes_read, .total = total_size, .done = true, .err = err};
+  status_event_post(STATUS_EVENT_OTA_PROGRESS, &progress, sizeof(progress));
+  power_manager_demand(POWER_DEMAND_OTA, false);
 
   return err;
 }
 
-static esp_err_t perform_ota_update() {
-  ESP_LOGI(TAG, "Starting OTA Update");
+static esp_err_t perform_ota_update(const ota_image_source_t* source) {
+  const ota_image_encoding_t encoding = source != NULL ? source->encoding : OTA_IMAGE_RAW;
+  ESP_LOGI(TAG, "Starting %s OTA Update", encoding == OTA_IMAGE_ZLIB ? "compressed" : "full image");
 
-  esp_https_ota_handle_t ota_handle = NULL;
-  esp_err_t err = create_ota_handle(&ota_handle);
-  if (err != ESP_OK)
+  ota_pipeline_t pipeline;
+  esp_err_t err = create_pipeline(&pipeline, encoding);
+  if (err != ESP_OK) {
+    destroy_pipeline(&pipeline);
     return ESP_FAIL;
+  }
+  // A compressed download overwrites the partition from the start, so progress of a raw one no longer applies
+  if (encoding == OTA_IMAGE_RAW) {
+    load_resume_state(&pipeline);
+  } else {
+    clear_resume_state(&pipeline);
+  }
 
-  if (new_version_available(&ota_handle) == ESP_FIRMWARE_UP_TO_DATE) {
-    esp_https_ota_abort(ota_handle);
-    return ESP_FIRMWARE_UP_TO_DATE;
+  esp_http_client_handle_t client = NULL;
+  int64_t total_size = 0;
+  if (open_firmware_stream(&client, source != NULL ? source->url : NULL, &pipeline, &total_size) != ESP_OK) {
+    destroy_pipeline(&pipeline);
+    return ESP_FAIL;
   }
 
-  err = download_firmware(&ota_handle);
-  if (err != ESP_OK)
+  const int64_t started_us = esp_timer_get_time();
+  err = download_firmware(client, &pipeline, total_size);
+  https_connection_release(client, err == ESP_OK); // The rest of an aborted response is not read
+  destroy_pipeline(&pipeline);
+  if (err == ESP_FIRMWARE_UP_TO_DATE) clear_resume_state(&pipeline);
+  if (err != ESP_OK) {
+    // Only frees the handle, what reached flash stays for a resume
+    if (pipeline.ota_begun) esp_ota_abort(pipeline.ota_handle);
     return err;
-
-  if (!esp_https_ota_is_complete_data_received(ota_handle)) {
-    ESP_LOGE(TAG, "OTA data not fully received");
-    err = ESP_FAIL;
   }
 
-  if (err == ESP_OK && esp_https_ota_finish(ota_handle) == ESP_OK) {
+  ESP_LOGI(TAG, "Image downloaded and written in %lld ms", (esp_timer_get_time() - started_us) / 1000);
+  // Verifies the whole image, resumed or not, before it is made bootable
+  err = esp_ota_end(pipeline.ota_handle);
+  if (err == ESP_OK) err = esp_ota_set_boot_partition(pipeline.partition);
+  clear_resume_state(&pipeline);
+  if (err == ESP_OK) {
     ESP_LOGI(TAG, "OTA successful, restarting...");
     vTaskDelay(pdMS_TO_TICKS(1000));
     esp_restart();
   }
 
-  esp_https_ota_abort(ota_handle);
+  ESP_LOGE(TAG, "Failed to set boot partition: %s", esp_err_to_name(err));
   return err;
 }
 
-void init_ota_task() {
+esp_err_t ota_download_perform(const ota_image_source_t* source) {
   wifi_manager_t* wifi_manager = get_wifi_manager();
   if (wifi_manager == NULL) {
     ESP_LOGE(TAG, "Wi-Fi not initialized");
     managers_release();
-    vTaskDelete(NULL);
-    return;
+    return ESP_ERR_INVALID_STATE;
   }
 
   wifi_manager_state_t wifi_state = wifi_manager_get_state(wifi_manager);
   managers_release();
   if ((wifi_state & WIFI_MANAGER_STATE_STA_IP_RECEIVED) == 0) {
     ESP_LOGE(TAG, "Wi-Fi not connected");
-    vTaskDelete(NULL);
-    return;
-  }
-
-  ESP_LOGI(TAG, "Initializing OTA Task");
-
-  const esp_err_t response = perform_ota_update();
-  if (response == ESP_FAIL) {
-    ESP_LOGE(TAG, "Error: %s", esp_err_to_name(response));
+    return ESP_ERR_INVALID_STATE;
   }
 
+  const esp_err_t response = perform_ota_update(source);
   if (response == ESP_FIRMWARE_UP_TO_DATE) {
-    ESP_LOGW(TAG, "Firmware is already up-to-date. Please use 'version_check' next time");
-  } else {
-    ESP_LOGE(TAG, "Unhandled OTA state");
+    ESP_LOGW(TAG, "Firmware is already up-to-date");
+    return ESP_OK;
   }
 
-  vTaskDelete(NULL);
-  ESP_LOGI(TAG, "Done");
+  ESP_LOGE(TAG, "Error: %s", esp_err_to_name(response));
+  return response;
 }
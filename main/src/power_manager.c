@@ -0,0 +1,279 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "power_manager.h"
+
+#include "state.h"
+#include "status_event.h"
+#include "web_page_manager.h"
+#include "wifi_manager.h"
+
+#include <esp_event.h>
+#include <esp_log.h>
+#include <esp_pm.h>
+#include <esp_timer.h>
+#include <esp_wifi.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
+
+static const char* TAG = "POWER";
+
+#ifdef CONFIG_POWER_LIGHT_SLEEP
+#define POWER_LIGHT_SLEEP_ENABLED true
+#else
+#define POWER_LIGHT_SLEEP_ENABLED false
+#endif
+
+#ifdef CONFIG_POWER_STA_MAX_MODEM
+#define POWER_STA_IDLE_MODEM WIFI_PS_MAX_MODEM // Wakes every CONFIG_POWER_STA_LISTEN_INTERVAL beacons
+#else
+#define POWER_STA_IDLE_MODEM WIFI_PS_MIN_MODEM
+#endif
+
+#ifdef CONFIG_POWER_SUSPEND_PORTAL
+#define POWER_SUSPEND_PORTAL_ENABLED true
+#else
+#define POWER_SUSPEND_PORTAL_ENABLED false
+#endif
+
+#define PORTAL_RETRY_MS 200 // Delay before a portal request that found the queue full is made again
+
+typedef struct
+{
+  const char* name;
+  wifi_ps_type_t modem;
+  bool cpu_max;
+} power_profile_config_t;
+
+static const power_profile_config_t profiles[] = {
+  [POWER_PROFILE_PERFORMANCE] = {.name = "performance", .modem = WIFI_PS_NONE, .cpu_max = true},
+  [POWER_PROFILE_STA_IDLE] = {.name = "STA idle", .modem = POWER_STA_IDLE_MODEM, .cpu_max = false},
+  [POWER_PROFILE_IDLE] = {.name = "idle", .modem = WIFI_PS_MIN_MODEM, .cpu_max = false},
+};
+
+// Inputs of the policy and what it last applied, guarded by mutex once started
+typedef struct
+{
+  SemaphoreHandle_t mutex;
+  esp_pm_lock_handle_t cpu_lock; // NULL without frequency scaling
+  bool cpu_lock_held;
+  power_profile_t profile;
+  bool applied;
+  uint32_t demands;
+  uint32_t wifi_state;
+  uint16_t ap_clients;
+  bool portal_running; // As last requested
+  esp_timer_handle_t portal_retry_timer;
+} power_state_t;
+
+static power_state_t power = {
+  .mutex = NULL,
+  .cpu_lock = NULL,
+  .cpu_lock_held = false,
+  .profile = POWER_PROFILE_IDLE,
+  .applied = false,
+  .demands = 0,
+  .wifi_state = 0,
+  .ap_clients = 0,
+  .portal_running = true, // Started by the boot sequence
+  .portal_retry_timer = NULL
+};
+
+static void configure_frequency_scaling();
+static uint16_t count_ap_clients();
+static power_profile_t select_profile();
+static void update_locked();
+static void apply_profile(power_profile_t profile);
+static void update_portal();
+static void portal_retry_timer_callback(void* arg);
+static void status_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+
+esp_err_t power_manager_start() {
+  if (power.mutex != NULL) return ESP_OK;
+
+  power.mutex = xSemaphoreCreateMutex();
+  if (power.mutex == NULL) {
+    ESP_LOGE(TAG, "Failed to create power manager mutex");
+    return ESP_ERR_NO_MEM;
+  }
+
+  configure_frequency_scaling();
+
+  if (POWER_SUSPEND_PORTAL_ENABLED) {
+    const esp_timer_create_args_t timer_args = {
+      .callback = portal_retry_timer_callback,
+      .arg = NULL,
+      .name = "portal_retry"
+    };
+    if (esp_timer_create(&timer_args, &power.portal_retry_timer) != ESP_OK) power.portal_retry_timer = NULL;
+  }
+
+  // The default event loop is created with the Wi-Fi manager
+  esp_err_t err = esp_event_handler_instance_register(STATUS_EVENT, STATUS_EVENT_WIFI_STATE, &status_event_handler, NULL,
+                                                      NULL);
+  if (err == ESP_OK) {
+    err = esp_event_handler_instance_register(WIFI_EVENT, WIFI_EVENT_AP_STACONNECTED, &wifi_event_handler, NULL, NULL);
+  }
+  if (err == ESP_OK) {
+    err = esp_event_handler_instance_register(WIFI_EVENT, WIFI_EVENT_AP_STADISCONNECTED, &wifi_event_handler, NULL,
+                                              NULL);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Failed to subscribe to Wi-Fi events (%s)", esp_err_to_name(err));
+    return err;
+  }
+
+  wifi_manager_t* wifi_manager = get_wifi_manager();
+  const uint32_t wifi_state = wifi_manager_get_state(wifi_manager);
+  managers_release();
+
+  xSemaphoreTake(power.mutex, portMAX_DELAY);
+  power.wifi_state = wifi_state;
+  power.ap_clients = count_ap_clients();
+  update_locked();
+  xSemaphoreGive(power.mutex);
+  return ESP_OK;
+}
+
+void power_manager_demand(const power_demand_t demand, const bool active) {
+  // Recorded for the start, nothing is applied before it
+  if (power.mutex == NULL) {
+    if (active) power.demands |= demand;
+    else power.demands &= ~demand;
+    return;
+  }
+
+  xSemaphoreTake(power.mutex, portMAX_DELAY);
+  if (active) power.demands |= demand;
+  else power.demands &= ~demand;
+  update_locked();
+  xSemaphoreGive(power.mutex);
+}
+
+power_profile_t power_manager_get_profile() {
+  return power.profile;
+}
+
+// The CPU scales down to CONFIG_POWER_MIN_CPU_FREQ_MHZ unless the performance profile holds it at the default
+static void configure_frequency_scaling() {
+  const esp_pm_config_t pm_config = {
+    .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+    .min_freq_mhz = CONFIG_POWER_MIN_CPU_FREQ_MHZ,
+    .light_sleep_enable = POWER_LIGHT_SLEEP_ENABLED
+  };
+
+  esp_err_t err = esp_pm_configure(&pm_config);
+  if (err == ESP_OK) err = esp_pm_lock_create(ESP_PM_CPU_FREQ_MAX, 0, "power_perf", &power.cpu_lock);
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "CPU frequency scaling unavailable (%s), only the modem is managed", esp_err_to_name(err));
+    power.cpu_lock = NULL;
+    return;
+  }
+  ESP_LOGI(TAG, "CPU scales between %d and %d MHz%s", CONFIG_POWER_MIN_CPU_FREQ_MHZ, CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+           POWER_LIGHT_SLEEP_ENABLED ? ", light sleep when idle" : "");
+}
+
+static uint16_t count_ap_clients() {
+  if ((power.wifi_state & WIFI_MANAGER_STATE_AP) == 0) return 0;
+
+  wifi_sta_list_t clients;
+  return esp_wifi_ap_get_sta_list(&clients) == ESP_OK ? clients.num : 0;
+}
+
+// A client on the AP is most likely using the portal, it gets the performance profile with the OTA download
+static power_profile_t select_profile() {
+  if (power.demands != 0 || power.ap_clients > 0) return POWER_PROFILE_PERFORMANCE;
+  if (power.wifi_state & WIFI_MANAGER_STATE_STA_IP_RECEIVED) return POWER_PROFILE_STA_IDLE;
+  return POWER_PROFILE_IDLE;
+}
+
+static void update_locked() {
+  const power_profile_t profile = select_profile();
+  if (!power.applied || profile != power.profile) apply_profile(profile);
+  update_portal();
+}
+
+static void apply_profile(const power_profile_t profile) {
+  const power_profile_config_t* config = &profiles[profile];
+
+  if (power.cpu_lock != NULL && config->cpu_max != power.cpu_lock_held) {
+    const esp_err_t err = config->cpu_max ? esp_pm_lock_acquire(power.cpu_lock) : esp_pm_lock_release(power.cpu_lock);
+    if (err == ESP_OK) power.cpu_lock_held = config->cpu_max;
+  }
+
+  // Modem sleep only applies to the station, the driver refuses it in some AP modes and keeps its previous setting
+  const esp_err_t err = esp_wifi_set_ps(config->modem);
+  if (err != ESP_OK) ESP_LOGW(TAG, "Modem sleep not changed: %s", esp_err_to_name(err));
+
+  ESP_LOGI(TAG, "Power profile: %s", config->name);
+  power.profile = profile;
+  power.applied = true;
+}
+
+// While the AP is up without a client nobody reaches the captive portal, its servers are stopped until one
+// associates. Without the AP the portal is served on the station, a suspended one is resumed.
+// Runs from event handlers with the mutex held, so the request is not waited on; a full queue is retried shortly.
+static void update_portal() {
+  if (!POWER_SUSPEND_PORTAL_ENABLED) return;
+
+  const bool want_portal = (power.wifi_state & WIFI_MANAGER_STATE_AP) == 0 || power.ap_clients > 0;
+  if (want_portal == power.portal_running) return;
+
+  web_page_manager_t* web_page_manager = get_web_page_manager();
+  const esp_err_t err = web_page_manager_try_request_state(
+    web_page_manager,
+    want_portal
+      ? WEB_PAGE_STATE_SERVING_REQUEST | WEB_PAGE_STATE_DNS_SERVER_REQUEST
+      : WEB_PAGE_STATE_NONE_REQUEST | WEB_PAGE_STATE_DNS_SERVER_NONE_REQUEST,
+    NULL, NULL);
+  managers_release();
+
+  if (err != ESP_OK) {
+    ESP_LOGW(TAG, "Portal %s request failed: %s", want_portal ? "resume" : "suspend", esp_err_to_name(err));
+    if (power.portal_retry_timer != NULL) {
+      esp_timer_stop(power.portal_retry_timer);
+      esp_timer_start_once(power.portal_retry_timer, PORTAL_RETRY_MS * 1000ULL);
+    }
+    return;
+  }
+  ESP_LOGI(TAG, "Portal %s", want_portal ? "resumed" : "suspended, no AP clients");
+  power.portal_running = want_portal;
+}
+
+static void portal_retry_timer_callback(void* arg) {
+  xSemaphoreTake(power.mutex, portMAX_DELAY);
+  update_portal();
+  xSemaphoreGive(power.mutex);
+}
+
+static void status_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+  const status_wifi_state_t* state = event_data;
+
+  xSemaphoreTake(power.mutex, portMAX_DELAY);
+  power.wifi_state = state->state;
+  power.ap_clients = count_ap_clients();
+  update_locked();
+  xSemaphoreGive(power.mutex);
+}
+
+// Counted from the driver's list rather than by event, so a missed event does not leave the count off for good
+static void wifi_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+  xSemaphoreTake(power.mutex, portMAX_DELAY);
+  power.ap_clients = count_ap_clients();
+  update_locked();
+  xSemaphoreGive(power.mutex);
+}
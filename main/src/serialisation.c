@@ -21,59 +21,53 @@
 #include <string.h>
 #include <stdio.h>
 
-static uint8_t* serialize_block(uint8_t* buffer, const void* data, size_t size);
+static uint8_t* serialize_record(uint8_t* buffer, uint8_t tag, const void* value, uint8_t len);
+static uint8_t* serialize_string_record(uint8_t* buffer, uint8_t tag, const char* str, uint8_t len);
+static size_t string_record_size(const char* str, uint8_t len);
+
+static uint8_t* serialize_record(uint8_t* buffer, const uint8_t tag, const void* value, const uint8_t len) {
+  buffer[0] = tag;
+  buffer[1] = len;
+  memcpy(buffer + TLV_HEADER_SIZE, value, len);
+  return buffer + TLV_HEADER_SIZE + len;
+}
 
-size_t serialize_wifi_settings(const wifi_settings_t* settings, uint8_t* buffer);
-size_t serialize_connectivity_configuration(const connectivity_configuration_t* config, uint8_t* buffer);
-size_t serialize_system_settings_configuration(const system_settings_configuration_t* config, uint8_t* buffer);
-size_t serialize_user_configuration(const user_configuration_t* config, uint8_t* buffer);
+// An empty or missing string is left out, it reads back as NULL either way
+static uint8_t* serialize_string_record(uint8_t* buffer, const uint8_t tag, const char* str, const uint8_t len) {
+  if (len == 0 || str == NULL) return buffer;
+  return serialize_record(buffer, tag, str, len);
+}
 
-static uint8_t* serialize_block(uint8_t* buffer, const void* data, size_t size) {
-  memcpy(buffer, data, size);
-  return buffer + size;
+static size_t string_record_size(const char* str, const uint8_t len) {
+  return len == 0 || str == NULL ? 0 : TLV_HEADER_SIZE + len;
 }
 
 size_t serialize_wifi_settings(const wifi_settings_t* settings, uint8_t* buffer) {
   uint8_t* ptr = buffer;
 
-  ptr = serialize_block(ptr, &settings->ssid_len, sizeof(settings->ssid_len));
-  ptr = serialize_block(ptr, &settings->password_len, sizeof(settings->password_len));
-
-  if (settings->ssid_len > 0 && settings->ssid != NULL) {
-    ptr = serialize_block(ptr, settings->ssid, settings->ssid_len);
-  }
-  if (settings->password_len > 0 && settings->password != NULL) {
-    ptr = serialize_block(ptr, settings->password, settings->password_len);
-  }
+  ptr = serialize_string_record(ptr, WIFI_TAG_SSID, settings->ssid, settings->ssid_len);
+  ptr = serialize_string_record(ptr, WIFI_TAG_PASSWORD, settings->password, settings->password_len);
 
   return ptr - buffer;
 }
 
-size_t serialize_connectivity_configuration(const connectivity_configuration_t* config, uint8_t* buffer) {
+size_t serialize_connectivity_header(const connectivity_configuration_t* config, uint8_t* buffer) {
   uint8_t* ptr = buffer;
 
-  ptr = serialize_block(ptr, &config->wifi_settings_count, sizeof(config->wifi_settings_count));
-  ptr = serialize_block(ptr, &config->ota_url_len, sizeof(config->ota_url_len));
-  ptr = serialize_block(ptr, &config->version_url_len, sizeof(config->version_url_len));
-
-  if (config->ota_url_len > 0 && config->ota_url != NULL) {
-    ptr = serialize_block(ptr, config->ota_url, config->ota_url_len);
-  }
-  if (config->version_url_len > 0 && config->version_url != NULL) {
-    ptr = serialize_block(ptr, config->version_url, config->version_url_len);
-  }
-
-  for (uint8_t i = 0; i < config->wifi_settings_count; i++) {
-    ptr += serialize_wifi_settings(&config->wifi_settings[i], ptr);
-  }
+  ptr = serialize_record(ptr, CON_TAG_WIFI_SETTINGS_COUNT, &config->wifi_settings_count,
+                         sizeof(config->wifi_settings_count));
+  ptr = serialize_string_record(ptr, CON_TAG_OTA_URL, config->ota_url, config->ota_url_len);
+  ptr = serialize_string_record(ptr, CON_TAG_VERSION_URL, config->version_url, config->version_url_len);
 
   return ptr - buffer;
 }
 
+// The level fits a byte, whatever the width of the enum
 size_t serialize_system_settings_configuration(const system_settings_configuration_t* config, uint8_t* buffer) {
   uint8_t* ptr = buffer;
 
-  ptr = serialize_block(ptr, &config->log_level, sizeof(config->log_level));
+  const uint8_t log_level = (uint8_t)config->log_level;
+  ptr = serialize_record(ptr, SYS_TAG_LOG_LEVEL, &log_level, sizeof(log_level));
 
   return ptr - buffer;
 }
@@ -81,59 +75,35 @@ size_t serialize_system_settings_configuration(const system_settings_configurati
 size_t serialize_user_configuration(const user_configuration_t* config, uint8_t* buffer) {
   uint8_t* ptr = buffer;
 
-  ptr = serialize_block(ptr, &config->unit_name_len, sizeof(config->unit_name_len));
-
-  if (config->unit_name_len > 0 && config->unit_name != NULL) {
-    ptr = serialize_block(ptr, config->unit_name, config->unit_name_len);
-  }
+  ptr = serialize_string_record(ptr, USR_TAG_UNIT_NAME, config->unit_name, config->unit_name_len);
 
   return ptr - buffer;
 }
 
-size_t serialize_unit_configuration(const unit_configuration_t* config, uint8_t* buffer) {
-  uint8_t* ptr = buffer;
-
-  ptr = serialize_block(ptr, &config->configuration_version, sizeof(config->configuration_version));
+size_t calculate_wifi_settings_size(const wifi_settings_t* settings) {
+  size_t size = 0;
 
-  ptr += serialize_connectivity_configuration(&config->con_config, ptr);
-  ptr += serialize_system_settings_configuration(&config->sys_config, ptr);
-  ptr += serialize_user_configuration(&config->user_config, ptr);
+  size += string_record_size(settings->ssid, settings->ssid_len);
+  size += string_record_size(settings->password, settings->password_len);
 
-  return ptr - buffer;
+  return size;
 }
 
-size_t calculate_unit_configuration_size(const unit_configuration_t* config) {
+size_t calculate_connectivity_header_size(const connectivity_configuration_t* config) {
   size_t size = 0;
 
-  size += sizeof(config->configuration_version);
-
-  const connectivity_configuration_t* con_cfg = &config->con_config;
+  size += TLV_HEADER_SIZE + sizeof(config->wifi_settings_count);
+  size += string_record_size(config->ota_url, config->ota_url_len);
+  size += string_record_size(config->version_url, config->version_url_len);
 
-  size += sizeof(con_cfg->wifi_settings_count);
-
-  size += sizeof(con_cfg->ota_url_len);
-  size += con_cfg->ota_url_len;
-
-  size += sizeof(con_cfg->version_url_len);
-  size += con_cfg->version_url_len;
-
-  for (uint32_t i = 0; i < con_cfg->wifi_settings_count; i++) {
-    const wifi_settings_t* wifi_setting = &con_cfg->wifi_settings[i];
-
-    size += sizeof(wifi_setting->ssid_len);
-    size += wifi_setting->ssid_len;
-
-    size += sizeof(wifi_setting->password_len);
-    size += wifi_setting->password_len;
-  }
-
-  const system_settings_configuration_t* sys_cfg = &config->sys_config;
-  size += sizeof(system_settings_configuration_t);
-
-  const user_configuration_t* usr_cfg = &config->user_config;
+  return size;
+}
 
-  size += sizeof(usr_cfg->unit_name_len);
-  size += usr_cfg->unit_name_len;
+size_t calculate_system_settings_configuration_size(const system_settings_configuration_t* config) {
+  (void)config;
+  return TLV_HEADER_SIZE + sizeof(uint8_t);
+}
 
-  return size;
+size_t calculate_user_configuration_size(const user_configuration_t* config) {
+  return string_record_size(config->unit_name, config->unit_name_len);
 }
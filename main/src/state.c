@@ -17,49 +17,154 @@
 #include "state.h"
 
 #include <esp_log.h>
-#include <esp_partition.h>
-#include <esp_spiffs.h>
-#include <sys/dirent.h>
+#include <string.h>
 
 static const char* TAG = "STATE";
 
+#define REQUEST_BUS_DEPTH 8
+#define REQUEST_BUS_POST_TIMEOUT_MS 100
+
+// Immutable copy of the configuration. The copy and everything it points to live in one allocation,
+// `config` is the first member so readers are handed a pointer to it.
+typedef struct
+{
+  unit_configuration_t config;
+  uint32_t refcount;
+} config_snapshot_t;
+
 static unit_configuration_t* shared_data = NULL;
+static config_snapshot_t* current_snapshot = NULL; // Holds one reference of its own while published
+static bool shared_data_changed = false; // Guarded by state_mutex, the release publishes a snapshot only when set
+static portMUX_TYPE snapshot_lock = portMUX_INITIALIZER_UNLOCKED;
 static managers_t* shared_managers = NULL;
 static SemaphoreHandle_t state_mutex = NULL;
 static SemaphoreHandle_t managers_mutex = NULL;
 EventGroupHandle_t system_event_group = NULL;
 
-static void init_spiffs() { // # TODO, relocate?
-  esp_vfs_spiffs_conf_t conf = {
-    .base_path = "/spiffs",
-    .partition_label = "ap_storage",
-    .max_files = 10, // Adjust as needed
-    .format_if_mount_failed = true
-  };
+// The helpers may also be handed a config other than the shared one, e.g. one being loaded, which is not published
+static void mark_changed(const unit_configuration_t* const config) {
+  if (config == shared_data) shared_data_changed = true;
+}
+
+static size_t copied_string_size(const char* str, const size_t len) {
+  return str != NULL ? len + 1 : 0;
+}
+
+// Copies len characters into the arena and NUL-terminates them, the source need not be terminated
+static char* copy_string(char** arena, const char* str, const size_t len) {
+  if (str == NULL) return NULL;
+
+  char* copy = *arena;
+  memcpy(copy, str, len);
+  copy[len] = '\0';
+  *arena += len + 1;
+  return copy;
+}
+
+static config_snapshot_t* create_snapshot(const unit_configuration_t* config) {
+  const connectivity_configuration_t* con_cfg = &config->con_config;
+  const size_t wifi_count = con_cfg->wifi_settings != NULL ? con_cfg->wifi_settings_count : 0;
+
+  size_t size = sizeof(config_snapshot_t) + wifi_count * sizeof(wifi_settings_t);
+  size += copied_string_size(con_cfg->ota_url, con_cfg->ota_url_len);
+  size += copied_string_size(con_cfg->version_url, con_cfg->version_url_len);
+  size += copied_string_size(config->user_config.unit_name, config->user_config.unit_name_len);
+  for (size_t i = 0; i < wifi_count; i++) {
+    size += copied_string_size(con_cfg->wifi_settings[i].ssid, con_cfg->wifi_settings[i].ssid_len);
+    size += copied_string_size(con_cfg->wifi_settings[i].password, con_cfg->wifi_settings[i].password_len);
+  }
 
-  esp_err_t ret = esp_vfs_spiffs_register(&conf);
-  if (ret != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to mount SPIFFS (%s)", esp_err_to_name(ret));
+  config_snapshot_t* snapshot = malloc(size);
+  if (snapshot == NULL) return NULL;
+
+  snapshot->config = *config;
+  snapshot->config.arena = NULL;
+  snapshot->config.arena_size = 0;
+  snapshot->refcount = 1;
+
+  connectivity_configuration_t* copy_con_cfg = &snapshot->config.con_config;
+  wifi_settings_t* wifi_settings = (wifi_settings_t*)(snapshot + 1);
+  char* arena = (char*)(wifi_settings + wifi_count);
+
+  copy_con_cfg->wifi_settings_count = wifi_count;
+  copy_con_cfg->wifi_settings = wifi_count > 0 ? wifi_settings : NULL;
+  for (size_t i = 0; i < wifi_count; i++) {
+    wifi_settings[i] = con_cfg->wifi_settings[i];
+    wifi_settings[i].ssid = copy_string(&arena, con_cfg->wifi_settings[i].ssid, con_cfg->wifi_settings[i].ssid_len);
+    wifi_settings[i].password =
+      copy_string(&arena, con_cfg->wifi_settings[i].password, con_cfg->wifi_settings[i].password_len);
   }
+  copy_con_cfg->ota_url = copy_string(&arena, con_cfg->ota_url, con_cfg->ota_url_len);
+  copy_con_cfg->version_url = copy_string(&arena, con_cfg->version_url, con_cfg->version_url_len);
+  snapshot->config.user_config.unit_name =
+    copy_string(&arena, config->user_config.unit_name, config->user_config.unit_name_len);
+
+  return snapshot;
+}
 
-  size_t total = 0, used = 0;
-  ret = esp_spiffs_info("ap_storage", &total, &used);
-  if (ret != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to get SPIFFS partition information (%s)", esp_err_to_name(ret));
-  } else {
-    ESP_LOGI(TAG, "Partition size: total: %d, used: %d", total, used);
+static void snapshot_unref(config_snapshot_t* snapshot) {
+  taskENTER_CRITICAL(&snapshot_lock);
+  const uint32_t remaining = --snapshot->refcount;
+  taskEXIT_CRITICAL(&snapshot_lock);
+
+  if (remaining == 0) free(snapshot);
+}
+
+// Called with state_mutex held, so snapshots are published in the order the changes were made
+static bool publish_snapshot() {
+  config_snapshot_t* snapshot = create_snapshot(shared_data);
+  if (snapshot == NULL) {
+    ESP_LOGE(TAG, "Failed to allocate configuration snapshot, readers keep the previous one");
+    return false;
   }
 
-  DIR* dir = opendir("/spiffs");
-  if (dir != NULL) {
-    struct dirent* ent;
-    while ((ent = readdir(dir)) != NULL) {
-      ESP_LOGI(TAG, "Found file: %s", ent->d_name);
-    }
-    closedir(dir);
-  } else {
-    ESP_LOGE(TAG, "Failed to open directory");
+  taskENTER_CRITICAL(&snapshot_lock);
+  config_snapshot_t* previous = current_snapshot;
+  current_snapshot = snapshot;
+  taskEXIT_CRITICAL(&snapshot_lock);
+
+  if (previous != NULL) snapshot_unref(previous);
+  return true;
+}
+
+QueueHandle_t request_bus_create() {
+  return xQueueCreate(REQUEST_BUS_DEPTH, sizeof(request_message_t));
+}
+
+void request_bus_delete(QueueHandle_t bus) {
+  if (bus != NULL) vQueueDelete(bus);
+}
+
+static esp_err_t post_request(QueueHandle_t bus, const uint32_t request, const request_callback_t callback,
+                              void* user_data, const TickType_t timeout) {
+  if (bus == NULL) return ESP_ERR_INVALID_STATE;
+
+  const request_message_t message = {.request = request, .callback = callback, .user_data = user_data};
+  if (xQueueSend(bus, &message, timeout) != pdTRUE) {
+    ESP_LOGE(TAG, "Request bus full, request 0x%lX not posted", (unsigned long)request);
+    return ESP_ERR_TIMEOUT;
   }
+  return ESP_OK;
+}
+
+// Bounded, a manager posting to its own full queue would otherwise wait on itself
+esp_err_t request_bus_post(QueueHandle_t bus, const uint32_t request, const request_callback_t callback,
+                           void* user_data) {
+  return post_request(bus, request, callback, user_data, pdMS_TO_TICKS(REQUEST_BUS_POST_TIMEOUT_MS));
+}
+
+esp_err_t request_bus_try_post(QueueHandle_t bus, const uint32_t request, const request_callback_t callback,
+                               void* user_data) {
+  return post_request(bus, request, callback, user_data, 0);
+}
+
+void request_bus_receive(QueueHandle_t bus, request_message_t* message) {
+  while (xQueueReceive(bus, message, portMAX_DELAY) != pdTRUE) {
+  }
+}
+
+void request_bus_complete(const request_message_t* message, const esp_err_t result) {
+  if (message->callback != NULL) message->callback(result, message->user_data);
 }
 
 void unit_config_init() {
@@ -77,6 +182,8 @@ void unit_config_init() {
       ESP_LOGE(TAG, "Failed to allocate memory for Shared-Data struct");
       abort();
     }
+
+    publish_snapshot();
   }
 
   if (shared_managers == NULL) {
@@ -93,8 +200,6 @@ void unit_config_init() {
       abort();
     }
   }
-
-  init_spiffs();
 }
 
 unit_configuration_t* unit_config_acquire() {
@@ -108,6 +213,87 @@ unit_configuration_t* unit_config_acquire() {
   return shared_data;
 }
 
+const unit_configuration_t* unit_config_snapshot_get() {
+  taskENTER_CRITICAL(&snapshot_lock);
+  config_snapshot_t* snapshot = current_snapshot;
+  if (snapshot != NULL) snapshot->refcount++;
+  taskEXIT_CRITICAL(&snapshot_lock);
+
+  if (snapshot == NULL) {
+    ESP_LOGE(TAG, "Shared-Data struct not initialized");
+    return NULL;
+  }
+  return &snapshot->config;
+}
+
+void unit_config_snapshot_put(const unit_configuration_t* const snapshot) {
+  if (snapshot == NULL) return;
+  snapshot_unref((config_snapshot_t*)snapshot);
+}
+
+bool unit_config_owns(const unit_configuration_t* const config, const void* const member) {
+  if (member == NULL || config == NULL || config->arena == NULL) return false;
+
+  const uint8_t* arena = config->arena;
+  return (const uint8_t*)member >= arena && (const uint8_t*)member < arena + config->arena_size;
+}
+
+// Members inside the arena go when the arena does, anything else was allocated on its own
+void unit_config_free_member(const unit_configuration_t* const config, void* const member) {
+  if (!unit_config_owns(config, member)) free(member);
+}
+
+esp_err_t unit_config_replace_string(unit_configuration_t* const config, char** const field, uint8_t* const field_len,
+                                     const char* const value) {
+  const size_t len = strlen(value);
+  if (len > UINT8_MAX) return ESP_ERR_INVALID_SIZE;
+
+  char* copy = malloc(len + 1);
+  if (copy == NULL) return ESP_ERR_NO_MEM;
+  memcpy(copy, value, len + 1);
+
+  unit_config_free_member(config, *field);
+  *field = copy;
+  *field_len = len;
+  mark_changed(config);
+  return ESP_OK;
+}
+
+void unit_config_free_wifi_settings(const unit_configuration_t* const config, wifi_settings_t* const wifi_settings,
+                                    const size_t count) {
+  if (wifi_settings == NULL) return;
+
+  for (size_t i = 0; i < count; i++) {
+    unit_config_free_member(config, wifi_settings[i].ssid);
+    unit_config_free_member(config, wifi_settings[i].password);
+  }
+  unit_config_free_member(config, wifi_settings);
+}
+
+void unit_config_replace_wifi_settings(unit_configuration_t* const config, wifi_settings_t* const wifi_settings,
+                                       const uint8_t count) {
+  connectivity_configuration_t* con_cfg = &config->con_config;
+  unit_config_free_wifi_settings(config, con_cfg->wifi_settings, con_cfg->wifi_settings_count);
+  con_cfg->wifi_settings = wifi_settings;
+  con_cfg->wifi_settings_count = count;
+  mark_changed(config);
+}
+
+void unit_config_free_members(unit_configuration_t* const config) {
+  connectivity_configuration_t* con_cfg = &config->con_config;
+  unit_config_free_wifi_settings(config, con_cfg->wifi_settings, con_cfg->wifi_settings_count);
+  unit_config_free_member(config, con_cfg->ota_url);
+  unit_config_free_member(config, con_cfg->version_url);
+  unit_config_free_member(config, config->user_config.unit_name);
+  free(config->arena);
+
+  *con_cfg = (connectivity_configuration_t){0};
+  config->user_config = (user_configuration_t){0};
+  config->arena = NULL;
+  config->arena_size = 0;
+  mark_changed(config);
+}
+
 void set_nvs_manager(nvs_manager_t* const nvs_manager) {
   if (shared_managers == NULL)
     ESP_LOGE(TAG, "Shared-Managers struct not initialized");
@@ -168,8 +354,14 @@ web_page_manager_t* get_web_page_manager() {
   return shared_managers->web_page_manager;
 }
 
+void unit_config_mark_changed() {
+  shared_data_changed = true;
+}
+
+// A failed publish leaves the flag set, so the next release tries again
 void unit_config_release() {
   if (state_mutex != NULL) {
+    if (shared_data_changed && publish_snapshot()) shared_data_changed = false;
     xSemaphoreGive(state_mutex);
   }
 }
@@ -181,7 +373,12 @@ void managers_release() {
 }
 
 void unit_config_cleanup() {
+  if (current_snapshot != NULL) {
+    snapshot_unref(current_snapshot);
+    current_snapshot = NULL;
+  }
   if (shared_data != NULL) {
+    unit_config_free_members(shared_data);
     free(shared_data);
     shared_data = NULL;
   }
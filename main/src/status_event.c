@@ -0,0 +1,28 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "status_event.h"
+
+#include <esp_log.h>
+
+static const char* TAG = "Status Event";
+
+ESP_EVENT_DEFINE_BASE(STATUS_EVENT);
+
+void status_event_post(const status_event_id_t id, const void* data, const size_t size) {
+  const esp_err_t err = esp_event_post(STATUS_EVENT, id, data, size, 0);
+  if (err != ESP_OK) ESP_LOGD(TAG, "Status event %d dropped: %s", id, esp_err_to_name(err));
+}
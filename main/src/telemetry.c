@@ -0,0 +1,234 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "telemetry.h"
+
+#include <esp_heap_caps.h>
+#include <esp_log.h>
+#include <esp_system.h>
+#include <esp_timer.h>
+#include <stdio.h>
+#include <string.h>
+
+static const char* TAG = "TELEMETRY";
+
+#define TELEMETRY_MAX_TASKS 8
+#define TELEMETRY_BUCKET_COUNT 8
+
+#ifdef CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+#define RUN_TIME_STATS_ENABLED true
+#else
+#define RUN_TIME_STATS_ENABLED false
+#endif
+
+typedef struct
+{
+  uint32_t count;
+  uint32_t max_us;
+  uint64_t total_us;
+  uint32_t buckets[TELEMETRY_BUCKET_COUNT];
+} histogram_t;
+
+// Upper bound of each bucket but the last, which holds everything longer. Each bucket is four times the one before,
+// from under a millisecond to over four seconds.
+static const uint32_t bucket_limits_us[TELEMETRY_BUCKET_COUNT - 1] = {
+  1000, 4000, 16000, 64000, 256000, 1000000, 4000000
+};
+
+static const char* const metric_names[TELEMETRY_METRIC_COUNT] = {
+  [TELEMETRY_HTTP_GET] = "http_get",
+  [TELEMETRY_HTTP_POST] = "http_post",
+  [TELEMETRY_NVS_COMMIT] = "nvs_commit",
+  [TELEMETRY_WIFI_SCAN] = "wifi_scan",
+  [TELEMETRY_OTA_READ] = "ota_read",
+  [TELEMETRY_OTA_WRITE] = "ota_write",
+};
+
+// Per-task figures, copied out while the task is known to still exist
+typedef struct
+{
+  char name[configMAX_TASK_NAME_LEN];
+  uint32_t stack_free;
+  uint32_t cpu_percent;
+} task_stats_t;
+
+static histogram_t histograms[TELEMETRY_METRIC_COUNT];
+static TaskHandle_t tasks[TELEMETRY_MAX_TASKS];
+static portMUX_TYPE telemetry_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t log_timer = NULL;
+
+static void log_timer_callback(void* arg);
+static cJSON* histogram_to_json(const histogram_t* histogram);
+static size_t take_snapshot(task_stats_t* task_stats, histogram_t* snapshot);
+
+void telemetry_record(const telemetry_metric_t metric, const int64_t duration_us) {
+  if (metric >= TELEMETRY_METRIC_COUNT) return;
+  const uint32_t us = duration_us < 0 ? 0 : duration_us > UINT32_MAX ? UINT32_MAX : (uint32_t)duration_us;
+
+  size_t bucket = 0;
+  while (bucket < TELEMETRY_BUCKET_COUNT - 1 && us >= bucket_limits_us[bucket]) bucket++;
+
+  taskENTER_CRITICAL(&telemetry_lock);
+  histogram_t* histogram = &histograms[metric];
+  histogram->count++;
+  histogram->total_us += us;
+  if (us > histogram->max_us) histogram->max_us = us;
+  histogram->buckets[bucket]++;
+  taskEXIT_CRITICAL(&telemetry_lock);
+}
+
+void telemetry_register_task(TaskHandle_t task) {
+  if (task == NULL) return;
+
+  taskENTER_CRITICAL(&telemetry_lock);
+  size_t free_slot = TELEMETRY_MAX_TASKS;
+  for (size_t i = 0; i < TELEMETRY_MAX_TASKS; i++) {
+    if (tasks[i] == task) free_slot = TELEMETRY_MAX_TASKS + 1; // Already registered
+    else if (tasks[i] == NULL && free_slot == TELEMETRY_MAX_TASKS) free_slot = i;
+  }
+  if (free_slot < TELEMETRY_MAX_TASKS) tasks[free_slot] = task;
+  taskEXIT_CRITICAL(&telemetry_lock);
+
+  if (free_slot == TELEMETRY_MAX_TASKS) ESP_LOGW(TAG, "No room to track task %s", pcTaskGetName(task));
+}
+
+void telemetry_unregister_task(TaskHandle_t task) {
+  taskENTER_CRITICAL(&telemetry_lock);
+  for (size_t i = 0; i < TELEMETRY_MAX_TASKS; i++) {
+    if (tasks[i] == task) tasks[i] = NULL;
+  }
+  taskEXIT_CRITICAL(&telemetry_lock);
+}
+
+// The tasks are read under the lock, which unregistering takes before a task is deleted, so no handle is used after
+// its task is gone. None of the reads block or allocate.
+static size_t take_snapshot(task_stats_t* const task_stats, histogram_t* const snapshot) {
+  size_t task_count = 0;
+  taskENTER_CRITICAL(&telemetry_lock);
+  for (size_t i = 0; i < TELEMETRY_MAX_TASKS; i++) {
+    if (tasks[i] == NULL) continue;
+
+    task_stats_t* stats = &task_stats[task_count++];
+    strlcpy(stats->name, pcTaskGetName(tasks[i]), sizeof(stats->name));
+    // Bytes, the stack type is a byte on the ESP32
+    stats->stack_free = uxTaskGetStackHighWaterMark(tasks[i]);
+#if RUN_TIME_STATS_ENABLED
+    stats->cpu_percent = ulTaskGetRunTimePercent(tasks[i]);
+#else
+    stats->cpu_percent = 0;
+#endif
+  }
+  memcpy(snapshot, histograms, sizeof(histograms));
+  taskEXIT_CRITICAL(&telemetry_lock);
+  return task_count;
+}
+
+static cJSON* histogram_to_json(const histogram_t* histogram) {
+  cJSON* json = cJSON_CreateObject();
+  if (json == NULL) return NULL;
+
+  cJSON_AddNumberToObject(json, "count", histogram->count);
+  cJSON_AddNumberToObject(json, "mean_us", histogram->count > 0 ? (double)(histogram->total_us / histogram->count) : 0);
+  cJSON_AddNumberToObject(json, "max_us", histogram->max_us);
+  cJSON* buckets = cJSON_AddArrayToObject(json, "buckets");
+  for (size_t i = 0; buckets != NULL && i < TELEMETRY_BUCKET_COUNT; i++) {
+    cJSON_AddItemToArray(buckets, cJSON_CreateNumber(histogram->buckets[i]));
+  }
+  return json;
+}
+
+// Only the figures are copied under the lock, cJSON allocates and may not run in a critical section
+cJSON* telemetry_to_json() {
+  task_stats_t task_stats[TELEMETRY_MAX_TASKS];
+  histogram_t snapshot[TELEMETRY_METRIC_COUNT];
+  const size_t task_count = take_snapshot(task_stats, snapshot);
+
+  cJSON* json = cJSON_CreateObject();
+  if (json == NULL) return NULL;
+
+  cJSON* heap = cJSON_AddObjectToObject(json, "heap");
+  if (heap != NULL) {
+    cJSON_AddNumberToObject(heap, "free", esp_get_free_heap_size());
+    cJSON_AddNumberToObject(heap, "min_free", esp_get_minimum_free_heap_size());
+    cJSON_AddNumberToObject(heap, "largest_block", heap_caps_get_largest_free_block(MALLOC_CAP_8BIT));
+  }
+
+  cJSON* task_list = cJSON_AddArrayToObject(json, "tasks");
+  for (size_t i = 0; task_list != NULL && i < task_count; i++) {
+    cJSON* task = cJSON_CreateObject();
+    if (task == NULL) continue;
+    cJSON_AddStringToObject(task, "name", task_stats[i].name);
+    cJSON_AddNumberToObject(task, "stack_free", task_stats[i].stack_free);
+#if RUN_TIME_STATS_ENABLED
+    cJSON_AddNumberToObject(task, "cpu_percent", task_stats[i].cpu_percent);
+#endif
+    cJSON_AddItemToArray(task_list, task);
+  }
+
+  cJSON* limits = cJSON_AddArrayToObject(json, "bucket_limits_us");
+  for (size_t i = 0; limits != NULL && i < TELEMETRY_BUCKET_COUNT - 1; i++) {
+    cJSON_AddItemToArray(limits, cJSON_CreateNumber(bucket_limits_us[i]));
+  }
+  cJSON* timings = cJSON_AddObjectToObject(json, "timings");
+  for (size_t i = 0; timings != NULL && i < TELEMETRY_METRIC_COUNT; i++) {
+    cJSON_AddItemToObject(timings, metric_names[i], histogram_to_json(&snapshot[i]));
+  }
+  return json;
+}
+
+// One line, for the serial log or a log collector, with the headline numbers only
+static void log_timer_callback(void* arg) {
+  char stacks[160] = "";
+  size_t used = 0;
+
+  task_stats_t task_stats[TELEMETRY_MAX_TASKS];
+  histogram_t snapshot[TELEMETRY_METRIC_COUNT];
+  const size_t task_count = take_snapshot(task_stats, snapshot);
+
+  for (size_t i = 0; i < task_count && used < sizeof(stacks); i++) {
+    const int written = snprintf(stacks + used, sizeof(stacks) - used, " %s:%u", task_stats[i].name,
+                                 (unsigned)task_stats[i].stack_free);
+    if (written > 0) used += (size_t)written;
+  }
+
+  ESP_LOGI(TAG, "heap free %lu min %lu | stack free%s | max ms get %lu post %lu nvs %lu scan %lu ota %lu/%lu",
+           (unsigned long)esp_get_free_heap_size(), (unsigned long)esp_get_minimum_free_heap_size(), stacks,
+           (unsigned long)(snapshot[TELEMETRY_HTTP_GET].max_us / 1000),
+           (unsigned long)(snapshot[TELEMETRY_HTTP_POST].max_us / 1000),
+           (unsigned long)(snapshot[TELEMETRY_NVS_COMMIT].max_us / 1000),
+           (unsigned long)(snapshot[TELEMETRY_WIFI_SCAN].max_us / 1000),
+           (unsigned long)(snapshot[TELEMETRY_OTA_READ].max_us / 1000),
+           (unsigned long)(snapshot[TELEMETRY_OTA_WRITE].max_us / 1000));
+}
+
+esp_err_t telemetry_start_logging() {
+  if (CONFIG_TELEMETRY_LOG_INTERVAL_S == 0 || log_timer != NULL) return ESP_OK;
+
+  const esp_timer_create_args_t timer_args = {
+    .callback = log_timer_callback,
+    .arg = NULL,
+    .name = "telemetry_log"
+  };
+  esp_err_t err = esp_timer_create(&timer_args, &log_timer);
+  if (err != ESP_OK) return err;
+
+  err = esp_timer_start_periodic(log_timer, CONFIG_TELEMETRY_LOG_INTERVAL_S * 1000000ULL);
+  if (err != ESP_OK) {
+    esp_timer_delete(log_timer);
+    log_timer = NULL;
+  }
+  return err;
+}
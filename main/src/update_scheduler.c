@@ -0,0 +1,127 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "update_scheduler.h"
+#include "ota_download.h"
+#include "state.h"
+#include "telemetry.h"
+#include "version_check.h"
+#include "wifi_manager.h"
+
+#include <esp_log.h>
+#include <esp_random.h>
+#include <esp_wifi.h>
+
+static const char* TAG = "UPDATE_SCHEDULER";
+
+#define UPDATE_SCHEDULER_STACK_SIZE 6144 // The TLS handshake, the version check and the OTA download all run on it
+
+static uint32_t jittered_delay_ms(uint32_t base_s, uint32_t jitter_s);
+static void delay_ms(uint32_t ms);
+static bool update_allowed();
+static esp_err_t run_update(ota_image_source_t* source);
+static void update_scheduler_task(void* arg);
+
+static uint32_t jittered_delay_ms(const uint32_t base_s, const uint32_t jitter_s) {
+  const uint32_t jitter_ms = jitter_s * 1000U;
+  return base_s * 1000U + (jitter_ms > 0 ? esp_random() % (jitter_ms + 1) : 0);
+}
+
+// pdMS_TO_TICKS() multiplies in TickType_t and wraps for delays of days at a 1 kHz tick, so the ticks are computed
+// in 64 bits and waited for in chunks that fit
+static void delay_ms(const uint32_t ms) {
+  uint64_t ticks = (uint64_t)ms * configTICK_RATE_HZ / 1000U;
+  while (ticks > 0) {
+    const TickType_t chunk = ticks > portMAX_DELAY - 1 ? portMAX_DELAY - 1 : (TickType_t)ticks;
+    vTaskDelay(chunk);
+    ticks -= chunk;
+  }
+}
+
+static bool update_allowed() {
+  wifi_manager_t* wifi_manager = get_wifi_manager();
+  const wifi_manager_state_t wifi_state =
+    wifi_manager != NULL ? wifi_manager_get_state(wifi_manager) : WIFI_MANAGER_STATE_NONE;
+  managers_release();
+  if ((wifi_state & WIFI_MANAGER_STATE_STA_IP_RECEIVED) == 0) {
+    ESP_LOGD(TAG, "Wi-Fi not connected, update check deferred");
+    return false;
+  }
+
+  // A download over a marginal link is likely to stall, and to slow down everything else on it
+  wifi_ap_record_t ap_info;
+  if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) return false;
+  if (ap_info.rssi < CONFIG_UPDATE_MIN_RSSI) {
+    ESP_LOGI(TAG, "Weak link (%d dBm), update check deferred", ap_info.rssi);
+    return false;
+  }
+
+  // A client on the provisioning AP is most likely configuring the device, an update would restart it underneath
+  if ((wifi_state & WIFI_MANAGER_STATE_AP) != 0) {
+    wifi_sta_list_t stations;
+    if (esp_wifi_ap_get_sta_list(&stations) == ESP_OK && stations.num > 0) {
+      ESP_LOGI(TAG, "AP client connected, update check deferred");
+      return false;
+    }
+  }
+  return true;
+}
+
+static esp_err_t run_update(ota_image_source_t* source) {
+  *source = (ota_image_source_t){.encoding = OTA_IMAGE_RAW};
+
+  bool update_available = false;
+  const esp_err_t err = version_check_run(source, &update_available);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Version check failed: %s", esp_err_to_name(err));
+    return err;
+  }
+  if (!update_available) return ESP_OK;
+
+  // Without a compressed image the raw one is downloaded from the configured URL. Only returns when the update did
+  // not happen.
+  return ota_download_perform(source->encoding == OTA_IMAGE_RAW ? NULL : source);
+}
+
+// One task for the life of the device, checks and downloads run on its stack instead of on tasks of their own
+static void update_scheduler_task(void* arg) {
+  ota_image_source_t source;
+
+  // The first check already lands somewhere in the jitter window, so devices booting together do not all ask at once
+  uint32_t next_check_ms = jittered_delay_ms(0, CONFIG_UPDATE_CHECK_JITTER_S);
+  for (;;) {
+    delay_ms(next_check_ms);
+
+    if (!update_allowed()) {
+      next_check_ms = jittered_delay_ms(CONFIG_UPDATE_CHECK_RETRY_S, CONFIG_UPDATE_CHECK_RETRY_S);
+    } else if (run_update(&source) != ESP_OK) {
+      next_check_ms = jittered_delay_ms(CONFIG_UPDATE_CHECK_RETRY_S, CONFIG_UPDATE_CHECK_RETRY_S);
+    } else {
+      next_check_ms = jittered_delay_ms(CONFIG_UPDATE_CHECK_INTERVAL_S, CONFIG_UPDATE_CHECK_JITTER_S);
+      ESP_LOGI(TAG, "Next update check in %lu s", (unsigned long)(next_check_ms / 1000));
+    }
+  }
+}
+
+esp_err_t update_scheduler_start(const UBaseType_t priority) {
+  TaskHandle_t task = NULL;
+  if (xTaskCreate(update_scheduler_task, TAG, UPDATE_SCHEDULER_STACK_SIZE, NULL, priority, &task) != pdPASS) {
+    ESP_LOGE(TAG, "Failed to create update scheduler task");
+    return ESP_ERR_NO_MEM;
+  }
+  telemetry_register_task(task);
+  return ESP_OK;
+}
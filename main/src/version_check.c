@@ -16,32 +16,204 @@
 
 #include "version_check.h"
 #include "configuration.h"
+#include "https_connection.h"
 #include "ota_download.h"
-#include "wifi_manager.h"
 
-#include <cJSON.h>
 #include <esp_http_client.h>
 #include <esp_log.h>
 #include <esp_ota_ops.h>
 #include <esp_partition.h>
+#include <esp_rom_crc.h>
 #include <esp_tls.h>
+#include <nvs_manager.h>
 #include <state.h>
 #include <string.h>
-#include <sys/param.h>
+#include <strings.h>
 
 static const char* TAG = "VERSION_CHECK";
 
-extern const uint8_t server_cert_pem_start[] asm("_binary_ca_cert_pem_start");
-extern const uint8_t server_cert_pem_end[] asm("_binary_ca_cert_pem_end");
-
-#define ESP_NEW_FIRMWARE_VERSION_FOUND 3
 #define MAX_VERSION_STRING_LENGTH 32
-#define MAX_HTTP_OUTPUT_BUFFER 128
+#define MAX_ETAG_LENGTH 64
+#define MAX_LAST_MODIFIED_LENGTH 40 // "Sun, 06 Nov 1994 08:49:37 GMT"
+#define MAX_JSON_KEY_LENGTH 16 // Longer keys are never ones that are looked for
 #define JSON_VERSION_TAG "version"
+#define JSON_COMPRESSED_URL_TAG "compressed_url" // Optional, a zlib compressed image of the same version
+#define VERSION_CACHE_KEY "version_cache"
+
+#ifdef CONFIG_OTA_COMPRESSED_IMAGES
+#define OTA_COMPRESSED_ENABLED true
+#else
+#define OTA_COMPRESSED_ENABLED false
+#endif
+
+// The validators of the last full response, with what it contained, so a 304 can be answered from NVS
+typedef struct {
+  uint32_t url_crc; // Of the version URL the record belongs to
+  char etag[MAX_ETAG_LENGTH];
+  char last_modified[MAX_LAST_MODIFIED_LENGTH];
+  char version[MAX_VERSION_STRING_LENGTH];
+  char compressed_url[MAX_URL_LENGTH];
+} version_cache_t;
+
+typedef struct {
+  const char* key;
+  char* value;
+  size_t size;
+  bool found;
+} json_field_t;
+
+// Scans the body as it arrives for string members of the top level object, nothing else of it is kept
+typedef struct {
+  uint8_t depth;
+  bool in_string;
+  bool escape;
+  bool expect_key;
+  bool overflow;
+  char* target; // Where the current string is copied to, NULL when it is skipped
+  size_t target_size;
+  size_t target_len;
+  json_field_t* field; // Set while the string is the value of a wanted member
+  char key[MAX_JSON_KEY_LENGTH];
+} json_scanner_t;
+
+typedef struct {
+  json_scanner_t scanner;
+  json_field_t fields[2];
+  char etag[MAX_ETAG_LENGTH];
+  char last_modified[MAX_LAST_MODIFIED_LENGTH];
+  char version[MAX_VERSION_STRING_LENGTH];
+  char compressed_url[MAX_URL_LENGTH];
+} version_response_t;
+
+static void reset_response(version_response_t* response);
+static void begin_json_string(json_scanner_t* scanner, version_response_t* response);
+static void append_json_char(json_scanner_t* scanner, char c);
+static void end_json_string(json_scanner_t* scanner);
+static void scan_json(version_response_t* response, const char* data, int len);
+static void copy_header(char* dest, size_t size, const char* value);
+static esp_err_t version_check_http_event_handler(esp_http_client_event_t* evt);
+static bool load_version_cache(version_cache_t* cache, uint32_t url_crc);
+static void store_version_cache(const version_response_t* response, uint32_t url_crc);
+static void set_version_result(const char* version, const char* compressed_url, char* out_version,
+                               ota_image_source_t* source);
+static esp_err_t get_https_version(char const* url_version, char* version, ota_image_source_t* source);
+
+static void reset_response(version_response_t* response) {
+  response->scanner = (json_scanner_t){0};
+  response->fields[0] = (json_field_t){JSON_VERSION_TAG, response->version, sizeof(response->version), false};
+  response->fields[1] =
+    (json_field_t){JSON_COMPRESSED_URL_TAG, response->compressed_url, sizeof(response->compressed_url), false};
+  response->etag[0] = '\0';
+  response->last_modified[0] = '\0';
+  response->version[0] = '\0';
+  response->compressed_url[0] = '\0';
+}
+
+static void begin_json_string(json_scanner_t* scanner, version_response_t* response) {
+  scanner->in_string = true;
+  scanner->escape = false;
+  scanner->overflow = false;
+  scanner->target = NULL;
+  scanner->target_len = 0;
+  scanner->field = NULL;
+  if (scanner->depth != 1) return; // Only members of the top level object are of interest
+
+  if (scanner->expect_key) {
+    scanner->target = scanner->key;
+    scanner->target_size = sizeof(scanner->key);
+    return;
+  }
+
+  for (size_t i = 0; i < sizeof(response->fields) / sizeof(response->fields[0]); i++) {
+    if (strcmp(scanner->key, response->fields[i].key) == 0) {
+      scanner->field = &response->fields[i];
+      scanner->target = scanner->field->value;
+      scanner->target_size = scanner->field->size;
+      return;
+    }
+  }
+}
+
+static void append_json_char(json_scanner_t* scanner, const char c) {
+  if (scanner->target == NULL || scanner->overflow) return;
+  if (scanner->target_len + 1 >= scanner->target_size) {
+    scanner->overflow = true;
+    return;
+  }
+  scanner->target[scanner->target_len++] = c;
+}
+
+// A string that did not fit, or used an escape that is not decoded, is dropped rather than cut short
+static void end_json_string(json_scanner_t* scanner) {
+  scanner->in_string = false;
+  if (scanner->target == NULL) return;
+
+  scanner->target[scanner->overflow ? 0 : scanner->target_len] = '\0';
+  if (scanner->field != NULL) {
+    scanner->field->found = !scanner->overflow;
+    if (scanner->overflow) ESP_LOGW(TAG, "'%s' in json response is too long", scanner->field->key);
+  } else {
+    scanner->expect_key = false; // The string was a key, its value follows
+  }
+  scanner->target = NULL;
+}
+
+// Fed every piece of the body in turn, also of chunked responses, so it needs no buffer for the whole document
+static void scan_json(version_response_t* response, const char* data, const int len) {
+  json_scanner_t* scanner = &response->scanner;
+  for (int i = 0; i < len; i++) {
+    const char c = data[i];
+    if (scanner->in_string) {
+      if (scanner->escape) {
+        scanner->escape = false;
+        if (c == '"' || c == '\\' || c == '/') {
+          append_json_char(scanner, c);
+        } else {
+          scanner->overflow = true; // Not expected in a version or an URL
+        }
+      } else if (c == '\\') {
+        scanner->escape = true;
+      } else if (c == '"') {
+        end_json_string(scanner);
+      } else {
+        append_json_char(scanner, c);
+      }
+      continue;
+    }
+
+    switch (c) {
+      case '"':
+        begin_json_string(scanner, response);
+        break;
+      case '{':
+      case '[':
+        if (scanner->depth < UINT8_MAX) scanner->depth++;
+        if (scanner->depth == 1) scanner->expect_key = (c == '{');
+        break;
+      case '}':
+      case ']':
+        if (scanner->depth > 0) scanner->depth--;
+        break;
+      case ',':
+        if (scanner->depth == 1) scanner->expect_key = true;
+        break;
+      default:
+        break;
+    }
+  }
+}
+
+// A validator that does not fit is not sent back at all, a shortened one would never match
+static void copy_header(char* dest, const size_t size, const char* value) {
+  if (strlen(value) < size) {
+    strlcpy(dest, value, size);
+  } else {
+    dest[0] = '\0';
+  }
+}
 
 static esp_err_t version_check_http_event_handler(esp_http_client_event_t* evt) {
-  static char* output_buffer = NULL; // Buffer for HTTP response
-  static int output_len = 0; // Bytes read
+  version_response_t* response = evt->user_data;
 
   switch (evt->event_id) {
     case HTTP_EVENT_ERROR:
@@ -54,50 +226,25 @@ static esp_err_t version_check_http_event_handler(esp_http_client_event_t* evt)
 
     case HTTP_EVENT_HEADER_SENT:
       ESP_LOGD(TAG, "HTTP_EVENT_HEADER_SENT");
+      reset_response(response); // Each attempt or redirect starts a new response
       break;
 
     case HTTP_EVENT_ON_HEADER:
       ESP_LOGD(TAG, "HTTP_EVENT_ON_HEADER, key=%s, value=%s", evt->header_key, evt->header_value);
+      if (strcasecmp(evt->header_key, "ETag") == 0) {
+        copy_header(response->etag, sizeof(response->etag), evt->header_value);
+      } else if (strcasecmp(evt->header_key, "Last-Modified") == 0) {
+        copy_header(response->last_modified, sizeof(response->last_modified), evt->header_value);
+      }
       break;
 
     case HTTP_EVENT_ON_DATA:
-      ESP_LOGI(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
-
-      if (output_len == 0 && evt->user_data) {
-        memset(evt->user_data, 0, MAX_HTTP_OUTPUT_BUFFER);
-      }
-
-      if (!esp_http_client_is_chunked_response(evt->client)) {
-        int copy_len = 0;
-        if (evt->user_data) {
-          copy_len = MIN(evt->data_len, MAX_HTTP_OUTPUT_BUFFER - output_len);
-          if (copy_len) {
-            memcpy(evt->user_data + output_len, evt->data, copy_len);
-          }
-        } else {
-          const int content_len = (int)esp_http_client_get_content_length(evt->client);
-          if (!output_buffer) {
-            output_buffer = (char*)calloc(content_len + 1, sizeof(char));
-            if (!output_buffer) {
-              ESP_LOGE(TAG, "Failed to allocate memory for output buffer");
-              return ESP_FAIL;
-            }
-          }
-          copy_len = MIN(evt->data_len, content_len - output_len);
-          if (copy_len) {
-            memcpy(output_buffer + output_len, evt->data, copy_len);
-          }
-        }
-        output_len += copy_len;
-      }
+      ESP_LOGD(TAG, "HTTP_EVENT_ON_DATA, len=%d", evt->data_len);
+      scan_json(response, evt->data, evt->data_len);
       break;
 
     case HTTP_EVENT_ON_FINISH:
       ESP_LOGD(TAG, "HTTP_EVENT_ON_FINISH");
-      if (output_buffer) {
-        free(output_buffer);
-      }
-      output_len = 0;
       break;
 
     case HTTP_EVENT_DISCONNECTED:
@@ -108,10 +255,6 @@ static esp_err_t version_check_http_event_handler(esp_http_client_event_t* evt)
         ESP_LOGI(TAG, "Last esp error code: 0x%x", err);
         ESP_LOGI(TAG, "Last mbedtls failure: 0x%x", mbedtls_err);
       }
-      if (output_buffer) {
-        free(output_buffer);
-      }
-      output_len = 0;
       break;
 
     default:
@@ -120,71 +263,106 @@ static esp_err_t version_check_http_event_handler(esp_http_client_event_t* evt)
   return ESP_OK;
 }
 
-static esp_err_t parse_https_response(char const* const https_response, char* version) {
-  esp_err_t err;
+static bool load_version_cache(version_cache_t* cache, const uint32_t url_crc) {
+  size_t size = sizeof(*cache);
+  nvs_manager_t* nvs_manager = get_nvs_manager();
+  const esp_err_t err = nvs_manager_load_blob(nvs_manager, VERSION_CACHE_KEY, cache, &size);
+  managers_release();
+  if (err != ESP_OK || size != sizeof(*cache) || cache->url_crc != url_crc) return false;
 
-  cJSON* json = cJSON_Parse(https_response);
-  if (!json) {
-    ESP_LOGE(TAG, "Failed to parse JSON response");
-    err = ESP_FAIL;
-    return err;
-  }
+  cache->etag[sizeof(cache->etag) - 1] = '\0';
+  cache->last_modified[sizeof(cache->last_modified) - 1] = '\0';
+  cache->version[sizeof(cache->version) - 1] = '\0';
+  cache->compressed_url[sizeof(cache->compressed_url) - 1] = '\0';
+  return cache->version[0] != '\0' && (cache->etag[0] != '\0' || cache->last_modified[0] != '\0');
+}
 
-  const cJSON* version_item = cJSON_GetObjectItem(json, JSON_VERSION_TAG);
-  if (cJSON_IsString(version_item)) {
-    strlcpy(version, version_item->valuestring, MAX_VERSION_STRING_LENGTH);
-    ESP_LOGI(TAG, "Server version: %s", version);
-    err = ESP_OK;
-  } else {
-    ESP_LOGE(TAG, "'version' not found in json response");
-    err = ESP_FAIL;
-  }
+// Rewritten only when the server sent a new version document, a 304 leaves NVS alone
+static void store_version_cache(const version_response_t* response, const uint32_t url_crc) {
+  if (response->etag[0] == '\0' && response->last_modified[0] == '\0') return; // Nothing to revalidate with
 
-  cJSON_Delete(json);
-  return err;
+  version_cache_t* cache = calloc(1, sizeof(version_cache_t));
+  if (cache == NULL) return;
+
+  cache->url_crc = url_crc;
+  strlcpy(cache->etag, response->etag, sizeof(cache->etag));
+  strlcpy(cache->last_modified, response->last_modified, sizeof(cache->last_modified));
+  strlcpy(cache->version, response->version, sizeof(cache->version));
+  if (response->fields[1].found) strlcpy(cache->compressed_url, response->compressed_url, sizeof(cache->compressed_url));
+
+  nvs_manager_t* nvs_manager = get_nvs_manager();
+  const esp_err_t err = nvs_manager_store_blob(nvs_manager, VERSION_CACHE_KEY, cache, sizeof(*cache));
+  managers_release();
+  if (err != ESP_OK) ESP_LOGW(TAG, "Failed to store version validators: %s", esp_err_to_name(err));
+  free(cache);
 }
 
-static esp_err_t get_https_version(char const* const url_version, char* version) {
-  char* local_response_buffer = calloc(MAX_HTTP_OUTPUT_BUFFER, sizeof(char));
-  if (local_response_buffer == NULL) {
+static void set_version_result(const char* version, const char* compressed_url, char* out_version,
+                               ota_image_source_t* source) {
+  strlcpy(out_version, version, MAX_VERSION_STRING_LENGTH);
+  ESP_LOGI(TAG, "Server version: %s", out_version);
+
+  if (OTA_COMPRESSED_ENABLED && compressed_url[0] != '\0') {
+    source->encoding = OTA_IMAGE_ZLIB;
+    strlcpy(source->url, compressed_url, sizeof(source->url));
+    ESP_LOGI(TAG, "Compressed image available");
+  }
+}
+
+// A conditional GET: with validators from an earlier response the server answers 304 without a body when the
+// version document did not change, and the version it had is taken from NVS.
+static esp_err_t get_https_version(char const* const url_version, char* version, ota_image_source_t* source) {
+  // One allocation for the request, freed before returning; the cache is only needed while the request is sent
+  version_response_t* response = calloc(1, sizeof(version_response_t) + sizeof(version_cache_t));
+  if (response == NULL) {
     ESP_LOGE(TAG, "Failed to allocate memory for local response");
     return ESP_ERR_NO_MEM;
   }
+  version_cache_t* cache = (version_cache_t*)(response + 1);
+  reset_response(response);
 
-  esp_err_t err = ESP_OK;
-  const esp_http_client_config_t https_config = {
-    .url = url_version,
-    .cert_pem = (char*)server_cert_pem_start, // #TODO move cert to spiffs
-    .event_handler = version_check_http_event_handler,
-    .user_data = local_response_buffer,
-    .method = HTTP_METHOD_GET,
-    .disable_auto_redirect = true,
-  };
-
-  esp_http_client_handle_t client = esp_http_client_init(&https_config);
-  if ((err = esp_http_client_perform(client)) == ESP_OK) {
-    ESP_LOGI(TAG, "HTTPS GET request succeeded");
-  } else {
-    ESP_LOGE(TAG, "HTTP GET request failed: %s", esp_err_to_name(err));
+  const uint32_t url_crc = esp_rom_crc32_le(0, (const uint8_t*)url_version, strlen(url_version));
+  const bool cached = load_version_cache(cache, url_crc);
+
+  esp_http_client_handle_t client = https_connection_acquire(url_version, version_check_http_event_handler, response);
+  if (client == NULL) {
+    free(response);
+    return ESP_FAIL;
   }
 
-  if (client != NULL) {
-    esp_http_client_cleanup(client);
+  if (cached && cache->etag[0] != '\0') https_connection_set_header(client, "If-None-Match", cache->etag);
+  if (cached && cache->last_modified[0] != '\0') {
+    https_connection_set_header(client, "If-Modified-Since", cache->last_modified);
   }
 
-  if (local_response_buffer[0] == '\0') {
-    ESP_LOGE(TAG, "Could not read endpoint data");
+  // The connection stays open for the OTA download or the next check
+  esp_err_t err = https_connection_perform(client);
+  const int status = esp_http_client_get_status_code(client);
+  https_connection_release(client, err == ESP_OK);
+
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "HTTP GET request failed: %s", esp_err_to_name(err));
+  } else if (status == 304 && cached) {
+    ESP_LOGI(TAG, "Version document not modified");
+    set_version_result(cache->version, cache->compressed_url, version, source);
+  } else if (status != 200) {
+    ESP_LOGE(TAG, "Version request failed with HTTP status %d", status);
     err = ESP_FAIL;
+  } else if (!response->fields[0].found) {
+    ESP_LOGE(TAG, "'version' not found in json response");
+    err = ESP_FAIL;
+  } else {
+    set_version_result(response->version, response->compressed_url, version, source);
+    store_version_cache(response, url_crc);
   }
 
-  err = parse_https_response(local_response_buffer, version);
-
-  free(local_response_buffer);
+  free(response);
   return err;
 }
 
-static esp_err_t check_https_firmware_version() {
+esp_err_t version_check_run(ota_image_source_t* source, bool* update_available) {
   esp_err_t err = {0};
+  *update_available = false;
 
   // Current version
   const esp_partition_t* running = esp_ota_get_running_partition();
@@ -195,55 +373,17 @@ static esp_err_t check_https_firmware_version() {
   }
 
   // Server version
-  char* server_version = calloc(MAX_HTTP_OUTPUT_BUFFER, sizeof(char));
-  if (server_version == NULL) {
-    return ESP_ERR_NO_MEM;
-  }
+  char server_version[MAX_VERSION_STRING_LENGTH] = {0};
 
-  const unit_configuration_t* unit_cfg = unit_config_acquire();
+  // The snapshot is held across the HTTPS round-trip without blocking writers
+  const unit_configuration_t* unit_cfg = unit_config_snapshot_get();
+  if (unit_cfg == NULL) return ESP_ERR_INVALID_STATE;
   const connectivity_configuration_t* con_cfg = &(unit_cfg->con_config);
   char const* const version_url = con_cfg->version_url;
-  if ((err = get_https_version(version_url, server_version)) == ESP_OK) {
-    err = (memcmp(server_version, running_app_info.version, MAX_VERSION_STRING_LENGTH) == 0)
-      ? ESP_OK
-      : ESP_NEW_FIRMWARE_VERSION_FOUND; // Compare
+  if ((err = get_https_version(version_url, server_version, source)) == ESP_OK) {
+    *update_available = memcmp(server_version, running_app_info.version, MAX_VERSION_STRING_LENGTH) != 0; // Compare
   }
 
-  free(server_version);
-  unit_config_release();
+  unit_config_snapshot_put(unit_cfg);
   return err;
 }
-
-void init_version_checking_task() {
-  wifi_manager_t* wifi_manager = get_wifi_manager();
-  if (wifi_manager == NULL) {
-    ESP_LOGE(TAG, "Wi-Fi not initialized");
-    managers_release();
-    vTaskDelete(NULL);
-    return;
-  }
-
-  wifi_manager_state_t wifi_state = wifi_manager_get_state(wifi_manager);
-  managers_release();
-  if ((wifi_state & WIFI_MANAGER_STATE_STA_IP_RECEIVED) == 0) {
-    ESP_LOGE(TAG, "Wi-Fi not connected");
-    vTaskDelete(NULL);
-    return;
-  }
-
-  // Check version
-  const esp_err_t err = check_https_firmware_version();
-  if (err == ESP_OK) {
-    vTaskDelete(NULL);
-    return; // up to date
-  }
-
-  if (err == ESP_NEW_FIRMWARE_VERSION_FOUND) {
-    xTaskCreate(init_ota_task, TAG, 4096, NULL, OTA_UPDATE_P, NULL);
-  } else {
-    ESP_LOGE(TAG, "Error: %s", esp_err_to_name(err));
-  }
-
-  ESP_LOGI(TAG, "Done");
-  vTaskDelete(NULL);
-}
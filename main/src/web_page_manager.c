@@ -20,68 +20,146 @@
 #include "dns_redirect.h"
 #include "nvs_manager.h"
 #include "state.h"
+#include "status_event.h"
+#include "telemetry.h"
+#include "wifi_manager.h"
 
 #include <esp_http_server.h>
 #include <esp_log.h>
-#include <esp_spiffs.h>
 #include <state.h>
 
 #include <cJSON.h>
+#include <esp_rom_crc.h>
 #include <esp_timer.h>
+#include <esp_wifi_types.h>
+#include <freertos/FreeRTOS.h>
+#include <freertos/semphr.h>
 
+#include <inttypes.h>
 #include <stdbool.h>
 
+#define ETAG_LENGTH 16
+#define MAX_RECV_TIMEOUTS 5
+
+#ifdef CONFIG_WEB_PAGE_WEBSOCKET
+#define WS_HANDLER_COUNT 1
+#define WS_MAX_CLIENTS 3 // Each holds one of the server's open sockets for as long as the page is open
+#define WS_MESSAGE_LENGTH 192
+#define WS_MAX_FRAME 64 // Clients have nothing to say, longer frames close the socket
+
+// A formatted status message on its way to the httpd task
+typedef struct
+{
+  web_page_manager_t* manager;
+  size_t len;
+  char text[WS_MESSAGE_LENGTH];
+} ws_message_t;
+#else
+#define WS_HANDLER_COUNT 0
+#endif
+
 typedef struct
 {
-  const char* path;
+  const char* name;
   const char* data_ptr;
-  long content_length;
+  size_t content_length;
+  const char* gz_data_ptr; // gzip-compressed variant, NULL if there is none
+  size_t gz_content_length;
+  char etag[ETAG_LENGTH]; // Computed from the content at load time, one per representation
+  char gz_etag[ETAG_LENGTH];
 } file_info_t;
 
+// Assets are linked into the application image (see main/CMakeLists.txt) and sent directly from flash
+#define EMBEDDED_ASSET(symbol)                                          \
+  extern const char symbol##_start[] asm("_binary_" #symbol "_start"); \
+  extern const char symbol##_end[] asm("_binary_" #symbol "_end")
+
+#define ASSET_DATA(symbol) symbol##_start, (size_t)(symbol##_end - symbol##_start)
+#define GZIP_ASSET(file_name, symbol) {file_name, ASSET_DATA(symbol), ASSET_DATA(symbol##_gz), {0}, {0}}
+
+EMBEDDED_ASSET(ap_pages_css);
+EMBEDDED_ASSET(ap_wifi_html);
+EMBEDDED_ASSET(ap_ota_html);
+EMBEDDED_ASSET(ap_usr_html);
+EMBEDDED_ASSET(ap_sys_html);
+// Composite pages: default_page.html, the page's script and the closing tags, assembled at build time
+EMBEDDED_ASSET(wifi_page_html);
+EMBEDDED_ASSET(ota_page_html);
+EMBEDDED_ASSET(sys_page_html);
+EMBEDDED_ASSET(usr_page_html);
+
+EMBEDDED_ASSET(ap_pages_css_gz);
+EMBEDDED_ASSET(ap_wifi_html_gz);
+EMBEDDED_ASSET(ap_ota_html_gz);
+EMBEDDED_ASSET(ap_usr_html_gz);
+EMBEDDED_ASSET(ap_sys_html_gz);
+EMBEDDED_ASSET(wifi_page_html_gz);
+EMBEDDED_ASSET(ota_page_html_gz);
+EMBEDDED_ASSET(sys_page_html_gz);
+EMBEDDED_ASSET(usr_page_html_gz);
+
 typedef enum
 {
   CSS = 0,
   AP_WIFI,
-  AP_WIFI_JS,
   AP_OTA,
-  AP_OTA_JS,
   AP_USR,
-  AP_USR_JS,
   AP_SYS,
-  AP_SYS_JS,
-  DEFAULT_PAGE,
+  WIFI_PAGE,
+  OTA_PAGE,
+  SYS_PAGE,
+  USR_PAGE,
   CONFIG_TYPE_COUNT
 } resource_t;
 
 struct web_page_manager
 {
-  EventGroupHandle_t request_event_group;
+  QueueHandle_t request_queue;
   EventGroupHandle_t state_event_group;
   TaskHandle_t fsm_task_handle;
 
   file_info_t files[CONFIG_TYPE_COUNT];
-  char json_buffer[1024];
+  char cache_control[32];
   httpd_handle_t server;
-  httpd_uri_t handlers[15];
+  httpd_uri_t handlers[17];
+#ifdef CONFIG_WEB_PAGE_WEBSOCKET
+  // Sockets subscribed to status pushes, -1 when free. Only the httpd task touches the list.
+  int ws_fds[WS_MAX_CLIENTS];
+  volatile uint8_t ws_client_count;
+  esp_event_handler_instance_t status_handler;
+  // Server the status pushes are queued on, NULL while it is stopped or being stopped. Guarded by ws_lock, so no work
+  // is queued on a server that httpd_stop() is tearing down.
+  httpd_handle_t ws_server;
+  SemaphoreHandle_t ws_lock;
+  StaticSemaphore_t ws_lock_buffer;
+#endif
 };
 
 static char* TAG = "Web-page Manager";
 
 static const char* const TEXT_HTML = "text/html"; // TYPE
 static const char* const TEXT_CSS = "text/css"; // TYPE
-static const char* const closing_tags = "</script></body></html>";
 
 static void fsm_task(void* arg);
 static esp_err_t transition_to_state(web_page_manager_t* manager, web_page_manager_state_request_t new_state_request);
 static esp_err_t init_web_pages(web_page_manager_t* manager);
-static esp_err_t load_content(file_info_t* file);
+static esp_err_t timed_handler(httpd_req_t* req);
+static void compute_etags(file_info_t* file);
+static esp_err_t send_resource(web_page_manager_t const* manager, httpd_req_t* req, resource_t resource,
+                               const char* type, bool cacheable);
+static bool is_not_modified(web_page_manager_t const* manager, httpd_req_t* req, const char* etag);
+static esp_err_t send_not_modified(httpd_req_t* req);
+static esp_err_t wifi_page(httpd_req_t* req, bool cacheable);
 static esp_err_t wifi_handler(httpd_req_t* req);
 static esp_err_t ap_wifi_html(httpd_req_t* req);
 static void send_json_resp(httpd_req_t* req, int code, const char* msg);
+static esp_err_t receive_json(httpd_req_t* req, cJSON** json);
 static esp_err_t ota_handler(httpd_req_t* req);
 static esp_err_t ap_ota_html(httpd_req_t* req);
 static esp_err_t sys_handler(httpd_req_t* req);
 static esp_err_t ap_sys_html(httpd_req_t* req);
+static esp_err_t dns_stats_handler(httpd_req_t* req);
+static esp_err_t telemetry_handler(httpd_req_t* req);
 static esp_err_t user_handler(httpd_req_t* req);
 static esp_err_t ap_usr_html(httpd_req_t* req);
 static esp_err_t no_content(httpd_req_t* req);
@@ -93,9 +171,18 @@ static esp_err_t wifi_post_handler(httpd_req_t* req);
 static esp_err_t ota_post_handler(httpd_req_t* req);
 static esp_err_t sys_post_handler(httpd_req_t* req);
 static esp_err_t user_post_handler(httpd_req_t* req);
-static esp_err_t send_pages(web_page_manager_t const* manager, httpd_req_t* req, const resource_t resources[],
-                            size_t num_resouces);
+static bool accepts_gzip(httpd_req_t* req);
 static esp_err_t cleanup_web_page_manager(web_page_manager_t* manager);
+#ifdef CONFIG_WEB_PAGE_WEBSOCKET
+static esp_err_t start_status_socket(web_page_manager_t* manager);
+static void stop_status_socket(web_page_manager_t* manager);
+static esp_err_t ws_handler(httpd_req_t* req);
+static bool ws_add_client(web_page_manager_t* manager, int fd);
+static void ws_remove_client(web_page_manager_t* manager, size_t index);
+static size_t format_status_message(int32_t id, const void* data, char* text, size_t size);
+static void status_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+static void ws_broadcast(void* arg);
+#endif
 
 web_page_manager_t* web_page_manager_create(UBaseType_t priority) {
   web_page_manager_t* manager = calloc(1, sizeof(web_page_manager_t));
@@ -105,22 +192,20 @@ web_page_manager_t* web_page_manager_create(UBaseType_t priority) {
   }
 
   *manager = (web_page_manager_t){
-    .request_event_group = xEventGroupCreate(),
+    .request_queue = request_bus_create(),
     .state_event_group = xEventGroupCreate(),
     .fsm_task_handle = NULL,
     .files = {
-      [CSS] = {"/spiffs/ap_pages.css", NULL, 0},
-      [AP_WIFI] = {"/spiffs/ap_wifi.html", NULL, 0},
-      [AP_WIFI_JS] = {"/spiffs/ap_wifi.js", NULL, 0},
-      [AP_OTA] = {"/spiffs/ap_ota.html", NULL, 0},
-      [AP_OTA_JS] = {"/spiffs/ap_ota.js", NULL, 0},
-      [AP_USR] = {"/spiffs/ap_usr.html", NULL, 0},
-      [AP_USR_JS] = {"/spiffs/ap_usr.js", NULL, 0},
-      [AP_SYS] = {"/spiffs/ap_sys.html", NULL, 0},
-      [AP_SYS_JS] = {"/spiffs/ap_sys.js", NULL, 0},
-      [DEFAULT_PAGE] = {"/spiffs/default_page.html", NULL, 0}
+      [CSS] = GZIP_ASSET("ap_pages.css", ap_pages_css),
+      [AP_WIFI] = GZIP_ASSET("ap_wifi.html", ap_wifi_html),
+      [AP_OTA] = GZIP_ASSET("ap_ota.html", ap_ota_html),
+      [AP_USR] = GZIP_ASSET("ap_usr.html", ap_usr_html),
+      [AP_SYS] = GZIP_ASSET("ap_sys.html", ap_sys_html),
+      [WIFI_PAGE] = GZIP_ASSET("wifi_page.html", wifi_page_html),
+      [OTA_PAGE] = GZIP_ASSET("ota_page.html", ota_page_html),
+      [SYS_PAGE] = GZIP_ASSET("sys_page.html", sys_page_html),
+      [USR_PAGE] = GZIP_ASSET("usr_page.html", usr_page_html)
     },
-    .json_buffer = {0},
     .server = NULL,
     .handlers = {
       // Wi-Fi
@@ -132,6 +217,8 @@ web_page_manager_t* web_page_manager_create(UBaseType_t priority) {
       // Sys
       {.uri = "/system", .method = HTTP_GET, .handler = sys_handler, .user_ctx = manager},
       {.uri = "/ap_sys.html", .method = HTTP_GET, .handler = ap_sys_html, .user_ctx = manager},
+      {.uri = "/dns_stats", .method = HTTP_GET, .handler = dns_stats_handler, .user_ctx = manager},
+      {.uri = "/telemetry", .method = HTTP_GET, .handler = telemetry_handler, .user_ctx = manager},
       // Usr
       {.uri = "/usercfg", .method = HTTP_GET, .handler = user_handler, .user_ctx = manager},
       {.uri = "/ap_usr.html", .method = HTTP_GET, .handler = ap_usr_html, .user_ctx = manager},
@@ -148,11 +235,16 @@ web_page_manager_t* web_page_manager_create(UBaseType_t priority) {
     }
   };
 
-  if (manager->request_event_group == NULL || manager->state_event_group == NULL) {
+  if (manager->request_queue == NULL || manager->state_event_group == NULL) {
+    request_bus_delete(manager->request_queue);
+    if (manager->state_event_group) vEventGroupDelete(manager->state_event_group);
     free(manager);
     ESP_LOGE(TAG, "Failed to create web page manager");
     return NULL;
   }
+#ifdef CONFIG_WEB_PAGE_WEBSOCKET
+  manager->ws_lock = xSemaphoreCreateMutexStatic(&manager->ws_lock_buffer);
+#endif
 
   xTaskCreate(
     fsm_task,
@@ -162,6 +254,7 @@ web_page_manager_t* web_page_manager_create(UBaseType_t priority) {
     priority,
     &manager->fsm_task_handle
     );
+  telemetry_register_task(manager->fsm_task_handle);
 
   return manager;
 }
@@ -172,11 +265,10 @@ void web_page_manager_destroy(web_page_manager_t* const manager) {
   cleanup_web_page_manager(manager);
 
   if (manager->fsm_task_handle) {
+    telemetry_unregister_task(manager->fsm_task_handle);
     vTaskDelete(manager->fsm_task_handle);
   }
-  if (manager->request_event_group) {
-    vEventGroupDelete(manager->request_event_group);
-  }
+  request_bus_delete(manager->request_queue);
   if (manager->state_event_group) {
     vEventGroupDelete(manager->state_event_group);
   }
@@ -184,12 +276,19 @@ void web_page_manager_destroy(web_page_manager_t* const manager) {
   free(manager);
 }
 
-esp_err_t web_page_manager_request_state(web_page_manager_t* const manager, web_page_manager_state_request_t new_state) {
+esp_err_t web_page_manager_request_state(web_page_manager_t* const manager, web_page_manager_state_request_t new_state,
+                                         const request_callback_t callback, void* user_data) {
   if (manager == NULL) return ESP_ERR_NOT_FOUND;
 
-  xEventGroupSetBits(manager->request_event_group, new_state);
+  return request_bus_post(manager->request_queue, new_state, callback, user_data);
+}
 
-  return ESP_OK;
+esp_err_t web_page_manager_try_request_state(web_page_manager_t* const manager,
+                                             web_page_manager_state_request_t new_state,
+                                             const request_callback_t callback, void* user_data) {
+  if (manager == NULL) return ESP_ERR_NOT_FOUND;
+
+  return request_bus_try_post(manager->request_queue, new_state, callback, user_data);
 }
 
 void web_page_manager_wait_until_state(web_page_manager_t const* const manager, web_page_manager_state_t wait_state) {
@@ -207,8 +306,8 @@ static void fsm_task(void* arg) {
     return;
   }
 
-  if (manager->request_event_group == NULL) {
-    ESP_LOGE(TAG, "Request event group not created");
+  if (manager->request_queue == NULL) {
+    ESP_LOGE(TAG, "Request queue not created");
     vTaskDelete(NULL);
     return;
   }
@@ -216,18 +315,14 @@ static void fsm_task(void* arg) {
   xEventGroupSetBits(manager->state_event_group, WEB_PAGE_STATE_NONE | WEB_PAGE_STATE_DNS_SERVER_NONE);
 
   while (1) {
-    EventBits_t bits = xEventGroupWaitBits(
-      manager->request_event_group,
-      WEB_PAGE_STATE_NONE_REQUEST | WEB_PAGE_STATE_SERVING_REQUEST | WEB_PAGE_STATE_DNS_SERVER_NONE_REQUEST |
-      WEB_PAGE_STATE_DNS_SERVER_REQUEST,
-      pdTRUE, pdFALSE, portMAX_DELAY
-      );
-
-    const esp_err_t err = transition_to_state(manager, bits);
+    request_message_t message;
+    request_bus_receive(manager->request_queue, &message);
+
+    const esp_err_t err = transition_to_state(manager, message.request);
     if (err != ESP_OK)
       ESP_LOGE(TAG, "State transition failed: %s", esp_err_to_name(err));
 
-    taskYIELD();
+    request_bus_complete(&message, err);
   }
 
   vTaskDelete(NULL);
@@ -240,9 +335,11 @@ static esp_err_t transition_to_state(web_page_manager_t* manager, web_page_manag
 
   if (current_state & WEB_PAGE_STATE_SERVING && new_state_request & WEB_PAGE_STATE_NONE_REQUEST) {
     err = cleanup_web_page_manager(manager);
+    xEventGroupClearBits(manager->state_event_group, WEB_PAGE_STATE_SERVING);
     xEventGroupSetBits(manager->state_event_group, WEB_PAGE_STATE_NONE);
   } else if (current_state & WEB_PAGE_STATE_NONE && new_state_request & WEB_PAGE_STATE_SERVING_REQUEST) {
     err = init_web_pages(manager);
+    xEventGroupClearBits(manager->state_event_group, WEB_PAGE_STATE_NONE);
     xEventGroupSetBits(manager->state_event_group, WEB_PAGE_STATE_SERVING);
   } else {
     ESP_LOGI(TAG, "No state transition for web-server");
@@ -251,10 +348,12 @@ static esp_err_t transition_to_state(web_page_manager_t* manager, web_page_manag
   current_state = xEventGroupGetBits(manager->state_event_group);
   if (current_state & WEB_PAGE_STATE_DNS_SERVER_ACTIVE && new_state_request & WEB_PAGE_STATE_DNS_SERVER_NONE_REQUEST) {
     stop_dns_server();
-    xEventGroupSetBits(manager->state_event_group, current_state | WEB_PAGE_STATE_DNS_SERVER_NONE);
+    xEventGroupClearBits(manager->state_event_group, WEB_PAGE_STATE_DNS_SERVER_ACTIVE);
+    xEventGroupSetBits(manager->state_event_group, WEB_PAGE_STATE_DNS_SERVER_NONE);
   } else if (current_state & WEB_PAGE_STATE_DNS_SERVER_NONE && new_state_request & WEB_PAGE_STATE_DNS_SERVER_REQUEST) {
     start_dns_server();
-    xEventGroupSetBits(manager->state_event_group, current_state | WEB_PAGE_STATE_DNS_SERVER_ACTIVE);
+    xEventGroupClearBits(manager->state_event_group, WEB_PAGE_STATE_DNS_SERVER_NONE);
+    xEventGroupSetBits(manager->state_event_group, WEB_PAGE_STATE_DNS_SERVER_ACTIVE);
   } else {
     ESP_LOGI(TAG, "No state transition for dns-server");
   }
@@ -272,20 +371,36 @@ static esp_err_t init_web_pages(web_page_manager_t* const manager) {
 
   esp_err_t err = ESP_OK;
 
+  size_t asset_bytes = 0;
+  size_t gz_asset_bytes = 0;
   for (resource_t i = 0; i < CONFIG_TYPE_COUNT; i++) {
-    err = load_content(&manager->files[i]);
-    if (err != ESP_OK) return err;
+    compute_etags(&manager->files[i]);
+    asset_bytes += manager->files[i].content_length;
+    gz_asset_bytes += manager->files[i].gz_content_length;
   }
+  snprintf(manager->cache_control, sizeof(manager->cache_control), "public, max-age=%d", CONFIG_WEB_PAGE_CACHE_MAX_AGE);
+  ESP_LOGI(TAG, "Serving %d assets (%d bytes, %d bytes gzip) from flash", CONFIG_TYPE_COUNT, asset_bytes,
+           gz_asset_bytes);
 
   httpd_config_t cfg = HTTPD_DEFAULT_CONFIG();
-  cfg.max_uri_handlers = N_HANDLERS;
+  cfg.max_uri_handlers = N_HANDLERS + WS_HANDLER_COUNT;
   cfg.uri_match_fn = httpd_uri_match_wildcard;
 
   err = httpd_start(&manager->server, &cfg);
   if (err != ESP_OK) return err;
 
+#ifdef CONFIG_WEB_PAGE_WEBSOCKET
+  // Ahead of the wildcard redirect, the first matching handler answers
+  err = start_status_socket(manager);
+  if (err != ESP_OK) return err;
+#endif
+
+  // Every handler is registered behind timed_handler, with its own entry as the context
   for (size_t i = 0; i < N_HANDLERS; i++) {
-    err = httpd_register_uri_handler(manager->server, &manager->handlers[i]);
+    httpd_uri_t timed = manager->handlers[i];
+    timed.handler = timed_handler;
+    timed.user_ctx = &manager->handlers[i];
+    err = httpd_register_uri_handler(manager->server, &timed);
     if (err != ESP_OK) return err;
   }
 
@@ -294,82 +409,122 @@ static esp_err_t init_web_pages(web_page_manager_t* const manager) {
   return err;
 }
 
-static esp_err_t load_content(file_info_t* const file) {
-  if (file->data_ptr != NULL) {
-    return ESP_OK;
-  }
-
-  FILE* f = fopen(file->path, "r");
-  if (f == NULL) {
-    ESP_LOGE(TAG, "Failed to open %s", file->path);
-    return ESP_ERR_NOT_FOUND;
-  }
-
-  fseek(f, 0, SEEK_END);
-  file->content_length = ftell(f);
-  fseek(f, 0, SEEK_SET);
+// Runs the registered handler with the context it was declared with, recording how long the request took
+static esp_err_t timed_handler(httpd_req_t* req) {
+  const httpd_uri_t* uri = req->user_ctx;
+  req->user_ctx = uri->user_ctx;
 
-  char* buffer = (char*)malloc(file->content_length + 1);
-  if (buffer == NULL) {
-    ESP_LOGE(TAG, "Failed to allocate memory");
-    fclose(f);
-    return ESP_ERR_NO_MEM;
-  }
+  const int64_t started_us = esp_timer_get_time();
+  const esp_err_t err = uri->handler(req);
+  telemetry_record(uri->method == HTTP_POST ? TELEMETRY_HTTP_POST : TELEMETRY_HTTP_GET,
+                   esp_timer_get_time() - started_us);
+  return err;
+}
 
-  const size_t read = fread(buffer, 1, file->content_length, f);
-  buffer[read] = '\0';
-  fclose(f);
+// The assets never change during a firmware's life, so a hash of the content identifies its version.
+// When a compressed variant exists it is hashed instead, it is derived from (and so changes with) the raw content.
+static void compute_etags(file_info_t* const file) {
+  if (file->etag[0] != '\0') return;
 
-  file->data_ptr = buffer;
-  buffer = NULL;
+  const uint32_t hash = file->gz_data_ptr != NULL
+    ? esp_rom_crc32_le(0, (const uint8_t*)file->gz_data_ptr, file->gz_content_length)
+    : esp_rom_crc32_le(0, (const uint8_t*)file->data_ptr, file->content_length);
 
-  ESP_LOGI(TAG, "File [%s] loaded successfully, size: %ld bytes", file->path, file->content_length);
-  return ESP_OK;
+  snprintf(file->etag, sizeof(file->etag), "\"%08" PRIx32 "\"", hash);
+  snprintf(file->gz_etag, sizeof(file->gz_etag), "\"%08" PRIx32 "-gz\"", hash);
 }
 
-static esp_err_t send_pages(web_page_manager_t const* const manager, httpd_req_t* req, const resource_t resources[],
-                            size_t num_resouces) {
+// Every resource is a contiguous body in flash, sent with a single httpd_resp_send and a known Content-Length
+static esp_err_t send_resource(web_page_manager_t const* const manager, httpd_req_t* req, const resource_t resource,
+                               const char* type, const bool cacheable) {
   if (manager == NULL) {
     ESP_LOGE(TAG, "Web page manager is NULL");
     return ESP_ERR_NOT_FOUND;
   }
-  esp_err_t err = ESP_OK;
 
-  for (size_t i = 0; i < num_resouces; i++) {
-    resource_t resource = resources[i];
-    if (manager->files[resource].data_ptr == NULL) {
-      ESP_LOGE(TAG, "File [%s] is NULL", manager->files[i].path);
-      return ESP_ERR_NOT_FOUND;
-    }
-    err = httpd_resp_send_chunk(req, manager->files[resource].data_ptr, manager->files[resource].content_length);
-    if (err != ESP_OK) {
-      ESP_LOGE(TAG, "Failed to send chunk");
-      return err;
+  const file_info_t* file = &manager->files[resource];
+  httpd_resp_set_type(req, type);
+  if (!cacheable) httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+
+  if (file->gz_data_ptr != NULL) {
+    httpd_resp_set_hdr(req, "Vary", "Accept-Encoding");
+    if (accepts_gzip(req)) {
+      if (cacheable && is_not_modified(manager, req, file->gz_etag)) return send_not_modified(req);
+      httpd_resp_set_hdr(req, "Content-Encoding", "gzip");
+      return httpd_resp_send(req, file->gz_data_ptr, (ssize_t)file->gz_content_length);
     }
   }
 
-  if (httpd_resp_sendstr_chunk(req, closing_tags) != ESP_OK) {
-    ESP_LOGE(TAG, "Failed to send closing tags");
-    return ESP_FAIL;
+  if (cacheable && is_not_modified(manager, req, file->etag)) return send_not_modified(req);
+
+  if (file->data_ptr == NULL) {
+    ESP_LOGE(TAG, "File [%s] has no uncompressed variant", file->name);
+    return ESP_ERR_NOT_FOUND;
+  }
+  return httpd_resp_send(req, file->data_ptr, (ssize_t)file->content_length);
+}
+
+// Attaches the validators of the representation about to be sent, and checks them against the client's copy
+static bool is_not_modified(web_page_manager_t const* const manager, httpd_req_t* req, const char* etag) {
+  httpd_resp_set_hdr(req, "ETag", etag);
+  httpd_resp_set_hdr(req, "Cache-Control", manager->cache_control);
+
+  char if_none_match[128] = {0};
+  if (httpd_req_get_hdr_value_len(req, "If-None-Match") == 0) return false;
+  if (httpd_req_get_hdr_value_str(req, "If-None-Match", if_none_match, sizeof(if_none_match)) == ESP_ERR_NOT_FOUND) {
+    return false;
   }
 
-  return httpd_resp_sendstr_chunk(req, NULL);
+  return strstr(if_none_match, etag) != NULL || strcmp(if_none_match, "*") == 0;
 }
 
-static esp_err_t wifi_handler(httpd_req_t* req) {
+static esp_err_t send_not_modified(httpd_req_t* req) {
+  httpd_resp_set_status(req, "304 Not Modified");
+  return httpd_resp_send(req, NULL, 0);
+}
+
+static bool accepts_gzip(httpd_req_t* req) {
+  char accept_encoding[128] = {0};
+  if (httpd_req_get_hdr_value_len(req, "Accept-Encoding") == 0) return false;
+
+  // A truncated value still carries the leading encodings, which is where gzip is listed in practice
+  if (httpd_req_get_hdr_value_str(req, "Accept-Encoding", accept_encoding, sizeof(accept_encoding)) ==
+    ESP_ERR_NOT_FOUND) {
+    return false;
+  }
+
+  return strstr(accept_encoding, "gzip") != NULL;
+}
+
+static esp_err_t wifi_page(httpd_req_t* req, const bool cacheable) {
   web_page_manager_t* manager = req->user_ctx;
-  httpd_resp_set_type(req, TEXT_HTML);
-  resource_t pages[] = {DEFAULT_PAGE, AP_WIFI_JS};
-  return send_pages(manager, req, pages, sizeof(pages) / sizeof(pages[0]));
+  return send_resource(manager, req, WIFI_PAGE, TEXT_HTML, cacheable);
+}
+
+static esp_err_t wifi_handler(httpd_req_t* req) {
+  return wifi_page(req, true);
 }
 
 static esp_err_t ap_wifi_html(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
-  httpd_resp_set_type(req, TEXT_HTML);
-  return httpd_resp_sendstr(req, manager->files[AP_WIFI].data_ptr);
+  return send_resource(manager, req, AP_WIFI, TEXT_HTML, true);
 }
 
 static void send_json_resp(httpd_req_t* req, const int code, const char* msg) {
+  switch (code) {
+  case 200:
+    break;
+  case 400:
+    httpd_resp_set_status(req, "400 Bad Request");
+    break;
+  case 413:
+    httpd_resp_set_status(req, "413 Payload Too Large");
+    break;
+  default:
+    httpd_resp_set_status(req, "500 Internal Server Error");
+    break;
+  }
+
   cJSON* r = cJSON_CreateObject();
   cJSON_AddNumberToObject(r, "c", code);
   cJSON_AddStringToObject(r, "m", msg);
@@ -380,45 +535,119 @@ static void send_json_resp(httpd_req_t* req, const int code, const char* msg) {
   free((void*)s);
 }
 
+// Reads the whole body into a buffer owned by this request and parses it. The body may arrive over several
+// segments, so receive until Content-Length is reached. On failure the error response has already been sent.
+static esp_err_t receive_json(httpd_req_t* req, cJSON** json) {
+  *json = NULL;
+
+  if (req->content_len == 0) {
+    send_json_resp(req, 400, "Empty body");
+    return ESP_FAIL;
+  }
+
+  if (req->content_len > CONFIG_WEB_PAGE_MAX_POST_BODY) {
+    ESP_LOGW(TAG, "Rejecting %u byte body on [%s]", (unsigned)req->content_len, req->uri);
+    send_json_resp(req, 413, "Body too large");
+    return ESP_FAIL;
+  }
+
+  char* body = malloc(req->content_len + 1);
+  if (body == NULL) {
+    send_json_resp(req, 500, "Memory allocation failed");
+    return ESP_FAIL;
+  }
+
+  size_t received = 0;
+  int timeouts = 0;
+  while (received < req->content_len) {
+    const int r = httpd_req_recv(req, body + received, req->content_len - received);
+    if (r == HTTPD_SOCK_ERR_TIMEOUT && ++timeouts < MAX_RECV_TIMEOUTS) continue;
+    if (r <= 0) {
+      ESP_LOGE(TAG, "Receive error [%d] after %u of %u bytes", r, (unsigned)received, (unsigned)req->content_len);
+      free(body);
+      send_json_resp(req, 400, "Receive error");
+      return ESP_FAIL;
+    }
+    received += r;
+  }
+  body[received] = '\0';
+
+  *json = cJSON_Parse(body);
+  free(body);
+
+  if (*json == NULL) {
+    send_json_resp(req, 400, "Invalid JSON");
+    return ESP_FAIL;
+  }
+
+  return ESP_OK;
+}
+
 static esp_err_t ota_handler(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
-  httpd_resp_set_type(req, TEXT_HTML);
-  resource_t pages[] = {DEFAULT_PAGE, AP_OTA_JS};
-  return send_pages(manager, req, pages, sizeof(pages) / sizeof(pages[0]));
+  return send_resource(manager, req, OTA_PAGE, TEXT_HTML, true);
 }
 
 static esp_err_t ap_ota_html(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
-  httpd_resp_set_type(req, TEXT_HTML);
-  return httpd_resp_sendstr(req, manager->files[AP_OTA].data_ptr);
+  return send_resource(manager, req, AP_OTA, TEXT_HTML, true);
 }
 
 static esp_err_t sys_handler(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
-  httpd_resp_set_type(req, TEXT_HTML);
-  resource_t pages[] = {DEFAULT_PAGE, AP_SYS_JS};
-  return send_pages(manager, req, pages, sizeof(pages) / sizeof(pages[0]));
+  return send_resource(manager, req, SYS_PAGE, TEXT_HTML, true);
 }
 
 static esp_err_t ap_sys_html(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
   if (manager == NULL) return ESP_ERR_NOT_FOUND;
-  httpd_resp_set_type(req, TEXT_HTML);
-  return httpd_resp_sendstr(req, manager->files[AP_SYS].data_ptr);
+  return send_resource(manager, req, AP_SYS, TEXT_HTML, true);
+}
+
+static esp_err_t dns_stats_handler(httpd_req_t* req) {
+  dns_redirect_stats_t stats;
+  dns_redirect_get_stats(&stats);
+
+  cJSON* r = cJSON_CreateObject();
+  if (r == NULL) return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Memory allocation failed");
+  cJSON_AddNumberToObject(r, "queries", stats.queries);
+  cJSON_AddNumberToObject(r, "answered", stats.answered);
+  cJSON_AddNumberToObject(r, "dropped", stats.dropped);
+  cJSON_AddNumberToObject(r, "malformed", stats.malformed);
+  const char* s = cJSON_PrintUnformatted(r);
+  cJSON_Delete(r);
+  if (s == NULL) return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Memory allocation failed");
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  const esp_err_t err = httpd_resp_sendstr(req, s);
+  free((void*)s);
+  return err;
+}
+
+static esp_err_t telemetry_handler(httpd_req_t* req) {
+  cJSON* r = telemetry_to_json();
+  if (r == NULL) return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Memory allocation failed");
+  const char* s = cJSON_PrintUnformatted(r);
+  cJSON_Delete(r);
+  if (s == NULL) return httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Memory allocation failed");
+
+  httpd_resp_set_type(req, "application/json");
+  httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+  const esp_err_t err = httpd_resp_sendstr(req, s);
+  free((void*)s);
+  return err;
 }
 
 static esp_err_t user_handler(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
-  httpd_resp_set_type(req, TEXT_HTML);
-  resource_t pages[] = {DEFAULT_PAGE, AP_USR_JS};
-  return send_pages(manager, req, pages, sizeof(pages) / sizeof(pages[0]));
+  return send_resource(manager, req, USR_PAGE, TEXT_HTML, true);
 }
 
 static esp_err_t ap_usr_html(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
   if (manager == NULL) return ESP_ERR_NOT_FOUND;
-  httpd_resp_set_type(req, TEXT_HTML);
-  return httpd_resp_sendstr(req, manager->files[AP_USR].data_ptr);
+  return send_resource(manager, req, AP_USR, TEXT_HTML, true);
 }
 
 static esp_err_t no_content(httpd_req_t* req) {
@@ -428,8 +657,7 @@ static esp_err_t no_content(httpd_req_t* req) {
 
 static esp_err_t css_handler(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
-  httpd_resp_set_type(req, TEXT_CSS);
-  return httpd_resp_sendstr(req, manager->files[CSS].data_ptr);
+  return send_resource(manager, req, CSS, TEXT_CSS, true);
 }
 
 static esp_err_t redirect_handler(httpd_req_t* req) {
@@ -449,7 +677,7 @@ static esp_err_t redirect_handler(httpd_req_t* req) {
 
   if (strstr(uri, "hotspot-detect")) {
     ESP_LOGI(TAG, "Handling Apple captive portal detection");
-    return wifi_handler(req);
+    return wifi_page(req, false);
   }
 
   if (strstr(uri, "connecttest.txt")) {
@@ -457,8 +685,9 @@ static esp_err_t redirect_handler(httpd_req_t* req) {
     return no_content(req);
   }
 
+  // Probe and redirected URLs are not cached, a client must not keep seeing the portal once it is gone
   ESP_LOGI(TAG, "Defaulting to Wi-Fi page");
-  return wifi_handler(req);
+  return wifi_page(req, false);
 }
 
 static void restart_timer_callback(void* arg) {
@@ -491,8 +720,6 @@ static esp_err_t reboot_handler(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
   cleanup_web_page_manager(manager);
 
-  esp_vfs_spiffs_unregister("ap_storage");
-
   return ESP_OK;
 }
 
@@ -500,16 +727,8 @@ static esp_err_t wifi_post_handler(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
   if (manager == NULL) return ESP_ERR_NOT_FOUND;
 
-  memset(manager->json_buffer, 0, sizeof(manager->json_buffer));
-  int r = httpd_req_recv(req, manager->json_buffer, sizeof(manager->json_buffer) - 1);
-  if (r <= 0) return ESP_FAIL;
-  manager->json_buffer[r] = 0;
-
-  cJSON* root = cJSON_Parse(manager->json_buffer);
-  if (!root) {
-    send_json_resp(req, 400, "Invalid JSON");
-    return ESP_FAIL;
-  }
+  cJSON* root = NULL;
+  if (receive_json(req, &root) != ESP_OK) return ESP_FAIL;
 
   cJSON* networks = cJSON_GetObjectItem(root, "networks");
   if (!cJSON_IsArray(networks)) {
@@ -519,7 +738,13 @@ static esp_err_t wifi_post_handler(httpd_req_t* req) {
   }
 
   size_t element_count = cJSON_GetArraySize(networks);
-  wifi_settings_t* wifi_settings = (wifi_settings_t*)malloc(sizeof(wifi_settings_t) * element_count);
+  if (element_count == 0 || element_count > UINT8_MAX) {
+    cJSON_Delete(root);
+    send_json_resp(req, 400, "Invalid network count");
+    return ESP_FAIL;
+  }
+
+  wifi_settings_t* wifi_settings = (wifi_settings_t*)calloc(element_count, sizeof(wifi_settings_t));
   if (!wifi_settings) {
     cJSON_Delete(root);
     send_json_resp(req, 500, "Memory allocation failed");
@@ -532,28 +757,46 @@ static esp_err_t wifi_post_handler(httpd_req_t* req) {
     cJSON* ssid = cJSON_GetObjectItem(network, "ssid");
     cJSON* pass = cJSON_GetObjectItem(network, "pass");
 
-    if (!cJSON_IsString(ssid) || !cJSON_IsString(pass) ||
-      !strlen(ssid->valuestring) || !strlen(pass->valuestring)) {
+    const size_t ssid_len = cJSON_IsString(ssid) ? strlen(ssid->valuestring) : 0;
+    const size_t pass_len = cJSON_IsString(pass) ? strlen(pass->valuestring) : 0;
+    if (ssid_len == 0 || pass_len == 0 || ssid_len > MAX_SSID_LEN || pass_len > MAX_PASSPHRASE_LEN) {
       cJSON_Delete(root);
       send_json_resp(req, 400, "Invalid network");
-      free(wifi_settings);
+      unit_config_free_wifi_settings(NULL, wifi_settings, element_count);
+      return ESP_FAIL;
+    }
+
+    wifi_settings_t* setting = &wifi_settings[element_index];
+    setting->ssid = malloc(ssid_len + 1);
+    setting->password = malloc(pass_len + 1);
+    if (!setting->ssid || !setting->password) {
+      cJSON_Delete(root);
+      send_json_resp(req, 500, "Memory allocation failed");
+      unit_config_free_wifi_settings(NULL, wifi_settings, element_count);
       return ESP_FAIL;
     }
 
-    strlcpy(wifi_settings[element_index].ssid, ssid->valuestring, sizeof(wifi_settings[element_index].ssid));
-    strlcpy(wifi_settings[element_index].password, pass->valuestring, sizeof(wifi_settings[element_index].password));
+    strlcpy(setting->ssid, ssid->valuestring, ssid_len + 1);
+    strlcpy(setting->password, pass->valuestring, pass_len + 1);
+    setting->ssid_len = ssid_len;
+    setting->password_len = pass_len;
     element_index++;
   }
   cJSON_Delete(root);
 
   unit_configuration_t* unit_configuration = unit_config_acquire();
-  connectivity_configuration_t* con_config = &(unit_configuration->con_config);
-  free(con_config->wifi_settings);
-  con_config->wifi_settings = wifi_settings;
-  unit_configuration->con_config.wifi_settings_count = element_count;
+  unit_config_replace_wifi_settings(unit_configuration, wifi_settings, element_count);
   unit_config_release();
 
   send_json_resp(req, 200, "Saved Wi-Fi");
+  struct nvs_manager* nvs_manager = get_nvs_manager();
+  nvs_manager_request_state(nvs_manager, NVS_STATE_WRITE_REQUEST, NULL, NULL);
+  managers_release();
+
+  // Try the new networks alongside the portal, clients stay connected to the AP while the STA connects
+  wifi_manager_t* wifi_manager = get_wifi_manager();
+  wifi_manager_request_state(wifi_manager, WIFI_MANAGER_STATE_STA_REQUEST | WIFI_MANAGER_STATE_AP_REQUEST, NULL, NULL);
+  managers_release();
 
   return ESP_OK;
 }
@@ -562,36 +805,43 @@ static esp_err_t ota_post_handler(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
   if (manager == NULL) return ESP_ERR_NOT_FOUND;
 
-  memset(manager->json_buffer, 0, sizeof(manager->json_buffer));
-  int r = httpd_req_recv(req, manager->json_buffer, sizeof(manager->json_buffer) - 1);
-  if (r <= 0) return ESP_FAIL;
-  manager->json_buffer[r] = 0;
-
-  cJSON* d = cJSON_Parse(manager->json_buffer);
-  if (!d) {
-    send_json_resp(req, 400, "Invalid data");
-    return ESP_FAIL;
-  }
+  cJSON* d = NULL;
+  if (receive_json(req, &d) != ESP_OK) return ESP_FAIL;
 
   const char* ota_url = cJSON_GetStringValue(cJSON_GetObjectItem(d, "ota_url"));
   const char* version_url = cJSON_GetStringValue(cJSON_GetObjectItem(d, "version_url"));
 
+  // Lengths are stored in a byte, MAX_URL_LENGTH - 1 is the longest URL that can be persisted
+  if ((ota_url && strlen(ota_url) >= MAX_URL_LENGTH) || (version_url && strlen(version_url) >= MAX_URL_LENGTH)) {
+    cJSON_Delete(d);
+    send_json_resp(req, 400, "URL too long");
+    return ESP_FAIL;
+  }
+
   unit_configuration_t* config = unit_config_acquire();
+  connectivity_configuration_t* con_config = &config->con_config;
 
-  if (ota_url) {
-    strlcpy(config->con_config.ota_url, ota_url, MAX_URL_LENGTH);
+  if (ota_url && unit_config_replace_string(config, &con_config->ota_url, &con_config->ota_url_len, ota_url) != ESP_OK) {
+    unit_config_release();
+    cJSON_Delete(d);
+    send_json_resp(req, 500, "Memory allocation failed");
+    return ESP_FAIL;
   }
 
-  if (version_url) {
-    strlcpy(config->con_config.version_url, version_url, MAX_URL_LENGTH);
+  if (version_url &&
+    unit_config_replace_string(config, &con_config->version_url, &con_config->version_url_len, version_url) != ESP_OK) {
+    unit_config_release();
+    cJSON_Delete(d);
+    send_json_resp(req, 500, "Memory allocation failed");
+    return ESP_FAIL;
   }
 
-  unit_config_release(config);
+  unit_config_release();
 
   cJSON_Delete(d);
   send_json_resp(req, 200, "OTA configuration saved");
   struct nvs_manager* nvs_manager = get_nvs_manager();
-  nvs_manager_request_state(nvs_manager, NVS_STATE_WRITE_REQUEST);
+  nvs_manager_request_state(nvs_manager, NVS_STATE_WRITE_REQUEST, NULL, NULL);
   managers_release();
   return ESP_OK;
 }
@@ -600,19 +850,8 @@ static esp_err_t sys_post_handler(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
   if (manager == NULL) return ESP_ERR_NOT_FOUND;
 
-  memset(manager->json_buffer, 0, sizeof(manager->json_buffer));
-  int r = httpd_req_recv(req, manager->json_buffer, sizeof(manager->json_buffer) - 1);
-  if (r <= 0) {
-    send_json_resp(req, 400, "Receive error");
-    return ESP_FAIL;
-  }
-  manager->json_buffer[r] = 0;
-
-  cJSON* d = cJSON_Parse(manager->json_buffer);
-  if (!d) {
-    send_json_resp(req, 400, "Invalid JSON");
-    return ESP_FAIL;
-  }
+  cJSON* d = NULL;
+  if (receive_json(req, &d) != ESP_OK) return ESP_FAIL;
 
   esp_err_t ret = ESP_OK;
   char* log_level_ptr = NULL;
@@ -653,9 +892,10 @@ static esp_err_t sys_post_handler(httpd_req_t* req) {
     }
 
     esp_log_level_set("*", sys_conf->log_level);
+    unit_config_mark_changed();
     unit_config_release();
     struct nvs_manager* nvs_manager = get_nvs_manager();
-    nvs_manager_request_state(nvs_manager, NVS_STATE_WRITE_REQUEST);
+    nvs_manager_request_state(nvs_manager, NVS_STATE_WRITE_REQUEST, NULL, NULL);
     managers_release();
   }
 
@@ -670,19 +910,8 @@ static esp_err_t user_post_handler(httpd_req_t* req) {
   web_page_manager_t* manager = req->user_ctx;
   if (manager == NULL) return ESP_ERR_NOT_FOUND;
 
-  memset(manager->json_buffer, 0, sizeof(manager->json_buffer));
-  int r = httpd_req_recv(req, manager->json_buffer, sizeof(manager->json_buffer) - 1);
-  if (r <= 0) {
-    send_json_resp(req, 400, "Receive error");
-    return ESP_FAIL;
-  }
-  manager->json_buffer[r] = 0;
-
-  cJSON* d = cJSON_Parse(manager->json_buffer);
-  if (!d) {
-    send_json_resp(req, 400, "Invalid JSON");
-    return ESP_FAIL;
-  }
+  cJSON* d = NULL;
+  if (receive_json(req, &d) != ESP_OK) return ESP_FAIL;
 
   esp_err_t ret = ESP_OK;
   char* unit_name = NULL;
@@ -705,21 +934,17 @@ static esp_err_t user_post_handler(httpd_req_t* req) {
       goto cleanup;
     }
 
-    char* new_name = realloc(config->user_config.unit_name, len + 1);
-    if (!new_name) {
+    user_configuration_t* usr_config = &config->user_config;
+    if (unit_config_replace_string(config, &usr_config->unit_name, &usr_config->unit_name_len, unit_name) != ESP_OK) {
       unit_config_release();
       send_json_resp(req, 500, "Memory error");
       ret = ESP_FAIL;
       goto cleanup;
     }
 
-    config->user_config.unit_name = new_name;
-    strlcpy(config->user_config.unit_name, unit_name, len + 1);
-    config->user_config.unit_name_len = len;
-
     unit_config_release();
     struct nvs_manager* nvs_manager = get_nvs_manager();
-    nvs_manager_request_state(nvs_manager, NVS_STATE_WRITE_REQUEST);
+    nvs_manager_request_state(nvs_manager, NVS_STATE_WRITE_REQUEST, NULL, NULL);
     managers_release();
   }
 
@@ -736,22 +961,203 @@ static esp_err_t cleanup_web_page_manager(web_page_manager_t* const manager) {
 
   const size_t N_HANDLERS = sizeof(manager->handlers) / sizeof(manager->handlers[0]);
 
+#ifdef CONFIG_WEB_PAGE_WEBSOCKET
+  stop_status_socket(manager);
+#endif
   for (size_t i = 0; i < N_HANDLERS; i++) {
     ret = httpd_unregister_uri_handler(manager->server, manager->handlers[i].uri, manager->handlers[i].method);
     if (ret != ESP_OK) return ret;
   }
 
   ret = httpd_stop(manager->server);
-  if (ret != ESP_OK) return ret;
+  if (ret == ESP_OK) manager->server = NULL;
+  return ret;
+}
 
-  for (resource_t i = 0; i < CONFIG_TYPE_COUNT; i++) {
-    if (manager->files[i].data_ptr != NULL) {
-      free((void*)manager->files[i].data_ptr);
-      manager->files[i].data_ptr = NULL;
+#ifdef CONFIG_WEB_PAGE_WEBSOCKET
+// Status pushes: a page opens /ws once and is sent Wi-Fi state changes, scan results and OTA progress as they happen,
+// instead of polling with a new connection each time. Events arrive on the event loop task and are handed to the
+// httpd task, which owns the client list and the sockets.
+static esp_err_t start_status_socket(web_page_manager_t* const manager) {
+  for (size_t i = 0; i < WS_MAX_CLIENTS; i++) manager->ws_fds[i] = -1;
+  manager->ws_client_count = 0;
+
+  const httpd_uri_t ws = {
+    .uri = "/ws",
+    .method = HTTP_GET,
+    .handler = ws_handler,
+    .user_ctx = manager,
+    .is_websocket = true
+  };
+  esp_err_t err = httpd_register_uri_handler(manager->server, &ws);
+  if (err != ESP_OK) return err;
+
+  xSemaphoreTake(manager->ws_lock, portMAX_DELAY);
+  manager->ws_server = manager->server;
+  xSemaphoreGive(manager->ws_lock);
+
+  err = esp_event_handler_instance_register(STATUS_EVENT, ESP_EVENT_ANY_ID, &status_event_handler, manager,
+                                            &manager->status_handler);
+  if (err != ESP_OK) stop_status_socket(manager);
+  return err;
+}
+
+// Called before httpd_stop(). Once the handle is cleared a push already running has queued its work and a later one
+// queues nothing, whether or not the event loop is still dispatching to the handler.
+static void stop_status_socket(web_page_manager_t* const manager) {
+  xSemaphoreTake(manager->ws_lock, portMAX_DELAY);
+  manager->ws_server = NULL;
+  xSemaphoreGive(manager->ws_lock);
+
+  if (manager->status_handler != NULL) {
+    esp_event_handler_instance_unregister(STATUS_EVENT, ESP_EVENT_ANY_ID, manager->status_handler);
+    manager->status_handler = NULL;
+  }
+  httpd_unregister_uri_handler(manager->server, "/ws", HTTP_GET);
+  manager->ws_client_count = 0;
+}
+
+// The handshake subscribes the socket and sends the current Wi-Fi state. Frames from the client are read and dropped,
+// httpd answers pings and closes by itself.
+static esp_err_t ws_handler(httpd_req_t* req) {
+  web_page_manager_t* manager = req->user_ctx;
+  if (manager == NULL) return ESP_ERR_NOT_FOUND;
+
+  if (req->method == HTTP_GET) {
+    if (!ws_add_client(manager, httpd_req_to_sockfd(req))) {
+      ESP_LOGW(TAG, "Status socket refused, %d clients connected", WS_MAX_CLIENTS);
+      return ESP_FAIL;
     }
+
+    wifi_manager_t* wifi_manager = get_wifi_manager();
+    const status_wifi_state_t state = {.state = wifi_manager_get_state(wifi_manager)};
+    managers_release();
+
+    char text[WS_MESSAGE_LENGTH];
+    httpd_ws_frame_t frame = {.final = true, .type = HTTPD_WS_TYPE_TEXT, .payload = (uint8_t*)text};
+    frame.len = format_status_message(STATUS_EVENT_WIFI_STATE, &state, text, sizeof(text));
+    return frame.len > 0 ? httpd_ws_send_frame(req, &frame) : ESP_OK;
   }
 
-  memset(manager->json_buffer, 0, sizeof(manager->json_buffer));
+  uint8_t payload[WS_MAX_FRAME];
+  httpd_ws_frame_t frame = {0};
+  esp_err_t err = httpd_ws_recv_frame(req, &frame, 0);
+  if (err != ESP_OK) return err;
+  if (frame.len > sizeof(payload)) return ESP_ERR_INVALID_SIZE;
 
-  return ret;
+  frame.payload = payload;
+  return frame.len > 0 ? httpd_ws_recv_frame(req, &frame, sizeof(payload)) : ESP_OK;
+}
+
+// A slot left by a closed socket is reused, httpd reuses the descriptor as well
+static bool ws_add_client(web_page_manager_t* const manager, const int fd) {
+  int free_slot = -1;
+  for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+    if (manager->ws_fds[i] == fd) return true;
+    if (manager->ws_fds[i] >= 0 && httpd_ws_get_fd_info(manager->server, manager->ws_fds[i]) != HTTPD_WS_CLIENT_WEBSOCKET) {
+      ws_remove_client(manager, i);
+    }
+    if (manager->ws_fds[i] < 0 && free_slot < 0) free_slot = (int)i;
+  }
+  if (free_slot < 0) return false;
+
+  manager->ws_fds[free_slot] = fd;
+  manager->ws_client_count++;
+  return true;
+}
+
+static void ws_remove_client(web_page_manager_t* const manager, const size_t index) {
+  manager->ws_fds[index] = -1;
+  manager->ws_client_count--;
+}
+
+static size_t format_status_message(const int32_t id, const void* data, char* text, const size_t size) {
+  cJSON* r = cJSON_CreateObject();
+  if (r == NULL) return 0;
+
+  switch (id) {
+    case STATUS_EVENT_WIFI_STATE:
+    {
+      const status_wifi_state_t* state = data;
+      cJSON_AddStringToObject(r, "type", "wifi");
+      cJSON_AddBoolToObject(r, "sta", (state->state & WIFI_MANAGER_STATE_STA) != 0);
+      cJSON_AddBoolToObject(r, "ip", (state->state & WIFI_MANAGER_STATE_STA_IP_RECEIVED) != 0);
+      cJSON_AddBoolToObject(r, "ap", (state->state & WIFI_MANAGER_STATE_AP) != 0);
+      break;
+    }
+    case STATUS_EVENT_SCAN_DONE:
+    {
+      const status_scan_done_t* scan = data;
+      cJSON_AddStringToObject(r, "type", "scan");
+      cJSON_AddNumberToObject(r, "aps", scan->ap_count);
+      cJSON_AddNumberToObject(r, "matches", scan->matches);
+      if (scan->best_ssid[0] != '\0') {
+        cJSON_AddStringToObject(r, "best", scan->best_ssid);
+        cJSON_AddNumberToObject(r, "rssi", scan->best_rssi);
+      }
+      break;
+    }
+    case STATUS_EVENT_OTA_PROGRESS:
+    {
+      const status_ota_progress_t* progress = data;
+      cJSON_AddStringToObject(r, "type", "ota");
+      cJSON_AddNumberToObject(r, "bytes", progress->bytes);
+      cJSON_AddNumberToObject(r, "total", (double)progress->total);
+      cJSON_AddBoolToObject(r, "done", progress->done);
+      if (progress->done) cJSON_AddStringToObject(r, "result", esp_err_to_name(progress->err));
+      break;
+    }
+    default:
+      cJSON_Delete(r);
+      return 0;
+  }
+
+  const bool printed = cJSON_PrintPreallocated(r, text, (int)size, false);
+  cJSON_Delete(r);
+  return printed ? strlen(text) : 0;
+}
+
+// Runs on the event loop task. The client count is read without the httpd task: a page that has just connected
+// misses at most this one event.
+static void status_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
+  web_page_manager_t* manager = arg;
+  if (manager->ws_client_count == 0) return;
+
+  ws_message_t* message = malloc(sizeof(ws_message_t));
+  if (message == NULL) return;
+
+  message->manager = manager;
+  message->len = format_status_message(event_id, event_data, message->text, sizeof(message->text));
+  if (message->len == 0) {
+    free(message);
+    return;
+  }
+
+  xSemaphoreTake(manager->ws_lock, portMAX_DELAY);
+  if (manager->ws_server == NULL || httpd_queue_work(manager->ws_server, ws_broadcast, message) != ESP_OK) free(message);
+  xSemaphoreGive(manager->ws_lock);
+}
+
+// Runs on the httpd task
+static void ws_broadcast(void* arg) {
+  ws_message_t* message = arg;
+  web_page_manager_t* manager = message->manager;
+
+  httpd_ws_frame_t frame = {
+    .final = true,
+    .type = HTTPD_WS_TYPE_TEXT,
+    .payload = (uint8_t*)message->text,
+    .len = message->len
+  };
+  for (size_t i = 0; i < WS_MAX_CLIENTS; i++) {
+    const int fd = manager->ws_fds[i];
+    if (fd < 0) continue;
+
+    if (httpd_ws_get_fd_info(manager->server, fd) != HTTPD_WS_CLIENT_WEBSOCKET ||
+      httpd_ws_send_frame_async(manager->server, fd, &frame) != ESP_OK) {
+      ws_remove_client(manager, i);
+    }
+  }
+  free(message);
 }
+#endif
@@ -16,26 +16,81 @@
 
 #include "wifi_manager.h"
 
+#include "nvs_manager.h"
 #include "state.h"
+#include "status_event.h"
+#include "telemetry.h"
 
 #include <configuration.h>
 #include <esp_err.h>
 #include <esp_event.h>
 #include <esp_event_base.h>
 #include <esp_log.h>
+#include <esp_mac.h>
+#include <esp_random.h>
 #include <esp_timer.h>
 #include <esp_wifi.h>
 #include <freertos/FreeRTOS.h>
 #include <freertos/task.h>
 #include <string.h>
 
-#define WIFI_DELAY_RECONNECT_MS 30000 // #TODO refactor into configurable settings
+#define CONNECTION_HINT_KEY "wifi_hint"
+
+#ifdef CONFIG_WIFI_FAST_RECONNECT
+#define FAST_RECONNECT_ENABLED true
+#else
+#define FAST_RECONNECT_ENABLED false
+#endif
+
+// A directed scan carries the SSID in its probes, so the dwell per channel can be short
+#define DIRECTED_SCAN_MIN_MS 100
+#define DIRECTED_SCAN_MAX_MS 300
+#define SCAN_CHANNEL_UNSET UINT8_MAX // No directed scan made yet for the network, try its learned channel first
+
+#ifdef CONFIG_WIFI_ROAMING
+#define ROAMING_ENABLED true
+#define ROAM_RSSI_THRESHOLD CONFIG_WIFI_ROAM_RSSI_THRESHOLD
+#define ROAM_RSSI_HYSTERESIS CONFIG_WIFI_ROAM_RSSI_HYSTERESIS
+#define ROAM_POLL_INTERVAL_MS CONFIG_WIFI_ROAM_POLL_INTERVAL_MS
+#define ROAM_SCAN_INTERVAL_MS CONFIG_WIFI_ROAM_SCAN_INTERVAL_MS
+#else
+#define ROAMING_ENABLED false
+#define ROAM_RSSI_THRESHOLD 0
+#define ROAM_RSSI_HYSTERESIS 0
+#define ROAM_POLL_INTERVAL_MS 0
+#define ROAM_SCAN_INTERVAL_MS 0
+#endif
+
+// Posted by the roaming timer, so the RSSI check and the background scan run on the manager's task; not part of the
+// public request set
+#define WIFI_MANAGER_ROAM_CHECK_REQUEST ((wifi_manager_state_request_t)BIT3)
+
+// Background scans run while associated, so each channel is only visited briefly before returning to the home channel
+#define ROAM_SCAN_MIN_MS 20
+#define ROAM_SCAN_MAX_MS 60
+#define ROAM_SCAN_HOME_DWELL_MS 60
 
 static const char* TAG = "Wi-Fi Manager";
 
+// How a disconnect is retried, decided from its reason
+typedef enum
+{
+  RECONNECT_TRANSIENT, // Link dropped or association hiccup, the AP is most likely still there
+  RECONNECT_NOT_FOUND, // AP absent, keep probing on a backoff
+  RECONNECT_CREDENTIALS, // Rejected credentials, retrying only repeats the failure
+} reconnect_policy_t;
+
+// Last network an IP was obtained on, persisted so the next connect can skip the scan
+typedef struct
+{
+  char ssid[MAX_SSID_LEN + 1];
+  uint8_t bssid[6];
+  uint8_t channel;
+} connection_hint_t;
+
 struct wifi_manager
 {
-  EventGroupHandle_t request_event_group;
+  QueueHandle_t request_queue;
   EventGroupHandle_t state_event_group;
   TaskHandle_t fsm_task_handle;
 
@@ -47,6 +102,28 @@ struct wifi_manager
   esp_event_handler_instance_t ip_event_handler_t;
   esp_timer_handle_t retry_timer;
   uint32_t retry_count;
+  uint8_t immediate_retries;
+  uint8_t backoff_exponent;
+  uint8_t auth_failures;
+  connection_hint_t hint;
+  bool hint_loaded;
+  bool fast_connect_pending; // A direct connect from the hint is in flight, a failure falls back to the scan
+  bool rescan_pending; // STA re-requested while connected, e.g. for new credentials, scan again once disconnected
+  bool sta_stopping; // STA torn down by a transition, its disconnect is not retried until STA is requested again
+  // Scan in progress: either a single full scan, or one directed scan per configured network
+  bool directed_scan;
+  uint8_t scan_index;
+  uint8_t scan_channel; // Channel of the directed scan in progress, 0 for all channels
+  char scan_ssid[MAX_SSID_LEN + 1];
+  int8_t best_rssi;
+  bool network_found;
+  // Roaming: RSSI is polled while an IP is held, a weak link triggers a background scan for a better BSSID
+  esp_timer_handle_t roam_timer;
+  int64_t last_roam_scan_us;
+  bool roam_scan; // The scan in progress is a background scan, the current link stays up
+  int64_t scan_started_us;
+  bool roam_pending; // Disconnecting from the current AP to associate to the selected candidate
+  bool roam_attempt; // Associating to the candidate, a failure falls back to connecting by SSID
   char ap_ssid[MAX_SSID_LEN];
   char ap_password[MAX_PASSPHRASE_LEN]; // #TODO refactor
   bool sta_config_set;
@@ -57,23 +134,42 @@ static void fsm_task(void* arg);
 static void wifi_event_handler(void* arg, esp_event_base_t base, int32_t event_id, void* data);
 static void ip_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
 static esp_err_t transition_to_state(wifi_manager_t* manager, wifi_manager_state_t new_state);
+static void publish_state(wifi_manager_t const* manager);
+static void restart_sta_connection(wifi_manager_t* wifi_manager);
 static void retry_timer_callback(void* arg);
-static esp_err_t find_strongest_ssid(wifi_manager_t const* manager);
-static esp_err_t start_wifi_scan(wifi_manager_t const* wifi_manager);
+static void roam_timer_callback(void* arg);
+static void check_roaming(wifi_manager_t* wifi_manager);
+static void start_roaming(wifi_manager_t* wifi_manager);
+static void stop_roaming(wifi_manager_t* wifi_manager);
+static esp_err_t start_roam_scan(wifi_manager_t* wifi_manager);
+static void handle_roam_scan_done(wifi_manager_t* wifi_manager);
+static void copy_credentials(wifi_sta_config_t* sta, const wifi_settings_t* setting);
+static esp_err_t collect_scan_results(wifi_manager_t* manager, const uint8_t* exclude_bssid, uint16_t* matches);
+static esp_err_t start_wifi_scan(wifi_manager_t* wifi_manager);
+static esp_err_t start_next_directed_scan(wifi_manager_t* wifi_manager);
 static esp_err_t connect_to_sta(wifi_manager_t* wifi_manager);
+static esp_err_t fast_connect_to_sta(wifi_manager_t* wifi_manager);
+static void store_connection_hint(wifi_manager_t* wifi_manager);
+static void unpin_bssid(wifi_manager_t* wifi_manager);
 static void handle_sta_disconnected(wifi_manager_t* wifi_manager, wifi_event_sta_disconnected_t const* event_data);
 static void handle_sta_ip_obtained(wifi_manager_t* wifi_manager, ip_event_got_ip_t const* event_data);
 static void log_wifi_disconnect(uint8_t reason);
+static reconnect_policy_t reconnect_policy(uint8_t reason);
+static uint32_t next_backoff_ms(wifi_manager_t* wifi_manager);
+static void schedule_reconnect(wifi_manager_t* wifi_manager, uint8_t reason);
+static void abandon_sta(wifi_manager_t* wifi_manager);
 
 wifi_manager_t* wifi_manager_create(UBaseType_t priority) {
   static bool netif_initliazed = false;
   wifi_manager_t* manager = calloc(1, sizeof(wifi_manager_t));
   if (!manager) return NULL;
 
-  manager->request_event_group = xEventGroupCreate();
+  manager->request_queue = request_bus_create();
   manager->state_event_group = xEventGroupCreate();
 
-  if (!manager->request_event_group || !manager->state_event_group) {
+  if (!manager->request_queue || !manager->state_event_group) {
+    request_bus_delete(manager->request_queue);
+    if (manager->state_event_group) vEventGroupDelete(manager->state_event_group);
     free(manager);
     return NULL;
   }
@@ -87,6 +183,12 @@ wifi_manager_t* wifi_manager_create(UBaseType_t priority) {
   manager->ap_config.ap.max_connection = 1;
   manager->ap_config.ap.authmode = strlen(CONFIG_AP_PASSWORD) == 0 ? WIFI_AUTH_OPEN : WIFI_AUTH_WPA2_PSK;
   manager->ap_config.ap.pmf_cfg.required = false;
+  // 802.11k neighbour reports and 802.11v BSS transition requests let the AP steer the station, where the IDF
+  // is built with CONFIG_ESP_WIFI_11KV_SUPPORT and the AP supports them; otherwise the flags are ignored
+  manager->sta_config.sta.rm_enabled = ROAMING_ENABLED;
+  manager->sta_config.sta.btm_enabled = ROAMING_ENABLED;
+  // Beacons slept through between wake-ups, while the power manager has the modem in max modem sleep
+  manager->sta_config.sta.listen_interval = CONFIG_POWER_STA_LISTEN_INTERVAL;
 
   esp_timer_create_args_t timer_args = {
     .callback = retry_timer_callback,
@@ -95,6 +197,15 @@ wifi_manager_t* wifi_manager_create(UBaseType_t priority) {
   };
   ESP_ERROR_CHECK(esp_timer_create(&timer_args, &manager->retry_timer));
 
+  if (ROAMING_ENABLED) {
+    const esp_timer_create_args_t roam_timer_args = {
+      .callback = roam_timer_callback,
+      .arg = manager,
+      .name = "wifi_roam_timer"
+    };
+    ESP_ERROR_CHECK(esp_timer_create(&roam_timer_args, &manager->roam_timer));
+  }
+
   if (!netif_initliazed) {
     ESP_ERROR_CHECK(esp_netif_init()); // Should only be called once in program life-time
     netif_initliazed = true;
@@ -115,6 +226,7 @@ wifi_manager_t* wifi_manager_create(UBaseType_t priority) {
     priority,
     &manager->fsm_task_handle
     );
+  telemetry_register_task(manager->fsm_task_handle);
 
   return manager;
 }
@@ -133,6 +245,10 @@ void wifi_manager_destroy(wifi_manager_t* manager) {
     esp_timer_stop(manager->retry_timer);
     esp_timer_delete(manager->retry_timer);
   }
+  if (manager->roam_timer) {
+    esp_timer_stop(manager->roam_timer);
+    esp_timer_delete(manager->roam_timer);
+  }
 
   if (manager->sta_netif) {
     esp_netif_destroy(manager->sta_netif);
@@ -144,11 +260,10 @@ void wifi_manager_destroy(wifi_manager_t* manager) {
   esp_event_loop_delete_default();
 
   if (manager->fsm_task_handle) {
+    telemetry_unregister_task(manager->fsm_task_handle);
     vTaskDelete(manager->fsm_task_handle);
   }
-  if (manager->request_event_group) {
-    vEventGroupDelete(manager->request_event_group);
-  }
+  request_bus_delete(manager->request_queue);
   if (manager->state_event_group) {
     vEventGroupDelete(manager->state_event_group);
   }
@@ -164,11 +279,11 @@ void wifi_manager_destroy(wifi_manager_t* manager) {
   free(manager);
 }
 
-esp_err_t wifi_manager_request_state(wifi_manager_t* manager, wifi_manager_state_request_t new_state) {
+esp_err_t wifi_manager_request_state(wifi_manager_t* manager, wifi_manager_state_request_t new_state,
+                                     const request_callback_t callback, void* user_data) {
   if (!manager) return ESP_ERR_INVALID_ARG;
 
-  xEventGroupSetBits(manager->request_event_group, new_state);
-  return ESP_OK;
+  return request_bus_post(manager->request_queue, new_state, callback, user_data);
 }
 
 wifi_manager_state_t wifi_manager_get_state(const wifi_manager_t* manager) {
@@ -184,54 +299,168 @@ static void retry_timer_callback(void* arg) {
   esp_wifi_connect();
 }
 
+static void roam_timer_callback(void* arg) {
+  wifi_manager_t* manager = arg;
+  request_bus_try_post(manager->request_queue, WIFI_MANAGER_ROAM_CHECK_REQUEST, NULL, NULL);
+}
+
+static void check_roaming(wifi_manager_t* const manager) {
+  if (!(xEventGroupGetBits(manager->state_event_group) & WIFI_MANAGER_STATE_STA_IP_RECEIVED)) return;
+  if (manager->roam_scan || manager->roam_pending || manager->roam_attempt) return;
+
+  wifi_ap_record_t ap_info;
+  if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) return;
+  if (ap_info.rssi >= ROAM_RSSI_THRESHOLD) return;
+
+  const int64_t now = esp_timer_get_time();
+  if (manager->last_roam_scan_us != 0 &&
+      now - manager->last_roam_scan_us < (int64_t)ROAM_SCAN_INTERVAL_MS * 1000) {
+    return;
+  }
+
+  ESP_LOGI(TAG, "RSSI %d dBm below roaming threshold, scanning for a better AP", ap_info.rssi);
+  manager->last_roam_scan_us = now;
+  start_roam_scan(manager);
+}
+
+static void start_roaming(wifi_manager_t* const wifi_manager) {
+  if (!ROAMING_ENABLED) return;
+
+  wifi_manager->roam_pending = false;
+  wifi_manager->roam_attempt = false;
+  esp_timer_stop(wifi_manager->roam_timer);
+  esp_timer_start_periodic(wifi_manager->roam_timer, (uint64_t)ROAM_POLL_INTERVAL_MS * 1000);
+}
+
+static void stop_roaming(wifi_manager_t* const wifi_manager) {
+  if (!ROAMING_ENABLED) return;
+
+  esp_timer_stop(wifi_manager->roam_timer);
+}
+
+// A repeated STA request, e.g. after the networks were changed from the portal, starts over with a fresh scan and
+// retry budget on the interface that is already up
+static void restart_sta_connection(wifi_manager_t* const wifi_manager) {
+  ESP_LOGI(TAG, "Restarting STA connection");
+  esp_timer_stop(wifi_manager->retry_timer);
+  stop_roaming(wifi_manager);
+  wifi_manager->retry_count = 0;
+  wifi_manager->immediate_retries = 0;
+  wifi_manager->backoff_exponent = 0;
+  wifi_manager->auth_failures = 0;
+  wifi_manager->roam_pending = false;
+  wifi_manager->roam_attempt = false;
+
+  if (xEventGroupGetBits(wifi_manager->state_event_group) & WIFI_MANAGER_STATE_STA_IP_RECEIVED) {
+    wifi_manager->rescan_pending = true;
+    if (esp_wifi_disconnect() == ESP_OK) return;
+    wifi_manager->rescan_pending = false;
+  }
+
+  // Not connected: a scan already in flight reports with the new networks anyway, as results are matched against
+  // the current configuration
+  const esp_err_t err = start_wifi_scan(wifi_manager);
+  if (err != ESP_OK) ESP_LOGW(TAG, "STA restart scan failed: %s", esp_err_to_name(err));
+}
+
 void wifi_manager_wait_until_state(wifi_manager_t const* const manager, const wifi_manager_state_t wifi_state) {
   if (manager == NULL) return;
 
   xEventGroupWaitBits(manager->state_event_group, wifi_state, pdFALSE, pdFALSE, portMAX_DELAY);
 }
 
-static esp_err_t find_strongest_ssid(wifi_manager_t const* const manager) {
-  ESP_LOGI(TAG, "Finding strongest SSID");
+// Configured SSIDs by hash, so each scanned AP is matched in constant time
+typedef struct
+{
+  const wifi_settings_t** slots;
+  size_t mask;
+} ssid_lookup_t;
+
+static uint32_t hash_ssid(const char* ssid) {
+  uint32_t hash = 2166136261u; // FNV-1a
+  for (size_t i = 0; i < MAX_SSID_LEN && ssid[i] != '\0'; i++) {
+    hash = (hash ^ (uint8_t)ssid[i]) * 16777619u;
+  }
+  return hash;
+}
+
+// The driver's fields are not NUL-terminated when full, a 32 byte SSID or a 64 digit hex PSK fills them exactly
+static void copy_credentials(wifi_sta_config_t* const sta, const wifi_settings_t* const setting) {
+  strncpy((char*)sta->ssid, setting->ssid, sizeof(sta->ssid));
+  strncpy((char*)sta->password, setting->password != NULL ? setting->password : "", sizeof(sta->password));
+}
+
+static esp_err_t ssid_lookup_init(ssid_lookup_t* lookup, const connectivity_configuration_t* con_cfg) {
+  size_t size = 4;
+  while (size < 2 * (size_t)con_cfg->wifi_settings_count) size <<= 1;
+
+  lookup->slots = calloc(size, sizeof(*lookup->slots));
+  lookup->mask = size - 1;
+  if (lookup->slots == NULL) return ESP_ERR_NO_MEM;
+
+  for (size_t i = 0; i < con_cfg->wifi_settings_count; i++) {
+    const wifi_settings_t* setting = &con_cfg->wifi_settings[i];
+    if (setting->ssid == NULL) continue;
+
+    size_t slot = hash_ssid(setting->ssid) & lookup->mask;
+    while (lookup->slots[slot] != NULL) slot = (slot + 1) & lookup->mask;
+    lookup->slots[slot] = setting;
+  }
+  return ESP_OK;
+}
+
+static const wifi_settings_t* ssid_lookup_find(const ssid_lookup_t* lookup, const char* ssid) {
+  for (size_t slot = hash_ssid(ssid) & lookup->mask; lookup->slots[slot] != NULL; slot = (slot + 1) & lookup->mask) {
+    if (strncmp(lookup->slots[slot]->ssid, ssid, MAX_SSID_LEN) == 0) return lookup->slots[slot];
+  }
+  return NULL;
+}
 
+// Records are taken one at a time, the driver frees each as it is read, so no list of every AP is allocated
+// A record beats the current best by RSSI, best_rssi can be seeded to require a margin. The excluded BSSID, the AP
+// already associated to when roaming, is never selected.
+static esp_err_t collect_scan_results(wifi_manager_t* const manager, const uint8_t* const exclude_bssid,
+                                      uint16_t* const matches) {
   uint16_t ap_count = 0;
   ESP_ERROR_CHECK(esp_wifi_scan_get_ap_num(&ap_count));
 
-  wifi_ap_record_t* ap_records = malloc(sizeof(wifi_ap_record_t) * ap_count);
-  if (!ap_records) return ESP_ERR_NO_MEM;
+  const unit_configuration_t* config = unit_config_snapshot_get();
+  if (config == NULL) {
+    esp_wifi_clear_ap_list();
+    return ESP_ERR_INVALID_STATE;
+  }
 
-  ESP_ERROR_CHECK(esp_wifi_scan_get_ap_records(&ap_count, ap_records));
+  ssid_lookup_t lookup;
+  if (ssid_lookup_init(&lookup, &config->con_config) != ESP_OK) {
+    unit_config_snapshot_put(config);
+    esp_wifi_clear_ap_list();
+    return ESP_ERR_NO_MEM;
+  }
 
-  const unit_configuration_t* config = unit_config_acquire();
-  int8_t best_rssi = -127;
-  bool found = false;
+  wifi_ap_record_t record;
+  for (uint16_t i = 0; i < ap_count && esp_wifi_scan_get_ap_record(&record) == ESP_OK; i++) {
+    const wifi_settings_t* setting = ssid_lookup_find(&lookup, (const char*)record.ssid);
+    if (setting == NULL) continue;
 
-  for (int i = 0; i < ap_count; i++) {
-    for (size_t j = 0; j < config->con_config.wifi_settings_count; j++) {
-      const wifi_settings_t* setting = &config->con_config.wifi_settings[j];
+    (*matches)++;
+    if (record.rssi <= manager->best_rssi) continue;
+    if (exclude_bssid != NULL && memcmp(record.bssid, exclude_bssid, sizeof(record.bssid)) == 0) continue;
 
-      if (strncmp((char*)ap_records[i].ssid, setting->ssid,
-                  sizeof(ap_records[i].ssid)) == 0) {
-        if (ap_records[i].rssi > best_rssi) {
-          best_rssi = ap_records[i].rssi;
-          strlcpy((char*)manager->sta_config.sta.ssid,
-                  setting->ssid, MAX_SSID_LEN);
-          strlcpy((char*)manager->sta_config.sta.password,
-                  setting->password, MAX_PASSPHRASE_LEN);
-          found = true;
-        }
-      }
-    }
-    taskYIELD();
+    manager->best_rssi = record.rssi;
+    manager->network_found = true;
+    copy_credentials(&manager->sta_config.sta, setting);
+    manager->sta_config.sta.channel = record.primary;
+    memcpy(manager->sta_config.sta.bssid, record.bssid, sizeof(manager->sta_config.sta.bssid));
   }
+  esp_wifi_clear_ap_list();
 
-  unit_config_release();
-  free(ap_records);
-  if (found) {
-    ESP_LOGI(TAG, "Found network SSID [%s] at RSSI dBm [%d]", (char*)manager->sta_config.sta.ssid, best_rssi);
-  } else {
-    ESP_LOGW(TAG, "No network SSID found");
-  }
-  return found ? ESP_OK : ESP_ERR_NOT_FOUND;
+  free(lookup.slots);
+  unit_config_snapshot_put(config);
+
+  status_scan_done_t scan = {.ap_count = ap_count, .matches = *matches, .best_rssi = manager->best_rssi};
+  if (manager->network_found) memcpy(scan.best_ssid, manager->sta_config.sta.ssid, MAX_SSID_LEN);
+  status_event_post(STATUS_EVENT_SCAN_DONE, &scan, sizeof(scan));
+  return ESP_OK;
 }
 
 static void fsm_task(void* arg) {
@@ -240,40 +469,42 @@ static void fsm_task(void* arg) {
   xEventGroupSetBits(manager->state_event_group, WIFI_MANAGER_STATE_NONE);
 
   while (1) {
-    EventBits_t bits = xEventGroupWaitBits(
-      manager->request_event_group,
-      WIFI_MANAGER_STATE_NONE_REQUEST |
-      WIFI_MANAGER_STATE_STA_REQUEST |
-      WIFI_MANAGER_STATE_AP_REQUEST,
-      pdTRUE, pdFALSE, portMAX_DELAY
-      );
-
-    wifi_manager_state_t requested_state = WIFI_MANAGER_STATE_NONE;
-    if (bits == WIFI_MANAGER_STATE_NONE_REQUEST) requested_state = WIFI_MANAGER_STATE_NONE;
-    else if (bits == WIFI_MANAGER_STATE_STA_REQUEST) requested_state = WIFI_MANAGER_STATE_STA;
-    else if (bits == WIFI_MANAGER_STATE_AP_REQUEST) requested_state = WIFI_MANAGER_STATE_AP;
-    else if (bits == (WIFI_MANAGER_STATE_AP_REQUEST | WIFI_MANAGER_STATE_STA)) requested_state = WIFI_MANAGER_STATE_AP | WIFI_MANAGER_STATE_STA;
-    else
-      ESP_LOGW(TAG, "Requested state not recognized: %d", requested_state);
+    request_message_t message;
+    request_bus_receive(manager->request_queue, &message);
+    const uint32_t bits = message.request;
+
+    if (bits == WIFI_MANAGER_ROAM_CHECK_REQUEST) {
+      check_roaming(manager);
+      continue;
+    }
+
+    // STA and AP in one request combine into APSTA, a NONE request wins over both
+    wifi_manager_state_t requested_state = 0;
+    if (bits & WIFI_MANAGER_STATE_NONE_REQUEST) requested_state = WIFI_MANAGER_STATE_NONE;
+    else {
+      if (bits & WIFI_MANAGER_STATE_STA_REQUEST) requested_state |= WIFI_MANAGER_STATE_STA;
+      if (bits & WIFI_MANAGER_STATE_AP_REQUEST) requested_state |= WIFI_MANAGER_STATE_AP;
+    }
 
     const esp_err_t err = transition_to_state(manager, requested_state);
     if (err != ESP_OK)
       ESP_LOGE(TAG, "State transition failed: %s", esp_err_to_name(err));
 
-    taskYIELD();
+    request_bus_complete(&message, err);
   }
 }
 
 static esp_err_t connect_to_sta(wifi_manager_t* const wifi_manager) {
   ESP_LOGI(TAG, "Connecting to STA");
 
-  esp_err_t err = find_strongest_ssid(wifi_manager);
-  if (err != ESP_OK) {
-    ESP_LOGW(TAG, "Failed to find strongest SSID");
-    return err;
+  if (!wifi_manager->network_found) {
+    ESP_LOGW(TAG, "No network SSID found");
+    return ESP_ERR_NOT_FOUND;
   }
+  ESP_LOGI(TAG, "Found network SSID [%.*s] at RSSI dBm [%d]", MAX_SSID_LEN, (char*)wifi_manager->sta_config.sta.ssid,
+           wifi_manager->best_rssi);
 
-  err = esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_manager->sta_config);
+  esp_err_t err = esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_manager->sta_config);
   if (err != ESP_OK) {
     ESP_LOGW(TAG, "Failed to set STA config");
     return err;
@@ -286,6 +517,98 @@ static esp_err_t connect_to_sta(wifi_manager_t* const wifi_manager) {
   return err;
 }
 
+// Associates straight to the BSSID and channel that last gave an IP, if that network is still configured
+static esp_err_t fast_connect_to_sta(wifi_manager_t* const wifi_manager) {
+  if (!wifi_manager->hint_loaded) {
+    size_t size = sizeof(wifi_manager->hint);
+    nvs_manager_t* nvs_manager = get_nvs_manager();
+    const esp_err_t err = nvs_manager_load_blob(nvs_manager, CONNECTION_HINT_KEY, &wifi_manager->hint, &size);
+    managers_release();
+    if (err != ESP_OK || size != sizeof(wifi_manager->hint)) {
+      memset(&wifi_manager->hint, 0, sizeof(wifi_manager->hint));
+    }
+    wifi_manager->hint_loaded = true;
+  }
+
+  const connection_hint_t* hint = &wifi_manager->hint;
+  if (hint->ssid[0] == '\0' || hint->channel == 0) return ESP_ERR_NOT_FOUND;
+
+  const unit_configuration_t* config = unit_config_snapshot_get();
+  if (config == NULL) return ESP_ERR_INVALID_STATE;
+
+  const wifi_settings_t* match = NULL;
+  for (size_t i = 0; i < config->con_config.wifi_settings_count; i++) {
+    const wifi_settings_t* setting = &config->con_config.wifi_settings[i];
+    if (setting->ssid != NULL && strncmp(setting->ssid, hint->ssid, sizeof(hint->ssid)) == 0) {
+      match = setting;
+      break;
+    }
+  }
+
+  if (match == NULL) {
+    unit_config_snapshot_put(config);
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  wifi_sta_config_t* sta = &wifi_manager->sta_config.sta;
+  copy_credentials(sta, match);
+  unit_config_snapshot_put(config);
+
+  memcpy(sta->bssid, hint->bssid, sizeof(sta->bssid));
+  sta->bssid_set = true;
+  sta->channel = hint->channel;
+
+  esp_err_t err = esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_manager->sta_config);
+  if (err == ESP_OK) {
+    ESP_LOGI(TAG, "Fast connect to [%s] on channel %u", hint->ssid, hint->channel);
+    wifi_manager->fast_connect_pending = true;
+    err = esp_wifi_connect();
+  }
+
+  if (err != ESP_OK) {
+    wifi_manager->fast_connect_pending = false;
+    sta->bssid_set = false;
+    sta->channel = 0;
+  }
+  return err;
+}
+
+static void store_connection_hint(wifi_manager_t* const wifi_manager) {
+  wifi_ap_record_t ap_info;
+  if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) return;
+
+  connection_hint_t hint = {0};
+  strlcpy(hint.ssid, (const char*)ap_info.ssid, sizeof(hint.ssid));
+  memcpy(hint.bssid, ap_info.bssid, sizeof(hint.bssid));
+  hint.channel = ap_info.primary;
+
+  if (wifi_manager->hint_loaded && memcmp(&hint, &wifi_manager->hint, sizeof(hint)) == 0) return;
+
+  // Runs on the event loop, so the write is left to the NVS manager's task rather than waiting on flash here
+  nvs_manager_t* nvs_manager = get_nvs_manager();
+  const esp_err_t err = nvs_manager_post_blob(nvs_manager, CONNECTION_HINT_KEY, &hint, sizeof(hint));
+  managers_release();
+
+  if (err == ESP_OK) {
+    wifi_manager->hint = hint;
+    wifi_manager->hint_loaded = true;
+  } else {
+    ESP_LOGW(TAG, "Failed to store connection hint: %s", esp_err_to_name(err));
+  }
+}
+
+// A BSSID and channel pinned for a fast connect or a roam only hold for that association, later reconnects go by SSID so the
+// network is found again wherever it is
+static void unpin_bssid(wifi_manager_t* const wifi_manager) {
+  wifi_sta_config_t* sta = &wifi_manager->sta_config.sta;
+  if (!sta->bssid_set) return;
+
+  sta->bssid_set = false;
+  sta->channel = 0;
+  const esp_err_t err = esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_manager->sta_config);
+  if (err != ESP_OK) ESP_LOGW(TAG, "Failed to clear the BSSID pin: %s", esp_err_to_name(err));
+}
+
 static void log_wifi_disconnect(const uint8_t reason) {
   switch (reason) {
     case WIFI_REASON_AUTH_EXPIRE:
@@ -320,16 +643,121 @@ static void log_wifi_disconnect(const uint8_t reason) {
 
 static void handle_sta_disconnected(wifi_manager_t* const wifi_manager,
                                     wifi_event_sta_disconnected_t const* const event_data) {
-  ESP_LOGI(TAG, "Sta disconnected. Retrying to connect");
-
   log_wifi_disconnect(event_data->reason);
+  stop_roaming(wifi_manager);
+
+  if (wifi_manager->sta_stopping) {
+    xEventGroupClearBits(wifi_manager->state_event_group, WIFI_MANAGER_STATE_STA_IP_RECEIVED);
+    publish_state(wifi_manager);
+    return;
+  }
+
+  if (wifi_manager->roam_pending) {
+    // Left the old AP on purpose, go straight to the candidate
+    wifi_manager->roam_pending = false;
+    wifi_manager->roam_attempt = true;
+    if (esp_wifi_connect() == ESP_OK) return;
+  }
+
+  if (wifi_manager->roam_attempt) {
+    ESP_LOGI(TAG, "Roaming to candidate AP failed, reconnecting by SSID");
+    wifi_manager->roam_attempt = false;
+    unpin_bssid(wifi_manager);
+  }
+
+  xEventGroupClearBits(wifi_manager->state_event_group, WIFI_MANAGER_STATE_STA_IP_RECEIVED);
+  publish_state(wifi_manager);
+
+  if (wifi_manager->fast_connect_pending || wifi_manager->rescan_pending) {
+    ESP_LOGI(TAG, "%s, scanning for networks", wifi_manager->rescan_pending ? "STA restarted" : "Fast connect failed");
+    wifi_manager->fast_connect_pending = false;
+    wifi_manager->rescan_pending = false;
+    wifi_manager->sta_config.sta.bssid_set = false;
+    wifi_manager->sta_config.sta.channel = 0;
+    if (start_wifi_scan(wifi_manager) == ESP_OK) return;
+  }
+
+  unpin_bssid(wifi_manager);
+  schedule_reconnect(wifi_manager, event_data->reason);
+}
 
-  if (wifi_manager->retry_count < CONFIG_WIFI_RETRIES) {
-    esp_timer_start_once(wifi_manager->retry_timer, WIFI_DELAY_RECONNECT_MS * 1000);
-    wifi_manager->retry_count++;
+static reconnect_policy_t reconnect_policy(const uint8_t reason) {
+  switch (reason) {
+    case WIFI_REASON_AUTH_FAIL:
+    case WIFI_REASON_4WAY_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_HANDSHAKE_TIMEOUT:
+    case WIFI_REASON_802_1X_AUTH_FAILED:
+      return RECONNECT_CREDENTIALS;
+    case WIFI_REASON_NO_AP_FOUND:
+    case WIFI_REASON_NO_AP_FOUND_W_COMPATIBLE_SECURITY:
+    case WIFI_REASON_NO_AP_FOUND_IN_AUTHMODE_THRESHOLD:
+    case WIFI_REASON_NO_AP_FOUND_IN_RSSI_THRESHOLD:
+      return RECONNECT_NOT_FOUND;
+    default:
+      return RECONNECT_TRANSIENT;
+  }
+}
+
+// Exponential from the minimum up to the maximum, with the upper half jittered so that units sharing an AP spread
+// their retries after it reboots
+static uint32_t next_backoff_ms(wifi_manager_t* const wifi_manager) {
+  uint32_t delay_ms = CONFIG_WIFI_RECONNECT_BACKOFF_MIN_MS;
+  for (uint8_t i = 0; i < wifi_manager->backoff_exponent && delay_ms < CONFIG_WIFI_RECONNECT_BACKOFF_MAX_MS; i++) {
+    delay_ms *= 2;
+  }
+  if (delay_ms >= CONFIG_WIFI_RECONNECT_BACKOFF_MAX_MS) {
+    delay_ms = CONFIG_WIFI_RECONNECT_BACKOFF_MAX_MS;
   } else {
-    wifi_manager_request_state(wifi_manager, WIFI_MANAGER_STATE_AP); // #TODO make fail mode configurable
+    wifi_manager->backoff_exponent++;
+  }
+
+  const uint32_t half = delay_ms / 2;
+  return half + (half > 0 ? esp_random() % (half + 1) : 0);
+}
+
+static void schedule_reconnect(wifi_manager_t* const wifi_manager, const uint8_t reason) {
+  if (wifi_manager->retry_count >= CONFIG_WIFI_RETRIES) {
+    ESP_LOGW(TAG, "Giving up after %lu reconnect attempts", (unsigned long)wifi_manager->retry_count);
+    // #TODO make fail mode configurable
+    request_bus_try_post(wifi_manager->request_queue, WIFI_MANAGER_STATE_AP_REQUEST, NULL, NULL);
+    return;
+  }
+  wifi_manager->retry_count++;
+
+  switch (reconnect_policy(reason)) {
+    case RECONNECT_CREDENTIALS:
+      if (++wifi_manager->auth_failures > CONFIG_WIFI_AUTH_FAIL_RETRIES) {
+        ESP_LOGW(TAG, "Credentials rejected %u times, switching to AP", wifi_manager->auth_failures);
+        request_bus_try_post(wifi_manager->request_queue, WIFI_MANAGER_STATE_AP_REQUEST, NULL, NULL);
+        return;
+      }
+      break;
+    case RECONNECT_TRANSIENT:
+      if (wifi_manager->immediate_retries < CONFIG_WIFI_RECONNECT_IMMEDIATE_RETRIES) {
+        wifi_manager->immediate_retries++;
+        ESP_LOGI(TAG, "Sta disconnected. Reconnecting immediately");
+        if (esp_wifi_connect() == ESP_OK) return;
+      }
+      break;
+    case RECONNECT_NOT_FOUND:
+      break;
   }
+
+  const uint32_t delay_ms = next_backoff_ms(wifi_manager);
+  ESP_LOGI(TAG, "Sta disconnected. Retrying to connect in %lu ms", (unsigned long)delay_ms);
+  esp_timer_stop(wifi_manager->retry_timer);
+  esp_timer_start_once(wifi_manager->retry_timer, (uint64_t)delay_ms * 1000);
+}
+
+// A connection that cannot be made, e.g. to a mistyped SSID, leaves the provisioning AP and its clients up when it
+// is running, only without one is the radio turned off
+static void abandon_sta(wifi_manager_t* const wifi_manager) {
+  // The driver's mode rather than the state bits, which a transition bringing both interfaces up sets only after the
+  // STA has started
+  wifi_mode_t mode = WIFI_MODE_NULL;
+  const bool ap_up = esp_wifi_get_mode(&mode) == ESP_OK && (mode == WIFI_MODE_AP || mode == WIFI_MODE_APSTA);
+  request_bus_try_post(wifi_manager->request_queue,
+                       ap_up ? WIFI_MANAGER_STATE_AP_REQUEST : WIFI_MANAGER_STATE_NONE_REQUEST, NULL, NULL);
 }
 
 static void wifi_event_handler(void* arg, esp_event_base_t base, int32_t event_id, void* data) {
@@ -341,30 +769,49 @@ static void wifi_event_handler(void* arg, esp_event_base_t base, int32_t event_i
     switch (event_id) {
       case WIFI_EVENT_STA_START:
       {
+        if (FAST_RECONNECT_ENABLED && fast_connect_to_sta(manager) == ESP_OK) break;
+
         esp_err_t err = start_wifi_scan(manager);
         if (err != ESP_OK) {
           ESP_LOGE(TAG, "Scan init failed: %s", esp_err_to_name(err));
-          wifi_manager_request_state(manager, WIFI_MANAGER_STATE_NONE);
+          abandon_sta(manager);
         }
       }
       break;
       case WIFI_EVENT_SCAN_DONE:
       {
-        esp_err_t err = connect_to_sta(manager);
+        telemetry_record(TELEMETRY_WIFI_SCAN, esp_timer_get_time() - manager->scan_started_us);
+        if (manager->roam_scan) {
+          handle_roam_scan_done(manager);
+          break;
+        }
+
+        uint16_t matches = 0;
+        esp_err_t err = collect_scan_results(manager, NULL, &matches);
+        if (err == ESP_OK && manager->directed_scan) {
+          // Not on its learned channel any more, probe the same network on every channel before moving on
+          if (matches == 0 && manager->scan_channel != 0) {
+            manager->scan_channel = 0;
+          } else {
+            manager->scan_index++;
+            manager->scan_channel = SCAN_CHANNEL_UNSET;
+          }
+          if (start_next_directed_scan(manager) == ESP_OK) break;
+        }
+
+        if (err == ESP_OK) err = connect_to_sta(manager);
         if (err != ESP_OK) {
           ESP_LOGE(TAG, "Connect to failed: %s", esp_err_to_name(err));
-          wifi_manager_request_state(manager, WIFI_MANAGER_STATE_NONE);
+          abandon_sta(manager);
         }
       }
       break;
       case WIFI_EVENT_STA_DISCONNECTED:
         handle_sta_disconnected(manager, data);
         break;
+      // ignore cases, interfaces are only stopped by transition_to_state()
       case WIFI_EVENT_STA_STOP:
       case WIFI_EVENT_AP_STOP:
-        wifi_manager_request_state(manager, WIFI_MANAGER_STATE_NONE);
-        break;
-      // ignore cases
       case WIFI_EVENT_STA_CONNECTED:
       case WIFI_EVENT_HOME_CHANNEL_CHANGE:
         break;
@@ -379,7 +826,14 @@ static void handle_sta_ip_obtained(wifi_manager_t* const wifi_manager, ip_event_
   ESP_LOGI(TAG, "Got IP: " IPSTR, IP2STR(&event_data->ip_info.ip));
 
   wifi_manager->retry_count = 0;
+  wifi_manager->immediate_retries = 0;
+  wifi_manager->backoff_exponent = 0;
+  wifi_manager->auth_failures = 0;
+  wifi_manager->fast_connect_pending = false;
+  if (FAST_RECONNECT_ENABLED) store_connection_hint(wifi_manager);
+  start_roaming(wifi_manager);
   xEventGroupSetBits(wifi_manager->state_event_group, WIFI_MANAGER_STATE_STA_IP_RECEIVED);
+  publish_state(wifi_manager);
 }
 
 static void ip_event_handler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data) {
@@ -393,7 +847,26 @@ static void ip_event_handler(void* arg, esp_event_base_t event_base, int32_t eve
   }
 }
 
-static esp_err_t start_wifi_scan(wifi_manager_t const* const wifi_manager) {
+// With few configured networks each one gets its own directed probe, on the channel it was last seen on when
+// known, which also finds hidden networks. Otherwise a single full scan is cheaper than one scan per network.
+static esp_err_t start_wifi_scan(wifi_manager_t* const wifi_manager) {
+  const unit_configuration_t* config = unit_config_snapshot_get();
+  if (config == NULL) return ESP_ERR_INVALID_STATE;
+  const uint8_t network_count = config->con_config.wifi_settings_count;
+  unit_config_snapshot_put(config);
+
+  wifi_manager->network_found = false;
+  wifi_manager->best_rssi = INT8_MIN;
+  wifi_manager->sta_config.sta.bssid_set = false;
+  wifi_manager->sta_config.sta.channel = 0;
+  wifi_manager->scan_index = 0;
+  wifi_manager->scan_channel = SCAN_CHANNEL_UNSET;
+  wifi_manager->directed_scan = network_count > 0 && network_count <= CONFIG_WIFI_DIRECTED_SCAN_MAX_NETWORKS;
+
+  if (wifi_manager->directed_scan) {
+    return start_next_directed_scan(wifi_manager);
+  }
+
   ESP_LOGI(TAG, "Starting Wi-Fi scan");
   const wifi_scan_config_t scan_config = {
     .ssid = NULL,
@@ -404,6 +877,7 @@ static esp_err_t start_wifi_scan(wifi_manager_t const* const wifi_manager) {
     .scan_time = {.active = {.min = 1000, .max = 3000}}
   };
 
+  wifi_manager->scan_started_us = esp_timer_get_time();
   esp_err_t err = esp_wifi_scan_start(&scan_config, false);
   if (err != ESP_OK) {
     ESP_LOGE(TAG, "Scan failed: %s", esp_err_to_name(err));
@@ -411,72 +885,186 @@ static esp_err_t start_wifi_scan(wifi_manager_t const* const wifi_manager) {
   return err;
 }
 
-static esp_err_t transition_to_state(wifi_manager_t* manager, wifi_manager_state_t new_state) {
-  // Validate configurations
-  if (new_state == WIFI_MANAGER_STATE_STA && !manager->sta_config_set) return ESP_ERR_INVALID_STATE;
-  if (new_state == WIFI_MANAGER_STATE_AP && !manager->ap_config_set) return ESP_ERR_INVALID_STATE;
+// Starts the scan for the network at scan_index, ESP_ERR_NOT_FOUND once every network has been probed
+static esp_err_t start_next_directed_scan(wifi_manager_t* const wifi_manager) {
+  const unit_configuration_t* config = unit_config_snapshot_get();
+  if (config == NULL) return ESP_ERR_INVALID_STATE;
+  const connectivity_configuration_t* con_cfg = &config->con_config;
 
-  if (manager->sta_netif) {
-    esp_netif_destroy(manager->sta_netif);
-    manager->sta_netif = NULL;
+  while (wifi_manager->scan_index < con_cfg->wifi_settings_count &&
+    con_cfg->wifi_settings[wifi_manager->scan_index].ssid == NULL) {
+    wifi_manager->scan_index++;
   }
-  if (manager->ap_netif) {
-    esp_netif_destroy(manager->ap_netif);
-    manager->ap_netif = NULL;
+  if (wifi_manager->scan_index >= con_cfg->wifi_settings_count) {
+    unit_config_snapshot_put(config);
+    return ESP_ERR_NOT_FOUND;
   }
 
-  EventBits_t current_state = xEventGroupGetBits(manager->state_event_group);
-  esp_err_t err;
-  if (current_state != WIFI_MANAGER_STATE_NONE) {
-    if ((err = esp_wifi_stop()) != ESP_OK) return err;
+  strlcpy(wifi_manager->scan_ssid, con_cfg->wifi_settings[wifi_manager->scan_index].ssid,
+          sizeof(wifi_manager->scan_ssid));
+  unit_config_snapshot_put(config);
+
+  const connection_hint_t* hint = &wifi_manager->hint;
+  if (wifi_manager->scan_channel == SCAN_CHANNEL_UNSET) {
+    const bool learned = strncmp(hint->ssid, wifi_manager->scan_ssid, sizeof(hint->ssid)) == 0;
+    wifi_manager->scan_channel = learned ? hint->channel : 0;
   }
 
-  wifi_mode_t target_mode;
-  switch (new_state) {
-    case WIFI_MANAGER_STATE_NONE:
-      target_mode = WIFI_MODE_NULL;
-      break;
-    case WIFI_MANAGER_STATE_STA:
-      target_mode = WIFI_MODE_STA;
-      manager->sta_netif = esp_netif_create_default_wifi_sta();
-      break;
-    case WIFI_MANAGER_STATE_AP:
-      target_mode = WIFI_MODE_AP;
-      manager->ap_netif = esp_netif_create_default_wifi_ap();
-      break;
-    default:
-    {
-      if (new_state == (WIFI_MANAGER_STATE_STA | WIFI_MANAGER_STATE_AP)) {
-        target_mode = WIFI_MODE_APSTA;
-        manager->sta_netif = esp_netif_create_default_wifi_sta();
-        manager->ap_netif = esp_netif_create_default_wifi_ap();
-      } else {
-        return ESP_ERR_INVALID_ARG;
-      }
-    }
+  ESP_LOGI(TAG, "Starting directed scan for [%s] on channel %u", wifi_manager->scan_ssid, wifi_manager->scan_channel);
+  const wifi_scan_config_t scan_config = {
+    .ssid = (uint8_t*)wifi_manager->scan_ssid,
+    .bssid = NULL,
+    .channel = wifi_manager->scan_channel,
+    .scan_type = WIFI_SCAN_TYPE_ACTIVE,
+    .show_hidden = true,
+    .scan_time = {.active = {.min = DIRECTED_SCAN_MIN_MS, .max = DIRECTED_SCAN_MAX_MS}}
+  };
+
+  wifi_manager->scan_started_us = esp_timer_get_time();
+  esp_err_t err = esp_wifi_scan_start(&scan_config, false);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Directed scan failed: %s", esp_err_to_name(err));
+  }
+  return err;
+}
+
+// Low-duty scan of all channels for the configured networks while the current link stays up
+static esp_err_t start_roam_scan(wifi_manager_t* const wifi_manager) {
+  const wifi_scan_config_t scan_config = {
+    .ssid = NULL,
+    .bssid = NULL,
+    .channel = 0,
+    .scan_type = WIFI_SCAN_TYPE_ACTIVE,
+    .show_hidden = false,
+    .scan_time = {.active = {.min = ROAM_SCAN_MIN_MS, .max = ROAM_SCAN_MAX_MS}},
+    .home_chan_dwell_time = ROAM_SCAN_HOME_DWELL_MS
+  };
+
+  wifi_manager->roam_scan = true;
+  wifi_manager->scan_started_us = esp_timer_get_time();
+  esp_err_t err = esp_wifi_scan_start(&scan_config, false);
+  if (err != ESP_OK) {
+    wifi_manager->roam_scan = false;
+    ESP_LOGW(TAG, "Roaming scan failed: %s", esp_err_to_name(err));
+  }
+  return err;
+}
+
+// Switches to the strongest configured BSSID if it beats the current AP by the hysteresis margin
+static void handle_roam_scan_done(wifi_manager_t* const wifi_manager) {
+  wifi_manager->roam_scan = false;
+
+  wifi_ap_record_t ap_info;
+  if (esp_wifi_sta_get_ap_info(&ap_info) != ESP_OK) {
+    esp_wifi_clear_ap_list();
+    return;
+  }
+
+  // Scan results overwrite sta_config only for a better candidate, the current one is kept to restore it otherwise
+  const wifi_config_t current_config = wifi_manager->sta_config;
+  const int required_rssi = ap_info.rssi + ROAM_RSSI_HYSTERESIS - 1;
+  wifi_manager->best_rssi = required_rssi > INT8_MAX ? INT8_MAX : (int8_t)required_rssi;
+  wifi_manager->network_found = false;
+
+  uint16_t matches = 0;
+  if (collect_scan_results(wifi_manager, ap_info.bssid, &matches) != ESP_OK || !wifi_manager->network_found) {
+    ESP_LOGD(TAG, "No better AP among %u matches", matches);
+    wifi_manager->sta_config = current_config;
+    return;
+  }
+
+  wifi_sta_config_t* sta = &wifi_manager->sta_config.sta;
+  ESP_LOGI(TAG, "Roaming from " MACSTR " (%d dBm) to " MACSTR " (%d dBm) on channel %u", MAC2STR(ap_info.bssid),
+           ap_info.rssi, MAC2STR(sta->bssid), wifi_manager->best_rssi, sta->channel);
+  sta->bssid_set = true;
+
+  if (esp_wifi_set_config(ESP_IF_WIFI_STA, &wifi_manager->sta_config) != ESP_OK) {
+    wifi_manager->sta_config = current_config;
+    return;
   }
 
-  if (new_state != WIFI_MANAGER_STATE_NONE) {
-    if (current_state == WIFI_MANAGER_STATE_NONE) {
+  wifi_manager->roam_pending = true;
+  if (esp_wifi_disconnect() != ESP_OK) {
+    wifi_manager->roam_pending = false;
+  }
+}
+
+// Only the interface that changes is brought up or torn down, so the AP and its clients stay up while the STA is
+// added, removed or re-tried, and the other way around
+static esp_err_t transition_to_state(wifi_manager_t* manager, wifi_manager_state_t new_state) {
+  const bool want_sta = (new_state & WIFI_MANAGER_STATE_STA) != 0;
+  const bool want_ap = (new_state & WIFI_MANAGER_STATE_AP) != 0;
+
+  // Validate configurations
+  if (want_sta && !manager->sta_config_set) return ESP_ERR_INVALID_STATE;
+  if (want_ap && !manager->ap_config_set) return ESP_ERR_INVALID_STATE;
+
+  const EventBits_t current_state = xEventGroupGetBits(manager->state_event_group);
+  const bool running = (current_state & (WIFI_MANAGER_STATE_STA | WIFI_MANAGER_STATE_AP)) != 0;
+  const bool has_sta = (current_state & WIFI_MANAGER_STATE_STA) != 0;
+  const bool has_ap = (current_state & WIFI_MANAGER_STATE_AP) != 0;
+  esp_err_t err;
+
+  if (has_sta && !want_sta) {
+    manager->sta_stopping = true;
+    esp_timer_stop(manager->retry_timer);
+    stop_roaming(manager);
+    esp_wifi_disconnect();
+  } else if (want_sta && !has_sta) {
+    manager->sta_stopping = false;
+  }
+
+  if (!want_sta && !want_ap) {
+    if (running) {
+      if ((err = esp_wifi_stop()) != ESP_OK) return err;
+      if ((err = esp_wifi_deinit()) != ESP_OK) return err;
+    }
+  } else {
+    if (!running) {
       wifi_init_config_t cfg = WIFI_INIT_CONFIG_DEFAULT();
       if ((err = esp_wifi_init(&cfg)) != ESP_OK) return err;
     }
 
+    if (want_sta && manager->sta_netif == NULL) manager->sta_netif = esp_netif_create_default_wifi_sta();
+    if (want_ap && manager->ap_netif == NULL) manager->ap_netif = esp_netif_create_default_wifi_ap();
+
+    // Changing the mode of a started driver starts or stops just the affected interface
+    const wifi_mode_t target_mode = want_sta && want_ap ? WIFI_MODE_APSTA : want_sta ? WIFI_MODE_STA : WIFI_MODE_AP;
     if ((err = esp_wifi_set_mode(target_mode)) != ESP_OK) return err;
 
-    if (target_mode == WIFI_MODE_STA || target_mode == WIFI_MODE_APSTA)
+    if (want_sta && !has_sta)
       if ((err = esp_wifi_set_config(ESP_IF_WIFI_STA, &manager->sta_config)) != ESP_OK) return err;
-    if (target_mode == WIFI_MODE_AP || target_mode == WIFI_MODE_APSTA)
+    if (want_ap && !has_ap)
       if ((err = esp_wifi_set_config(ESP_IF_WIFI_AP, &manager->ap_config)) != ESP_OK) return err;
 
-    if ((err = esp_wifi_start()) != ESP_OK) return err;
-  } else {
-    if ((err = esp_wifi_deinit()) != ESP_OK) return err;
+    if (!running) {
+      if ((err = esp_wifi_start()) != ESP_OK) return err;
+    } else if (want_sta && has_sta) {
+      restart_sta_connection(manager);
+    }
+  }
+
+  if (!want_sta && manager->sta_netif) {
+    esp_netif_destroy_default_wifi(manager->sta_netif);
+    manager->sta_netif = NULL;
+  }
+  if (!want_ap && manager->ap_netif) {
+    esp_netif_destroy_default_wifi(manager->ap_netif);
+    manager->ap_netif = NULL;
   }
 
-  // Update state event group
+  // Update state event group, the IP is only kept while the STA interface is
+  EventBits_t clear_bits = WIFI_MANAGER_STATE_NONE | WIFI_MANAGER_STATE_STA | WIFI_MANAGER_STATE_AP;
+  if (!want_sta) clear_bits |= WIFI_MANAGER_STATE_STA_IP_RECEIVED;
+  xEventGroupClearBits(manager->state_event_group, clear_bits);
   xEventGroupSetBits(manager->state_event_group, new_state);
   ESP_LOGI(TAG, "Wi-Fi in state:  0x%X", new_state);
+  publish_state(manager);
 
   return ESP_OK;
 }
+
+static void publish_state(wifi_manager_t const* const manager) {
+  const status_wifi_state_t state = {.state = xEventGroupGetBits(manager->state_event_group)};
+  status_event_post(STATUS_EVENT_WIFI_STATE, &state, sizeof(state));
+}
@@ -0,0 +1,58 @@
+#!/usr/bin/env python3
+#
+# Copyright 2025 Johan van Zyl
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#     http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+
+"""Concatenate the input files into the output file, gzip-compressed when --gzip is given.
+
+Usage: web_asset.py [--gzip] OUTPUT INPUT [INPUT ...]
+
+The gzip header carries no file name or timestamp, so the output only changes when the inputs do.
+"""
+
+import gzip
+import os
+import sys
+
+
+def main(argv):
+    args = argv[1:]
+    compress = len(args) > 0 and args[0] == '--gzip'
+    if compress:
+        args = args[1:]
+
+    if len(args) < 2:
+        sys.stderr.write(__doc__)
+        return 1
+
+    output, inputs = args[0], args[1:]
+
+    data = bytearray()
+    for path in inputs:
+        with open(path, 'rb') as f:
+            data += f.read()
+
+    os.makedirs(os.path.dirname(os.path.abspath(output)), exist_ok=True)
+    with open(output, 'wb') as out:
+        if compress:
+            with gzip.GzipFile(filename='', mode='wb', compresslevel=9, fileobj=out, mtime=0) as gz:
+                gz.write(data)
+        else:
+            out.write(data)
+
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,47 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#include "alloc_count.h"
+
+static size_t alloc_count = 0;
+
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t count, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size);
+void* __wrap_calloc(size_t count, size_t size);
+void* __wrap_realloc(void* ptr, size_t size);
+
+size_t alloc_count_get() {
+  return alloc_count;
+}
+
+void* __wrap_malloc(const size_t size) {
+  alloc_count++;
+  return __real_malloc(size);
+}
+
+void* __wrap_calloc(const size_t count, const size_t size) {
+  alloc_count++;
+  return __real_calloc(count, size);
+}
+
+void* __wrap_realloc(void* ptr, const size_t size) {
+  alloc_count++;
+  return __real_realloc(ptr, size);
+}
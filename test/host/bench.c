@@ -0,0 +1,464 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Times the configuration section serialisers and readers and the DNS question parser on the host, in ns/op and
+// heap calls per op. Every case is checked once before it is timed, a wrong result fails the run.
+
+#include "alloc_count.h"
+#include "configuration.h"
+#include "deserialisation.h"
+#include "dns_message.h"
+#include "serialisation.h"
+
+#include <arpa/inet.h>
+#include <lwip/prot/dns.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MIN_NS 200000000LL // Each case is repeated until it has run this long
+#define BENCH_QUICK_MIN_NS 2000000LL // With --quick, as ctest runs it
+#define DNS_MAX_QUERY_LEN 512
+#define DNS_EDNS_OPT_LEN 11 // Root name, type, UDP payload size, extended RCODE and flags, empty RDATA
+#define DNS_RRTYPE_OPT 41
+
+static const uint8_t network_counts[] = {1, 8, 64, 255};
+
+// A configuration as it is stored in NVS, one buffer per section
+typedef struct
+{
+  uint8_t* con;
+  size_t con_size;
+  uint8_t** wifi;
+  size_t* wifi_size;
+  uint8_t* sys;
+  size_t sys_size;
+  uint8_t* usr;
+  size_t usr_size;
+  uint8_t wifi_count;
+} sections_t;
+
+typedef struct
+{
+  unit_configuration_t* config;
+  const config_section_reader_t* reader;
+  sections_t stored; // Input of every decode
+  sections_t scratch; // Refilled from stored before each decode, the readers decode in place like over an NVS read
+  wifi_settings_t* wifi_settings;
+  uint8_t* blob; // Legacy single blob, the concatenation of the positional sections after the version byte
+  size_t blob_size;
+} config_case_t;
+
+typedef struct
+{
+  char name[48];
+  uint8_t message[DNS_MAX_QUERY_LEN];
+  size_t len;
+  int expected; // -1 rejected, 0 parsed without an answer, 1 answered
+} dns_case_t;
+
+static long long min_ns = BENCH_MIN_NS;
+static volatile size_t sink; // Keeps the timed results alive
+
+static long long now_ns();
+static void bench(const char* name, void (*op)(void* arg), void* arg);
+static char* make_string(const char* prefix, unsigned index, size_t len);
+static unit_configuration_t* make_config(uint8_t networks);
+static void free_config(unit_configuration_t* config);
+static void alloc_sections(sections_t* sections, uint8_t wifi_count);
+static void free_sections(sections_t* sections);
+static void encode_tlv(const unit_configuration_t* config, sections_t* sections);
+static void encode_positional(const unit_configuration_t* config, sections_t* sections);
+static void encode_legacy_blob(config_case_t* c);
+static void copy_sections(const sections_t* from, sections_t* to);
+static bool same_string(const char* expected, uint8_t expected_len, const char* actual, uint8_t actual_len);
+static bool same_config(const unit_configuration_t* expected, const unit_configuration_t* actual);
+static bool decode_sections(config_case_t* c, unit_configuration_t* out);
+static void serialize_op(void* arg);
+static void decode_sections_op(void* arg);
+static void decode_legacy_op(void* arg);
+static void bench_configs();
+static size_t build_query(uint8_t* message, const char* name, uint16_t qtype, bool edns);
+static void add_dns_case(dns_case_t* c, const char* name, const char* qname, uint16_t qtype, bool edns, int expected);
+static void dns_parse_op(void* arg);
+static void bench_dns();
+
+static long long now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Doubles the iterations until a batch runs for min_ns, so the clock's resolution does not show in the result
+static void bench(const char* name, void (*op)(void* arg), void* arg) {
+  for (unsigned long long iterations = 1;; iterations *= 2) {
+    const size_t allocs_before = alloc_count_get();
+    const long long start = now_ns();
+    for (unsigned long long i = 0; i < iterations; i++) op(arg);
+    const long long elapsed = now_ns() - start;
+    const size_t allocs = alloc_count_get() - allocs_before;
+
+    if (elapsed >= min_ns) {
+      printf("%-44s %12.1f ns/op %8.2f allocs/op\n", name, (double)elapsed / iterations, (double)allocs / iterations);
+      return;
+    }
+  }
+}
+
+static char* make_string(const char* prefix, const unsigned index, const size_t len) {
+  char* str = malloc(len + 1);
+  const int written = snprintf(str, len + 1, "%s%03u", prefix, index);
+  for (size_t i = written < 0 ? 0 : (size_t)written; i < len; i++) str[i] = 'x';
+  str[len] = '\0';
+  return str;
+}
+
+static unit_configuration_t* make_config(const uint8_t networks) {
+  unit_configuration_t* config = calloc(1, sizeof(unit_configuration_t));
+  connectivity_configuration_t* con = &config->con_config;
+
+  config->configuration_version = CONFIGURATION_VERSION;
+  con->ota_url_len = 48;
+  con->ota_url = make_string("https://updates.example.com/firmware/unit-", 1, con->ota_url_len);
+  con->version_url_len = 47;
+  con->version_url = make_string("https://updates.example.com/version/unit-", 1, con->version_url_len);
+  con->wifi_settings_count = networks;
+  con->wifi_settings = calloc(networks, sizeof(wifi_settings_t));
+  for (unsigned i = 0; i < networks; i++) {
+    wifi_settings_t* settings = &con->wifi_settings[i];
+    settings->ssid_len = 16;
+    settings->ssid = make_string("network-", i, settings->ssid_len);
+    settings->password_len = 24;
+    settings->password = make_string("passphrase-", i, settings->password_len);
+  }
+  config->sys_config.log_level = ESP_LOG_INFO;
+  config->user_config.unit_name_len = 12;
+  config->user_config.unit_name = make_string("unit-", 1, config->user_config.unit_name_len);
+  return config;
+}
+
+static void free_config(unit_configuration_t* config) {
+  connectivity_configuration_t* con = &config->con_config;
+  for (unsigned i = 0; i < con->wifi_settings_count; i++) {
+    free(con->wifi_settings[i].ssid);
+    free(con->wifi_settings[i].password);
+  }
+  free(con->wifi_settings);
+  free(con->ota_url);
+  free(con->version_url);
+  free(config->user_config.unit_name);
+  free(config);
+}
+
+// Sized for the largest section of either layout, a section holds at most three strings of up to 255 bytes
+static void alloc_sections(sections_t* sections, const uint8_t wifi_count) {
+  const size_t max_section = 3 * (TLV_HEADER_SIZE + UINT8_MAX);
+  sections->wifi_count = wifi_count;
+  sections->con = malloc(max_section);
+  sections->sys = malloc(max_section);
+  sections->usr = malloc(max_section);
+  sections->wifi = calloc(wifi_count, sizeof(uint8_t*));
+  sections->wifi_size = calloc(wifi_count, sizeof(size_t));
+  for (unsigned i = 0; i < wifi_count; i++) sections->wifi[i] = malloc(max_section);
+}
+
+static void free_sections(sections_t* sections) {
+  for (unsigned i = 0; i < sections->wifi_count; i++) free(sections->wifi[i]);
+  free(sections->wifi);
+  free(sections->wifi_size);
+  free(sections->con);
+  free(sections->sys);
+  free(sections->usr);
+}
+
+static void encode_tlv(const unit_configuration_t* config, sections_t* sections) {
+  const connectivity_configuration_t* con = &config->con_config;
+  sections->con_size = serialize_connectivity_header(con, sections->con);
+  for (unsigned i = 0; i < con->wifi_settings_count; i++) {
+    sections->wifi_size[i] = serialize_wifi_settings(&con->wifi_settings[i], sections->wifi[i]);
+  }
+  sections->sys_size = serialize_system_settings_configuration(&config->sys_config, sections->sys);
+  sections->usr_size = serialize_user_configuration(&config->user_config, sections->usr);
+}
+
+// The layout of CONFIGURATION_VERSION_POSITIONAL, lengths first and then the strings, which are not terminated
+static void encode_positional(const unit_configuration_t* config, sections_t* sections) {
+  const connectivity_configuration_t* con = &config->con_config;
+  uint8_t* ptr = sections->con;
+  *ptr++ = con->wifi_settings_count;
+  *ptr++ = con->ota_url_len;
+  *ptr++ = con->version_url_len;
+  memcpy(ptr, con->ota_url, con->ota_url_len);
+  ptr += con->ota_url_len;
+  memcpy(ptr, con->version_url, con->version_url_len);
+  ptr += con->version_url_len;
+  sections->con_size = ptr - sections->con;
+
+  for (unsigned i = 0; i < con->wifi_settings_count; i++) {
+    const wifi_settings_t* settings = &con->wifi_settings[i];
+    ptr = sections->wifi[i];
+    *ptr++ = settings->ssid_len;
+    *ptr++ = settings->password_len;
+    memcpy(ptr, settings->ssid, settings->ssid_len);
+    ptr += settings->ssid_len;
+    memcpy(ptr, settings->password, settings->password_len);
+    ptr += settings->password_len;
+    sections->wifi_size[i] = ptr - sections->wifi[i];
+  }
+
+  memcpy(sections->sys, &config->sys_config.log_level, sizeof(esp_log_level_t));
+  sections->sys_size = sizeof(esp_log_level_t);
+
+  ptr = sections->usr;
+  *ptr++ = config->user_config.unit_name_len;
+  memcpy(ptr, config->user_config.unit_name, config->user_config.unit_name_len);
+  sections->usr_size = 1 + config->user_config.unit_name_len;
+}
+
+static void encode_legacy_blob(config_case_t* c) {
+  const sections_t* sections = &c->stored;
+  c->blob_size = 1 + sections->con_size + sections->sys_size + sections->usr_size;
+  for (unsigned i = 0; i < sections->wifi_count; i++) c->blob_size += sections->wifi_size[i];
+
+  uint8_t* ptr = c->blob = malloc(c->blob_size);
+  *ptr++ = CONFIGURATION_VERSION_POSITIONAL;
+  memcpy(ptr, sections->con, sections->con_size);
+  ptr += sections->con_size;
+  for (unsigned i = 0; i < sections->wifi_count; i++) {
+    memcpy(ptr, sections->wifi[i], sections->wifi_size[i]);
+    ptr += sections->wifi_size[i];
+  }
+  memcpy(ptr, sections->sys, sections->sys_size);
+  ptr += sections->sys_size;
+  memcpy(ptr, sections->usr, sections->usr_size);
+}
+
+static void copy_sections(const sections_t* from, sections_t* to) {
+  memcpy(to->con, from->con, from->con_size);
+  to->con_size = from->con_size;
+  for (unsigned i = 0; i < from->wifi_count; i++) {
+    memcpy(to->wifi[i], from->wifi[i], from->wifi_size[i]);
+    to->wifi_size[i] = from->wifi_size[i];
+  }
+  memcpy(to->sys, from->sys, from->sys_size);
+  to->sys_size = from->sys_size;
+  memcpy(to->usr, from->usr, from->usr_size);
+  to->usr_size = from->usr_size;
+}
+
+static bool same_string(const char* expected, const uint8_t expected_len, const char* actual, const uint8_t actual_len) {
+  if (expected_len != actual_len) return false;
+  if (expected_len == 0) return true;
+  return actual != NULL && memcmp(expected, actual, expected_len) == 0 && actual[actual_len] == '\0';
+}
+
+static bool same_config(const unit_configuration_t* expected, const unit_configuration_t* actual) {
+  const connectivity_configuration_t* a = &expected->con_config;
+  const connectivity_configuration_t* b = &actual->con_config;
+  if (a->wifi_settings_count != b->wifi_settings_count) return false;
+  if (!same_string(a->ota_url, a->ota_url_len, b->ota_url, b->ota_url_len)) return false;
+  if (!same_string(a->version_url, a->version_url_len, b->version_url, b->version_url_len)) return false;
+  for (unsigned i = 0; i < a->wifi_settings_count; i++) {
+    const wifi_settings_t* x = &a->wifi_settings[i];
+    const wifi_settings_t* y = &b->wifi_settings[i];
+    if (!same_string(x->ssid, x->ssid_len, y->ssid, y->ssid_len)) return false;
+    if (!same_string(x->password, x->password_len, y->password, y->password_len)) return false;
+  }
+  if (expected->sys_config.log_level != actual->sys_config.log_level) return false;
+  return same_string(expected->user_config.unit_name, expected->user_config.unit_name_len, actual->user_config.unit_name,
+                     actual->user_config.unit_name_len);
+}
+
+// As read_config_sections() decodes them: the header sizes the Wi-Fi settings array before any section is decoded
+static bool decode_sections(config_case_t* c, unit_configuration_t* out) {
+  sections_t* s = &c->scratch;
+  copy_sections(&c->stored, s);
+  memset(out, 0, sizeof(*out));
+
+  const uint8_t count = c->reader->wifi_settings_count(s->con, s->con_size);
+  if (count != s->wifi_count) return false;
+  memset(c->wifi_settings, 0, count * sizeof(wifi_settings_t));
+
+  bool ok = c->reader->connectivity_header(&out->con_config, s->con, s->con_size);
+  out->con_config.wifi_settings = c->wifi_settings;
+  for (unsigned i = 0; ok && i < count; i++) ok = c->reader->wifi_settings(&c->wifi_settings[i], s->wifi[i], s->wifi_size[i]);
+  ok = ok && c->reader->system_settings(&out->sys_config, s->sys, s->sys_size);
+  ok = ok && c->reader->user_configuration(&out->user_config, s->usr, s->usr_size);
+  return ok;
+}
+
+// As write_config_sections() encodes them, each section sized before it is written
+static void serialize_op(void* arg) {
+  config_case_t* c = arg;
+  const unit_configuration_t* config = c->config;
+  const connectivity_configuration_t* con = &config->con_config;
+  sections_t* s = &c->scratch;
+
+  size_t total = calculate_connectivity_header_size(con) + serialize_connectivity_header(con, s->con);
+  for (unsigned i = 0; i < con->wifi_settings_count; i++) {
+    total += calculate_wifi_settings_size(&con->wifi_settings[i]) + serialize_wifi_settings(&con->wifi_settings[i], s->wifi[i]);
+  }
+  total += calculate_system_settings_configuration_size(&config->sys_config) +
+    serialize_system_settings_configuration(&config->sys_config, s->sys);
+  total += calculate_user_configuration_size(&config->user_config) + serialize_user_configuration(&config->user_config, s->usr);
+  sink = total;
+}
+
+static void decode_sections_op(void* arg) {
+  config_case_t* c = arg;
+  unit_configuration_t out;
+  sink = decode_sections(c, &out);
+}
+
+static void decode_legacy_op(void* arg) {
+  config_case_t* c = arg;
+  unit_configuration_t out = {0};
+  sink = deserialize_unit_configuration(&out, c->blob, c->blob + c->blob_size) != NULL;
+  free(out.arena);
+}
+
+static void bench_configs() {
+  for (size_t n = 0; n < sizeof(network_counts) / sizeof(network_counts[0]); n++) {
+    const uint8_t networks = network_counts[n];
+    config_case_t tlv = {.config = make_config(networks), .reader = config_section_reader(CONFIGURATION_VERSION)};
+    config_case_t positional = {.config = tlv.config, .reader = config_section_reader(CONFIGURATION_VERSION_POSITIONAL)};
+    config_case_t* cases[] = {&tlv, &positional};
+    for (size_t i = 0; i < 2; i++) {
+      alloc_sections(&cases[i]->stored, networks);
+      alloc_sections(&cases[i]->scratch, networks);
+      cases[i]->wifi_settings = calloc(networks, sizeof(wifi_settings_t));
+    }
+    encode_tlv(tlv.config, &tlv.stored);
+    encode_positional(positional.config, &positional.stored);
+    encode_legacy_blob(&positional);
+
+    unit_configuration_t out = {0};
+    for (size_t i = 0; i < 2; i++) {
+      if (!decode_sections(cases[i], &out) || !same_config(tlv.config, &out)) {
+        fprintf(stderr, "%s sections with %u networks do not read back\n", i == 0 ? "TLV" : "Positional", networks);
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (deserialize_unit_configuration(&out, positional.blob, positional.blob + positional.blob_size) == NULL ||
+        !same_config(tlv.config, &out)) {
+      fprintf(stderr, "Legacy blob with %u networks does not read back\n", networks);
+      exit(EXIT_FAILURE);
+    }
+    free(out.arena);
+
+    char name[64];
+    snprintf(name, sizeof(name), "serialize TLV sections, %u networks", networks);
+    bench(name, serialize_op, &tlv);
+    snprintf(name, sizeof(name), "decode TLV sections, %u networks", networks);
+    bench(name, decode_sections_op, &tlv);
+    snprintf(name, sizeof(name), "decode positional sections, %u networks", networks);
+    bench(name, decode_sections_op, &positional);
+    snprintf(name, sizeof(name), "decode legacy blob, %u networks", networks);
+    bench(name, decode_legacy_op, &positional);
+
+    for (size_t i = 0; i < 2; i++) {
+      free_sections(&cases[i]->stored);
+      free_sections(&cases[i]->scratch);
+      free(cases[i]->wifi_settings);
+    }
+    free(positional.blob);
+    free_config(tlv.config);
+  }
+}
+
+// A standard query with the recursion desired flag, as stub resolvers send it
+static size_t build_query(uint8_t* message, const char* name, const uint16_t qtype, const bool edns) {
+  const dns_header hdr = {.id = htons(0x1234), .flags = htons(DNS_FLAG_RD), .qdcount = htons(1),
+                          .arcount = htons(edns ? 1 : 0)};
+  memcpy(message, &hdr, sizeof(hdr));
+  size_t pos = sizeof(hdr);
+
+  for (const char* label = name; *label != '\0';) {
+    const char* dot = strchr(label, '.');
+    const size_t len = dot != NULL ? (size_t)(dot - label) : strlen(label);
+    message[pos++] = (uint8_t)len;
+    memcpy(message + pos, label, len);
+    pos += len;
+    label += len + (dot != NULL ? 1 : 0);
+  }
+  message[pos++] = 0;
+
+  const dns_question question = {.qtype = htons(qtype), .qclass = htons(DNS_RRCLASS_IN)};
+  memcpy(message + pos, &question, sizeof(question));
+  pos += sizeof(question);
+
+  if (edns) {
+    const uint8_t opt[DNS_EDNS_OPT_LEN] = {0, 0, DNS_RRTYPE_OPT, 0x10, 0x00};
+    memcpy(message + pos, opt, sizeof(opt));
+    pos += sizeof(opt);
+  }
+  return pos;
+}
+
+static void add_dns_case(dns_case_t* c, const char* name, const char* qname, const uint16_t qtype, const bool edns,
+                         const int expected) {
+  snprintf(c->name, sizeof(c->name), "parse DNS question, %s", name);
+  c->len = build_query(c->message, qname, qtype, edns);
+  c->expected = expected;
+}
+
+static void dns_parse_op(void* arg) {
+  const dns_case_t* c = arg;
+  bool answer = false;
+  sink = dns_parse_question(c->message, c->len, &answer) + answer;
+}
+
+static void bench_dns() {
+  // Three 63 byte labels and one of 61, the longest name dns_qname_length accepts
+  char longest[DNS_MAX_QNAME_LEN - 1];
+  memset(longest, 'a', sizeof(longest) - 1);
+  longest[63] = longest[127] = longest[191] = '.';
+  longest[sizeof(longest) - 1] = '\0';
+
+  dns_case_t cases[7];
+  add_dns_case(&cases[0], "short name", "a.io", DNS_RRTYPE_A, false, 1);
+  add_dns_case(&cases[1], "typical name", "connectivitycheck.gstatic.com", DNS_RRTYPE_A, false, 1);
+  add_dns_case(&cases[2], "AAAA", "connectivitycheck.gstatic.com", DNS_RRTYPE_AAAA, false, 0);
+  add_dns_case(&cases[3], "EDNS", "connectivitycheck.gstatic.com", DNS_RRTYPE_A, true, 1);
+  add_dns_case(&cases[4], "longest name", longest, DNS_RRTYPE_A, false, 1);
+  add_dns_case(&cases[5], "compressed name", "captive.apple.com", DNS_RRTYPE_A, false, -1);
+  cases[5].message[sizeof(dns_header)] = 0xC0; // Pointer back to the header, not accepted in a question
+  add_dns_case(&cases[6], "truncated name", "connectivitycheck.gstatic.com", DNS_RRTYPE_A, false, -1);
+  cases[6].len = sizeof(dns_header) + 10;
+
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    bool answer = false;
+    const size_t end = dns_parse_question(cases[i].message, cases[i].len, &answer);
+    const int result = end == 0 ? -1 : answer;
+    if (result != cases[i].expected || end > cases[i].len) {
+      fprintf(stderr, "%s: parsed as %d, expected %d\n", cases[i].name, result, cases[i].expected);
+      exit(EXIT_FAILURE);
+    }
+    bench(cases[i].name, dns_parse_op, &cases[i]);
+  }
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "--quick") == 0) min_ns = BENCH_QUICK_MIN_NS;
+
+  bench_configs();
+  bench_dns();
+  return EXIT_SUCCESS;
+}
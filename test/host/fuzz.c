@@ -0,0 +1,158 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Fuzz entry point for the parsers that read untrusted bytes: the configuration section readers of both layouts,
+// the legacy blob deserialiser and the DNS question parser. The first input byte picks the target, the rest is the
+// section, blob or datagram, copied to an allocation of exactly its size so that a sanitiser sees any read past it.
+// Besides not crashing, a parser has to keep every decoded string inside its input and terminated.
+
+#include "configuration.h"
+#include "deserialisation.h"
+#include "dns_message.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef enum
+{
+  FUZZ_CONNECTIVITY_HEADER,
+  FUZZ_WIFI_SETTINGS,
+  FUZZ_SYSTEM_SETTINGS,
+  FUZZ_USER_CONFIGURATION,
+  FUZZ_SECTION_COUNT
+} fuzz_section_t;
+
+#define FUZZ_READERS 2 // Tag-length-value and positional
+#define FUZZ_LEGACY_BLOB (FUZZ_READERS * FUZZ_SECTION_COUNT)
+#define FUZZ_DNS_QUESTION (FUZZ_LEGACY_BLOB + 1)
+#define FUZZ_TARGET_COUNT (FUZZ_DNS_QUESTION + 1)
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+static void check(bool condition, const char* what);
+static void check_string(const char* str, uint8_t len, const uint8_t* base, size_t size);
+static void fuzz_section(const config_section_reader_t* reader, fuzz_section_t section, uint8_t* input, size_t size);
+static void fuzz_legacy_blob(const uint8_t* input, size_t size);
+static void fuzz_dns_question(const uint8_t* input, size_t size);
+
+static void check(const bool condition, const char* what) {
+  if (condition) return;
+  fprintf(stderr, "Fuzz check failed: %s\n", what);
+  abort();
+}
+
+// A string is NULL exactly when its length is 0, otherwise it and its terminator lie inside [base, base + size)
+static void check_string(const char* str, const uint8_t len, const uint8_t* base, const size_t size) {
+  if (str == NULL) {
+    check(len == 0, "NULL string with a length");
+    return;
+  }
+  check(len > 0, "string without a length");
+  const uint8_t* start = (const uint8_t*)str;
+  check(start >= base && (size_t)(start - base) + len < size, "string outside its input");
+  check(str[len] == '\0', "string not terminated");
+}
+
+static void fuzz_section(const config_section_reader_t* reader, const fuzz_section_t section, uint8_t* input,
+                         const size_t size) {
+  switch (section) {
+  case FUZZ_CONNECTIVITY_HEADER:
+  {
+    (void)reader->wifi_settings_count(input, size);
+    connectivity_configuration_t config = {0};
+    if (!reader->connectivity_header(&config, input, size)) return;
+    check(config.wifi_settings == NULL, "header allocated the Wi-Fi settings");
+    check_string(config.ota_url, config.ota_url_len, input, size);
+    check_string(config.version_url, config.version_url_len, input, size);
+  }
+  break;
+  case FUZZ_WIFI_SETTINGS:
+  {
+    wifi_settings_t settings = {0};
+    if (!reader->wifi_settings(&settings, input, size)) return;
+    check_string(settings.ssid, settings.ssid_len, input, size);
+    check_string(settings.password, settings.password_len, input, size);
+  }
+  break;
+  case FUZZ_SYSTEM_SETTINGS:
+  {
+    system_settings_configuration_t config = {0};
+    (void)reader->system_settings(&config, input, size);
+  }
+  break;
+  case FUZZ_USER_CONFIGURATION:
+  {
+    user_configuration_t config = {0};
+    if (!reader->user_configuration(&config, input, size)) return;
+    check_string(config.unit_name, config.unit_name_len, input, size);
+  }
+  break;
+  default: break;
+  }
+}
+
+// Decoded into its own arena, everything it points to has to lie inside that
+static void fuzz_legacy_blob(const uint8_t* input, const size_t size) {
+  unit_configuration_t config = {0};
+  if (deserialize_unit_configuration(&config, input, input + size) != NULL) {
+    const connectivity_configuration_t* con = &config.con_config;
+    const uint8_t* arena = config.arena;
+    check_string(con->ota_url, con->ota_url_len, arena, config.arena_size);
+    check_string(con->version_url, con->version_url_len, arena, config.arena_size);
+    for (unsigned i = 0; i < con->wifi_settings_count; i++) {
+      check_string(con->wifi_settings[i].ssid, con->wifi_settings[i].ssid_len, arena, config.arena_size);
+      check_string(con->wifi_settings[i].password, con->wifi_settings[i].password_len, arena, config.arena_size);
+    }
+    check_string(config.user_config.unit_name, config.user_config.unit_name_len, arena, config.arena_size);
+  }
+  free(config.arena);
+}
+
+static void fuzz_dns_question(const uint8_t* input, const size_t size) {
+  check(dns_qname_length(input, size) <= size, "QNAME longer than the datagram");
+
+  bool answer = false;
+  const size_t end = dns_parse_question(input, size, &answer);
+  check(end <= size, "question longer than the datagram");
+  check(end == 0 || end >= sizeof(dns_header) + sizeof(dns_question), "question shorter than its fixed fields");
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, const size_t size) {
+  if (size == 0) return 0;
+
+  const uint8_t target = data[0] % FUZZ_TARGET_COUNT;
+  const size_t input_size = size - 1;
+  // Never empty, a zero sized malloc may return NULL and the parsers are handed a section pointer
+  uint8_t* input = malloc(input_size > 0 ? input_size : 1);
+  if (input == NULL) return 0;
+  memcpy(input, data + 1, input_size);
+
+  if (target < FUZZ_LEGACY_BLOB) {
+    const uint8_t version = target / FUZZ_SECTION_COUNT == 0 ? CONFIGURATION_VERSION : CONFIGURATION_VERSION_POSITIONAL;
+    fuzz_section(config_section_reader(version), target % FUZZ_SECTION_COUNT, input, input_size);
+  } else if (target == FUZZ_LEGACY_BLOB) {
+    fuzz_legacy_blob(input, input_size);
+  } else {
+    fuzz_dns_question(input, input_size);
+  }
+
+  free(input);
+  return 0;
+}
@@ -0,0 +1,105 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+// Stand-alone driver for the fuzz entry point where libFuzzer is not available. Replays the inputs given as files,
+// e.g. a libFuzzer crash, or with --random runs generated inputs as a smoke test.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FUZZ_DEFAULT_RUNS 100000
+#define FUZZ_MAX_INPUT 600 // Past the largest section and DNS query the parsers accept
+#define FUZZ_SEED 0x9E3779B97F4A7C15ULL
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+static uint64_t next_random(uint64_t* state);
+static size_t generate_records(uint8_t* input, size_t size, uint64_t* state);
+static int replay_file(const char* path);
+
+// xorshift64, the same sequence on every run so that a failure reproduces
+static uint64_t next_random(uint64_t* state) {
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// A chain of tag-length-value records with small tags, so that the readers get past the first record. A final
+// length running past the end, or a positional length byte, is left in as it comes.
+static size_t generate_records(uint8_t* input, const size_t size, uint64_t* state) {
+  size_t pos = 0;
+  while (pos + 2 <= size) {
+    const size_t room = size - pos - 2;
+    const uint8_t len = (uint8_t)(next_random(state) % (room < 40 ? room + 2 : 40));
+    input[pos] = (uint8_t)(next_random(state) % 6);
+    input[pos + 1] = len;
+    pos += 2;
+    for (uint8_t i = 0; i < len && pos < size; i++) input[pos++] = (uint8_t)next_random(state);
+  }
+  return pos;
+}
+
+static int replay_file(const char* path) {
+  FILE* file = fopen(path, "rb");
+  if (file == NULL) {
+    fprintf(stderr, "Cannot open %s\n", path);
+    return EXIT_FAILURE;
+  }
+
+  uint8_t* data = NULL;
+  size_t size = 0;
+  uint8_t chunk[4096];
+  for (size_t read; (read = fread(chunk, 1, sizeof(chunk), file)) > 0;) {
+    data = realloc(data, size + read);
+    memcpy(data + size, chunk, read);
+    size += read;
+  }
+  fclose(file);
+
+  LLVMFuzzerTestOneInput(data, size);
+  free(data);
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1 && strcmp(argv[1], "--random") != 0) {
+    for (int i = 1; i < argc; i++) {
+      if (replay_file(argv[i]) != EXIT_SUCCESS) return EXIT_FAILURE;
+    }
+    printf("Replayed %d inputs\n", argc - 1);
+    return EXIT_SUCCESS;
+  }
+
+  const unsigned long runs = argc > 2 ? strtoul(argv[2], NULL, 10) : FUZZ_DEFAULT_RUNS;
+  uint64_t state = FUZZ_SEED;
+  uint8_t input[FUZZ_MAX_INPUT + 1];
+  for (unsigned long run = 0; run < runs; run++) {
+    const size_t size = 1 + next_random(&state) % FUZZ_MAX_INPUT;
+    input[0] = (uint8_t)run; // Cycles through the targets
+    if (run % 2 == 0) {
+      generate_records(input + 1, size - 1, &state);
+    } else {
+      for (size_t i = 1; i < size; i++) input[i] = (uint8_t)next_random(&state);
+    }
+    LLVMFuzzerTestOneInput(input, size);
+  }
+  printf("Ran %lu generated inputs\n", runs);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+/*
+ * Copyright 2025 Johan van Zyl
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+
+#ifndef LWIP_HDR_DEF_H
+#define LWIP_HDR_DEF_H
+
+#include <arpa/inet.h>
+
+// Host stand-in for the lwIP header, only the byte order macros the DNS parser uses
+#define PP_HTONS(x) htons(x)
+#define PP_NTOHS(x) ntohs(x)
+#define PP_HTONL(x) htonl(x)
+#define PP_NTOHL(x) ntohl(x)
+
+#endif // LWIP_HDR_DEF_H